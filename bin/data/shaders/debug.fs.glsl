@@ -0,0 +1,15 @@
+/**
+    debug.fs.glsl
+
+    Fragment shader for the batched physics debug lines.
+*/
+
+#version 400
+
+in vec4 v_Color;
+
+out vec4 out_Color;
+
+void main() {
+    out_Color = v_Color;
+}
@@ -0,0 +1,20 @@
+/**
+    debug.vs.glsl
+
+    Vertex shader for the batched physics debug lines, every vertex
+    carries its own color.
+*/
+
+#version 400
+layout(location=0) in vec3 vertices;
+layout(location=1) in vec4 colors;
+
+uniform mat4 proj;
+uniform mat4 view;
+
+out vec4 v_Color;
+
+void main() {
+    gl_Position = proj * view * vec4(vertices, 1.0);
+    v_Color = colors;
+}
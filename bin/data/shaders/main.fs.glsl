@@ -6,10 +6,10 @@
 
 #version 400
 
-uniform vec4 frag_Color;
+in vec4 v_Color;
 
 out vec4 out_Color;
 
 void main() {
-    out_Color = frag_Color;
-}
\ No newline at end of file
+    out_Color = v_Color;
+}
@@ -1,16 +1,26 @@
 /**
     main.vs.glsl
 
-    This is the vertex shader for my simple bullet physics example
+    This is the vertex shader for my simple bullet physics example. The
+    model matrix and color come from the per instance attributes so
+    every object can be drawn by one multi-draw call.
 */
 
 #version 400
 layout(location=0) in vec3 vertices;
+layout(location=1) in vec4 instanceModel0;
+layout(location=2) in vec4 instanceModel1;
+layout(location=3) in vec4 instanceModel2;
+layout(location=4) in vec4 instanceModel3;
+layout(location=5) in vec4 instanceColor;
 
 uniform mat4 proj;
 uniform mat4 view;
-uniform mat4 model;
+
+out vec4 v_Color;
 
 void main() {
+    mat4 model = mat4(instanceModel0, instanceModel1, instanceModel2, instanceModel3);
     gl_Position = proj * view * model * vec4(vertices, 1.0);
-}
\ No newline at end of file
+    v_Color = instanceColor;
+}
@@ -27,6 +27,40 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <map>
 #include <algorithm>
 #include <functional>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+#include <cstdlib>
+#include <cmath>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <iomanip>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <direct.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
 
 #include <SDL.h>
 #include <SDL_image.h>
@@ -34,6 +68,12 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 #include <btBulletDynamicsCommon.h>
+#include <BulletCollision/CollisionDispatch/btGhostObject.h>
+#include <BulletDynamics/Character/btKinematicCharacterController.h>
+#include <BulletCollision/CollisionShapes/btShapeHull.h>
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
 
 #define BIT(v) (1<<v)
 
@@ -44,6 +84,8 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define COL_EVERYTHING -1
 
 #define FIXED_FRAME_60 (1.0f / 60.0f)
+// Internal Bullet sub-steps per fixed frame, input is applied per sub-step
+#define PHYSICS_SUBSTEPS 1
 
 static std::string g_caption = "Bullet Physics Test";
 
@@ -55,22 +97,176 @@ static bool g_running = true;
 static SDL_Window* g_window = nullptr;
 static SDL_GLContext g_context = nullptr;
 
-static uint32_t g_preTime = 0;
-static uint32_t g_currTime = 0;
+// SDL_GetPerformanceCounter ticks
+static uint64_t g_preTime = 0;
+static uint64_t g_currTime = 0;
 static float g_delta = 0.0f;
 static float g_fixedTime = 0.0f;
+// Fixed updates run per frame at most, the rest is dropped after a hitch
+#define MAX_FIXED_UPDATES 4
+
+// Frame limiter, see the Frame Section. --fps-cap and --uncapped turn
+// vsync off.
+static bool g_vsync = true;
+static uint32_t g_frameCap = 0;
+
+// --offscreen renders into a framebuffer object with the window hidden,
+// --capture streams the frames to a directory or "|command", see the
+// Capture Section
+static bool g_offscreen = false;
+static std::string g_capturePath;
+// Quit after this many frames, 0 runs until closed
+static uint32_t g_maxFrames = 0;
 
 static SDL_Event g_event;
 
+static bool g_kinematicPlayer = false;
+static bool g_ccd = true;
+static int g_substeps = PHYSICS_SUBSTEPS;
+static std::string g_broadphase = "dbvt";
+static std::string g_modelPath;
+static std::string g_levelPath;
+static uint32_t g_terrainSize = 0;
+static bool g_streamWorld = false;
+// Set with --connect, the app renders a remote server's world
+static bool g_netClient = false;
+static std::string g_connectAddress;
+
 void app_init();
 void app_event(SDL_Event& e);
 void app_update(float delta);
 void app_fixedUpdate();
+void app_physicsTick(btScalar timeStep);
+void app_unloadBody(btRigidBody* body);
 void app_render();
 void app_release();
+void app_spawnObjects();
+
+double util_milliseconds(uint64_t start, uint64_t end);
+void memory_init();
+void frame_init(bool vsync, uint32_t cap);
+void frame_end(uint64_t frameStart, float delta);
+void frame_release();
+void capture_init(bool offscreen, std::string path);
+void capture_beginFrame();
+void capture_endFrame();
+void capture_release();
+
+int tool_convertTextures(int argc, char** argv);
+int tool_benchController(int argc, char** argv);
+int tool_benchFields(int argc, char** argv);
+int tool_benchTunneling(int argc, char** argv);
+int tool_benchLevel(int argc, char** argv);
+int tool_benchStreaming(int argc, char** argv);
+int tool_benchWorlds(int argc, char** argv);
+int tool_benchSpawn(int argc, char** argv);
+int tool_benchBroadphase(int argc, char** argv);
+int tool_server(int argc, char** argv);
 
 int main(int argc, char** argv) {
 
+	memory_init();
+
+	if (argc > 1 && std::string(argv[1]) == "--convert-textures") {
+		return tool_convertTextures(argc - 2, argv + 2);
+	}
+
+	if (argc > 1 && std::string(argv[1]) == "--bench-controller") {
+		return tool_benchController(argc - 2, argv + 2);
+	}
+
+	if (argc > 1 && std::string(argv[1]) == "--bench-fields") {
+		return tool_benchFields(argc - 2, argv + 2);
+	}
+
+	if (argc > 1 && std::string(argv[1]) == "--bench-tunneling") {
+		return tool_benchTunneling(argc - 2, argv + 2);
+	}
+
+	if (argc > 1 && std::string(argv[1]) == "--bench-level") {
+		return tool_benchLevel(argc - 2, argv + 2);
+	}
+
+	if (argc > 1 && std::string(argv[1]) == "--bench-streaming") {
+		return tool_benchStreaming(argc - 2, argv + 2);
+	}
+
+	if (argc > 1 && std::string(argv[1]) == "--bench-worlds") {
+		return tool_benchWorlds(argc - 2, argv + 2);
+	}
+
+	if (argc > 1 && std::string(argv[1]) == "--bench-spawn") {
+		return tool_benchSpawn(argc - 2, argv + 2);
+	}
+
+	if (argc > 1 && std::string(argv[1]) == "--bench-broadphase") {
+		return tool_benchBroadphase(argc - 2, argv + 2);
+	}
+
+	if (argc > 1 && std::string(argv[1]) == "--server") {
+		return tool_server(argc - 2, argv + 2);
+	}
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+
+		if (arg == "--kinematic-player") {
+			g_kinematicPlayer = true;
+		}
+		else if (arg == "--no-ccd") {
+			g_ccd = false;
+		}
+		else if (arg == "--connect" && i + 1 < argc) {
+			g_netClient = true;
+			g_connectAddress = argv[++i];
+		}
+		else if (arg == "--stream-world") {
+			g_streamWorld = true;
+		}
+		else if (arg == "--level" && i + 1 < argc) {
+			g_levelPath = argv[++i];
+		}
+		else if (arg == "--terrain" && i + 1 < argc) {
+			g_terrainSize = std::max(atoi(argv[++i]), 2);
+		}
+		else if (arg == "--model" && i + 1 < argc) {
+			g_modelPath = argv[++i];
+		}
+		else if (arg == "--substeps" && i + 1 < argc) {
+			g_substeps = std::max(atoi(argv[++i]), 1);
+		}
+		else if (arg == "--broadphase" && i + 1 < argc) {
+			g_broadphase = argv[++i];
+		}
+		else if (arg == "--vsync") {
+			g_vsync = true;
+			g_frameCap = 0;
+		}
+		else if (arg == "--fps-cap" && i + 1 < argc) {
+			g_vsync = false;
+			g_frameCap = std::max(atoi(argv[++i]), 1);
+		}
+		else if (arg == "--uncapped") {
+			g_vsync = false;
+			g_frameCap = 0;
+		}
+		else if (arg == "--offscreen") {
+			g_offscreen = true;
+		}
+		else if (arg == "--capture" && i + 1 < argc) {
+			g_capturePath = argv[++i];
+		}
+		else if (arg == "--frames" && i + 1 < argc) {
+			g_maxFrames = std::max(atoi(argv[++i]), 1);
+		}
+	}
+
+	// Nothing can wait for a hidden window's vsync
+	if (g_offscreen && g_vsync) {
+		g_vsync = false;
+		g_frameCap = 0;
+	}
+
 	SDL_Init(SDL_INIT_EVERYTHING);
 
 	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
@@ -83,7 +279,7 @@ int main(int argc, char** argv) {
 		SDL_WINDOWPOS_UNDEFINED,
 		g_width,
 		g_height,
-		SDL_WINDOW_OPENGL
+		SDL_WINDOW_OPENGL | (g_offscreen ? SDL_WINDOW_HIDDEN : 0)
 	);
 
 
@@ -91,14 +287,29 @@ int main(int argc, char** argv) {
 
 	glewInit();
 
+	uint64_t initStart = SDL_GetPerformanceCounter();
+
 	app_init();
 
-	g_preTime = SDL_GetTicks();
+	std::cout << "app_init: " << util_milliseconds(initStart, SDL_GetPerformanceCounter()) << " ms" << std::endl;
+
+	frame_init(g_vsync, g_frameCap);
+	capture_init(g_offscreen, g_capturePath);
+
+	g_preTime = SDL_GetPerformanceCounter();
+	uint32_t frames = 0;
 
 	while (g_running) {
 
-		g_currTime = SDL_GetTicks();
-		g_delta = (g_currTime - g_preTime) / 1000.0f;
+		g_currTime = SDL_GetPerformanceCounter();
+		g_delta = (float)(util_milliseconds(g_preTime, g_currTime) / 1000.0);
+
+		// Captured runs advance one fixed frame per rendered frame, so
+		// the same run gives the same images no matter how fast it renders
+		if (!g_capturePath.empty()) {
+			g_delta = FIXED_FRAME_60;
+		}
+
 		g_fixedTime += g_delta;
 		g_preTime = g_currTime;
 
@@ -112,20 +323,41 @@ int main(int argc, char** argv) {
 
 
 		app_update(g_delta);
-		
-		if (g_fixedTime >= FIXED_FRAME_60) {
+
+		uint32_t fixedUpdates = 0;
+
+		while (g_fixedTime >= FIXED_FRAME_60 && fixedUpdates < MAX_FIXED_UPDATES) {
 			app_fixedUpdate();
+			g_fixedTime -= FIXED_FRAME_60;
+			fixedUpdates++;
+		}
+
+		if (fixedUpdates == MAX_FIXED_UPDATES) {
+			g_fixedTime = std::min(g_fixedTime, FIXED_FRAME_60);
 		}
 
+		capture_beginFrame();
+
 		app_render();
 
-		if (g_fixedTime >= FIXED_FRAME_60) {
-			g_fixedTime = 0.0f;
+		capture_endFrame();
+
+		if (!g_offscreen) {
+			SDL_GL_SwapWindow(g_window);
 		}
 
-		SDL_GL_SwapWindow(g_window);
+		frame_end(g_currTime, g_delta);
+
+		frames++;
+
+		if (g_maxFrames > 0 && frames >= g_maxFrames) {
+			g_running = false;
+		}
 	}
 
+	capture_release();
+	frame_release();
+
 	app_release();
 
 	SDL_GL_DeleteContext(g_context);
@@ -137,1737 +369,9889 @@ int main(int argc, char** argv) {
 }
 
 /*
-	------------------ App Section --------------------------
+	------------------ Util Section --------------------------
 */
-struct Shader {
-	uint32_t id;
+bool util_readFile(std::string path, std::string& out) {
+	std::ifstream in(path, std::ios::in | std::ios::binary);
 
-	void init(GLenum type, std::string path) {
-		id = glCreateShader(type);
+	if (!in.is_open()) {
+		return false;
+	}
 
-		std::ifstream in(path);
+	in.seekg(0, std::ios::end);
+	out.resize((size_t)in.tellg());
+	in.seekg(0, std::ios::beg);
+	in.read(&out[0], out.size());
+	in.close();
 
-		std::stringstream ss;
-		std::string temp;
+	return true;
+}
 
-		while (std::getline(in, temp)) {
-			ss << temp << std::endl;
-		}
+bool util_writeFile(std::string path, const void* data, size_t size) {
+	std::ofstream out(path, std::ios::out | std::ios::binary);
 
-		in.close();
+	if (!out.is_open()) {
+		return false;
+	}
 
-		std::string src = ss.str();
+	out.write((const char*)data, size);
+	out.close();
 
-		const char* c_src = src.c_str();
-		std::cout << c_src << std::endl;
+	return true;
+}
 
-		//std::cout << c_src << std::endl;
+void util_makeDirectory(std::string path) {
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
 
-		glShaderSource(id, 1, &c_src, 0);
-		glCompileShader(id);
+// FNV-1a, used to key on-disk caches by their source data
+uint64_t util_hash(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+	const uint8_t* bytes = (const uint8_t*)data;
 
-		char log[1024];
-		int len;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
 
-		glGetShaderiv(id, GL_INFO_LOG_LENGTH, &len);
+	return hash;
+}
 
-		if (len > 0) {
-			glGetShaderInfoLog(id, len, 0, log);
-			std::cout << log << std::endl;
-		}
-	}
+uint64_t util_hash(const std::string& str, uint64_t hash = 14695981039346656037ULL) {
+	return util_hash(str.data(), str.size(), hash);
+}
 
-	void release() {
-		glDeleteShader(this->id);
+double util_milliseconds(uint64_t start, uint64_t end) {
+	return (double)(end - start) * 1000.0 / (double)SDL_GetPerformanceFrequency();
+}
+
+// Size and modification time, cheap to check against huge source files
+uint64_t util_fileStamp(std::string path) {
+	struct stat info;
+
+	if (stat(path.c_str(), &info) != 0) {
+		return 0;
 	}
 
-};
+	uint64_t size = (uint64_t)info.st_size;
+	uint64_t time = (uint64_t)info.st_mtime;
+	return util_hash(&time, sizeof(uint64_t), util_hash(&size, sizeof(uint64_t)));
+}
 
-struct Program {
-	uint32_t programID = 0;
-	// Shaders
-	std::vector<Shader*> shaders;
-	// Attributes
-	uint32_t attributeID = 0;
-	std::map<std::string, uint32_t> attributeMapping;
-	// Uniforms
-	std::map<std::string, uint32_t> uniformsMapping;
+// Copy on write mapping of a whole file. Pages are only read from disk
+// when touched, and writes (e.g. pointer fix ups) never reach the file.
+struct MappedFile {
+	uint8_t* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+
+	bool open(std::string path) {
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
 
-	// Program Section
-	void init() {
-		// Create Program and Uploading shaders
-		this->programID = glCreateProgram();
-		std::for_each(shaders.begin(), shaders.end(), [&](Shader* shader) {
-			glAttachShader(this->programID, shader->id);
-		});
-		glLinkProgram(this->programID);
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(file, &fileSize);
+		size = (size_t)fileSize.QuadPart;
 
-		int len;
-		char log[1024];
+		mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
 
-		glGetProgramiv(programID, GL_INFO_LOG_LENGTH, &len);
+		if (mapping != nullptr) {
+			data = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+		}
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
 
-		if (len > 0) {
-			glGetProgramInfoLog(programID, len, 0, log);
-			std::cout << log << std::endl;
+		if (fd < 0) {
+			return false;
 		}
 
-		// Setting Up Attributes
-		glGenVertexArrays(1, &this->attributeID);
-	}
+		struct stat info;
+		fstat(fd, &info);
+		size = (size_t)info.st_size;
 
-	void bind() {
-		glUseProgram(this->programID);
-	}
+		if (size > 0) {
+			void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			data = (view != MAP_FAILED) ? (uint8_t*)view : nullptr;
+		}
 
-	void unbind() {
-		glUseProgram(0);
-	}
+		::close(fd);
+#endif
 
-	void release() {
-		// Delete Vertex Array
-		glDeleteVertexArrays(1, &this->attributeID);
+		if (data == nullptr) {
+			this->close();
+			return false;
+		}
 
-		std::for_each(shaders.begin(), shaders.end(), [&](Shader* shader) {
-			glDetachShader(this->programID, shader->id);
-		});
+		return true;
 	}
 
-	// Shader
-	void addShader(Shader* shader) {
-		this->shaders.push_back(shader);
+	void close() {
+#ifdef _WIN32
+		if (data != nullptr) {
+			UnmapViewOfFile(data);
+		}
+		if (mapping != nullptr) {
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+		}
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data != nullptr) {
+			munmap(data, size);
+		}
+#endif
+		data = nullptr;
+		size = 0;
 	}
+};
 
-	// Uniform
-	void createUniform(std::string name) {
-		this->uniformsMapping[name] = glGetUniformLocation(this->programID, name.c_str());
-	}
+/*
+	------------------ Memory Section --------------------------
+*/
+enum MemoryCategory {
+	MEM_GENERAL = 0,
+	MEM_WORLD,
+	MEM_BODIES,
+	MEM_SHAPES,
+	MEM_SIMULATION,
+	MEM_GL_BUFFERS,
+	MEM_GL_TEXTURES,
+	MEM_COUNT
+};
 
-	void set1i(std::string name, int x) {
-		glUniform1i(this->uniformsMapping[name], x);
-	}
+static const char* memoryCategoryNames[MEM_COUNT] = {
+	"bullet general",
+	"bullet world",
+	"bullet bodies",
+	"bullet shapes",
+	"bullet step",
+	"gl buffers",
+	"gl textures"
+};
 
-	void set2i(std::string name, const glm::ivec2& v) {
-		glUniform2i(this->uniformsMapping[name], v.x, v.y);
-	}
+// Keeps the blocks handed to Bullet 16 byte aligned
+#define MEMORY_HEADER_SIZE 16
 
-	void set3i(std::string name, const glm::ivec3& v) {
-		glUniform3i(this->uniformsMapping[name], v.x, v.y, v.z);
-	}
+struct MemoryHeader {
+	uint64_t size;
+	uint32_t category;
+};
 
-	void set4i(std::string name, const glm::ivec4& v) {
-		glUniform4i(this->uniformsMapping[name], v.x, v.y, v.z, v.w);
-	}
+// Bytes in use and the most ever in use at once. Bullet allocates from
+// the streaming and batch threads too, so everything is atomic.
+struct MemoryCounter {
+	std::atomic<int64_t> current;
+	std::atomic<int64_t> peak;
+	std::atomic<uint64_t> allocations;
+};
 
-	void set1f(std::string name, float x) {
-		glUniform1f(this->uniformsMapping[name], x);
-	}
+struct MemoryStats {
+	MemoryCounter counters[MEM_COUNT];
 
-	void set2f(std::string name, const glm::vec2& v) {
-		glUniform2f(this->uniformsMapping[name], v.x, v.y);
-	}
+	void add(uint32_t category, int64_t size) {
+		MemoryCounter& counter = counters[category];
+		int64_t current = counter.current.fetch_add(size) + size;
+		int64_t peak = counter.peak.load();
 
-	void set3f(std::string name, const glm::vec3& v) {
-		glUniform3f(this->uniformsMapping[name], v.x, v.y, v.z);
-	}
+		while (current > peak && !counter.peak.compare_exchange_weak(peak, current)) {
+		}
 
-	void set4f(std::string name, const glm::vec4& v) {
-		glUniform4f(this->uniformsMapping[name], v.x, v.y, v.z, v.w);
+		counter.allocations++;
 	}
 
-	void setMat2(std::string name, const glm::mat2& m) {
-		glUniformMatrix2fv(this->uniformsMapping[name], 1, GL_FALSE, &m[0][0]);
+	void remove(uint32_t category, int64_t size) {
+		counters[category].current.fetch_sub(size);
 	}
 
-	void setMat3(std::string name, const glm::mat3& m) {
-		glUniformMatrix3fv(this->uniformsMapping[name], 1, GL_FALSE, &m[0][0]);
+	// For GL objects whose storage is replaced, e.g. glBufferData on an
+	// existing buffer
+	void resize(uint32_t category, int64_t oldSize, int64_t newSize) {
+		if (newSize > oldSize) {
+			this->add(category, newSize - oldSize);
+		}
+		else {
+			this->remove(category, oldSize - newSize);
+		}
 	}
 
-	void setMat4(std::string name, const glm::mat4& m) {
-		glUniformMatrix4fv(this->uniformsMapping[name], 1, GL_FALSE, &m[0][0]);
+	int64_t getCurrent(uint32_t category) {
+		return counters[category].current.load();
 	}
 
-	// Attribute
-	void setAttribute(std::string name, uint32_t id) {
-		this->attributeMapping[name] = id;
+	int64_t getPeak(uint32_t category) {
+		return counters[category].peak.load();
 	}
 
-	void enableAttribute(std::string name) {
-		glEnableVertexAttribArray(this->attributeMapping[name]);
-	}
+	int64_t getBulletCurrent() {
+		int64_t total = 0;
 
-	void disableAttribute(std::string name) {
-		glDisableVertexAttribArray(this->attributeMapping[name]);
+		for (uint32_t i = MEM_GENERAL; i <= MEM_SIMULATION; i++) {
+			total += this->getCurrent(i);
+		}
+		return total;
 	}
 
-	void pointerAttribute(
-		std::string name,
-		uint32_t size,
-		GLenum type) {
-		glVertexAttribPointer(
-			this->attributeMapping[name],
-			size,
-			type,
-			GL_FALSE,
-			0,
-			0
-		);
-	}
+	void print() {
+		std::cout << "---- Memory ----" << std::endl;
+		std::cout << std::fixed << std::setprecision(1);
 
-	void bindAttribute() {
-		glBindVertexArray(this->attributeID);
-	}
+		for (uint32_t i = 0; i < MEM_COUNT; i++) {
+			std::cout << std::left << std::setw(16) << memoryCategoryNames[i] << std::right
+				<< " " << std::setw(9) << (this->getCurrent(i) / 1024.0) << " KiB, peak "
+				<< std::setw(9) << (this->getPeak(i) / 1024.0) << " KiB, "
+				<< counters[i].allocations.load() << " allocations" << std::endl;
+		}
 
-	void unbindAttribute() {
-		glBindVertexArray(0);
+		std::cout << std::defaultfloat;
 	}
-
 };
 
-struct VertexBuffer {
-	uint32_t id = 0;
-	std::vector<float> list;
-	bool isStatic = true;
+static MemoryStats memoryStats;
 
-	void add(float x) {
-		list.push_back(x);
-	}
+// Category new Bullet allocations on this thread are counted under
+static thread_local uint32_t memory_category = MEM_GENERAL;
 
-	void add(float x, float y) {
-		list.push_back(x);
-		list.push_back(y);
-	}
+// Returns the previous category so callers can restore it
+uint32_t memory_setCategory(uint32_t category) {
+	uint32_t previous = memory_category;
+	memory_category = category;
+	return previous;
+}
 
-	void add(float x, float y, float z) {
-		list.push_back(x);
-		list.push_back(y);
-		list.push_back(z);
-	}
+// The category is stored in the block so frees are charged correctly
+// no matter which thread or scope releases it
+void* memory_bulletAlloc(size_t size) {
+	uint8_t* block = (uint8_t*)malloc(size + MEMORY_HEADER_SIZE);
 
-	void add(float x, float y, float z, float w) {
-		list.push_back(x);
-		list.push_back(y);
-		list.push_back(z);
-		list.push_back(w);
+	if (block == nullptr) {
+		return nullptr;
 	}
 
-	void clear() {
-		list.clear();
-	}
+	MemoryHeader* header = (MemoryHeader*)block;
+	header->size = size;
+	header->category = memory_category;
 
-	void init(bool isStatic = true) {
-		glGenBuffers(1, &this->id);
-		this->isStatic = isStatic;
-	}
+	memoryStats.add(header->category, (int64_t)size);
 
-	void upload() {
-		this->bind();
-		glBufferData(GL_ARRAY_BUFFER, this->size() * sizeof(float), list.data(), (this->isStatic) ? GL_STATIC_DRAW : GL_DYNAMIC_DRAW);
-		this->unbind();
-	}
+	return block + MEMORY_HEADER_SIZE;
+}
 
-	void bind() {
-		glBindBuffer(GL_ARRAY_BUFFER, id);
+void memory_bulletFree(void* ptr) {
+	if (ptr == nullptr) {
+		return;
 	}
 
-	void unbind() {
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-	}
+	MemoryHeader* header = (MemoryHeader*)((uint8_t*)ptr - MEMORY_HEADER_SIZE);
+	memoryStats.remove(header->category, (int64_t)header->size);
+	free(header);
+}
 
-	void release() {
-		this->clear();
-		glDeleteBuffers(1, &id);
-	}
+// Same scheme as Bullet's own fallback. Needed because builds with
+// BT_HAS_ALIGNED_ALLOCATOR (MSVC) never go through the unaligned hook.
+void* memory_bulletAlignedAlloc(size_t size, int alignment) {
+	uint8_t* real = (uint8_t*)memory_bulletAlloc(size + sizeof(void*) + (alignment - 1));
 
-	uint32_t size() {
-		return list.size();
+	if (real == nullptr) {
+		return nullptr;
 	}
-};
 
-struct IndexBuffer {
-	uint32_t id;
-	std::vector<uint32_t> list;
+	uintptr_t aligned = ((uintptr_t)(real + sizeof(void*)) + (alignment - 1)) & ~(uintptr_t)(alignment - 1);
+	((void**)aligned)[-1] = real;
 
-	void add(uint32_t x) {
-		list.push_back(x);
-	}
+	return (void*)aligned;
+}
 
-	void add(uint32_t x, uint32_t y) {
-		list.push_back(x);
-		list.push_back(y);
+void memory_bulletAlignedFree(void* ptr) {
+	if (ptr == nullptr) {
+		return;
 	}
 
-	void add(uint32_t x, uint32_t y, uint32_t z) {
-		list.push_back(x);
-		list.push_back(y);
-		list.push_back(z);
-	}
+	memory_bulletFree(((void**)ptr)[-1]);
+}
 
-	void add(uint32_t x, uint32_t y, uint32_t z, uint32_t w) {
-		list.push_back(x);
-		list.push_back(y);
-		list.push_back(z);
-		list.push_back(w);
-	}
+// Has to run before Bullet allocates anything
+void memory_init() {
+	btAlignedAllocSetCustom(memory_bulletAlloc, memory_bulletFree);
+	btAlignedAllocSetCustomAligned(memory_bulletAlignedAlloc, memory_bulletAlignedFree);
+}
 
-	void clear() {
-		list.clear();
-	}
+/*
+	------------------ Profiler Section --------------------------
+*/
+// GPU results are read PROFILER_GPU_FRAMES - 1 frames after they were
+// issued, and dropped if still not available, so reading never stalls.
+#define PROFILER_GPU_FRAMES 4
+#define PROFILER_PRINT_INTERVAL 1.0
+
+enum ProfileTimer {
+	PT_UPDATE = 0,
+	PT_FIXED_UPDATE,
+	PT_FORCE_FIELDS,
+	PT_RENDER_3D,
+	PT_RENDER_HUB,
+	PT_COUNT
+};
 
-	void init() {
-		glGenBuffers(1, &id);
-	}
+static const char* profileTimerNames[PT_COUNT] = {
+	"update",
+	"fixedUpdate",
+	"force fields",
+	"render 3D",
+	"render hub"
+};
 
-	void upload() {
-		bind();
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, list.size() * sizeof(uint32_t), list.data(), GL_DYNAMIC_DRAW);
-		unbind();
-	}
+static const bool profileTimerGPU[PT_COUNT] = {
+	false,
+	false,
+	false,
+	true,
+	true
+};
 
-	void bind() {
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
-	}
+struct ProfileScope {
+	uint64_t cpuStart = 0;
+	double cpuTotal = 0.0;
+	uint32_t cpuSamples = 0;
+	double gpuTotal = 0.0;
+	uint32_t gpuSamples = 0;
+	// GL_TIMESTAMP begin/end pair per frame in flight
+	uint32_t queries[PROFILER_GPU_FRAMES][2];
+	bool issued[PROFILER_GPU_FRAMES];
+};
 
-	void unbind() {
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-	}
+struct Profiler {
+	ProfileScope scopes[PT_COUNT];
+	std::map<std::string, double> counters;
 
-	void release() {
-		clear();
-		glDeleteBuffers(1, &id);
+	bool enabled = false;
+	bool gpuSupported = false;
+	uint32_t frame = 0;
+	uint32_t frames = 0;
+	uint64_t lastPrint = 0;
+
+	void init() {
+		gpuSupported = GLEW_ARB_timer_query != 0;
+
+		for (uint32_t i = 0; i < PT_COUNT; i++) {
+			if (gpuSupported && profileTimerGPU[i]) {
+				glGenQueries(PROFILER_GPU_FRAMES * 2, &scopes[i].queries[0][0]);
+			}
+			for (uint32_t f = 0; f < PROFILER_GPU_FRAMES; f++) {
+				scopes[i].issued[f] = false;
+			}
+		}
+
+		lastPrint = SDL_GetPerformanceCounter();
 	}
 
-	uint32_t size() {
-		return list.size();
+	void toggle() {
+		enabled = !enabled;
+		std::cout << "Stats: " << (enabled ? "ON" : "OFF") << std::endl;
 	}
 
-};
+	// Collects the GPU results of the frame whose queries are about to
+	// be reused.
+	void beginFrame() {
+		uint32_t slot = frame % PROFILER_GPU_FRAMES;
 
-struct IGeometry {
-	virtual void init() = 0;
-	virtual void render(Program& program) = 0;
-	virtual void release() = 0;
-};
+		for (uint32_t i = 0; i < PT_COUNT; i++) {
+			ProfileScope& scope = scopes[i];
 
-struct GeometryPlane : public IGeometry {
+			if (!scope.issued[slot]) {
+				continue;
+			}
 
-	VertexBuffer vertices;
-	IndexBuffer indincies;
+			scope.issued[slot] = false;
 
-	virtual void init() {
+			int available = 0;
+			glGetQueryObjectiv(scope.queries[slot][1], GL_QUERY_RESULT_AVAILABLE, &available);
 
-		// Vertices
-		this->vertices.init();
-		this->vertices.add(1.0f, 0.0f, -1.0f);
-		this->vertices.add(1.0f, 0.0f, 1.0f);
-		this->vertices.add(-1.0f, 0.0f, -1.0f);
-		this->vertices.add(-1.0f, 0.0f, 1.0f);
-		this->vertices.upload();
+			if (!available) {
+				continue;
+			}
 
-		// Indencies
-		this->indincies.init();
-		this->indincies.add(0, 1, 2);
-		this->indincies.add(2, 1, 3);
-		this->indincies.upload();
+			GLuint64 start = 0, end = 0;
+			glGetQueryObjectui64v(scope.queries[slot][0], GL_QUERY_RESULT, &start);
+			glGetQueryObjectui64v(scope.queries[slot][1], GL_QUERY_RESULT, &end);
+
+			scope.gpuTotal += (end - start) / 1000000.0;
+			scope.gpuSamples++;
+		}
 	}
 
-	virtual void render(Program& program) {
-		program.bindAttribute();
+	void endFrame() {
+		frame++;
+		frames++;
 
-		vertices.bind();
-		program.pointerAttribute("vertices", 3, GL_FLOAT);
-		vertices.unbind();
+		uint64_t now = SDL_GetPerformanceCounter();
 
+		if (util_milliseconds(lastPrint, now) >= PROFILER_PRINT_INTERVAL * 1000.0) {
+			if (enabled) {
+				this->print(util_milliseconds(lastPrint, now));
+			}
+			this->reset();
+			lastPrint = now;
+		}
+	}
 
-		indincies.bind();
-		glDrawElements(GL_TRIANGLES, indincies.size(), GL_UNSIGNED_INT, 0);
-		indincies.unbind();
+	void begin(ProfileTimer timer) {
+		ProfileScope& scope = scopes[timer];
+		scope.cpuStart = SDL_GetPerformanceCounter();
 
-		program.unbindAttribute();
+		if (gpuSupported && profileTimerGPU[timer]) {
+			glQueryCounter(scope.queries[frame % PROFILER_GPU_FRAMES][0], GL_TIMESTAMP);
+		}
 	}
 
-	virtual void release() {
-		indincies.release();
-		vertices.release();
-	}
+	void end(ProfileTimer timer) {
+		ProfileScope& scope = scopes[timer];
+		scope.cpuTotal += util_milliseconds(scope.cpuStart, SDL_GetPerformanceCounter());
+		scope.cpuSamples++;
 
-};
+		if (gpuSupported && profileTimerGPU[timer]) {
+			uint32_t slot = frame % PROFILER_GPU_FRAMES;
+			glQueryCounter(scope.queries[slot][1], GL_TIMESTAMP);
+			scope.issued[slot] = true;
+		}
+	}
 
-struct GeometryCube : public IGeometry {
-	VertexBuffer vertices;
-	IndexBuffer indincies;
+	void setCounter(std::string name, double value) {
+		counters[name] = value;
+	}
 
-	virtual void init() {
-		vertices.init();
+	void reset() {
+		for (uint32_t i = 0; i < PT_COUNT; i++) {
+			scopes[i].cpuTotal = 0.0;
+			scopes[i].cpuSamples = 0;
+			scopes[i].gpuTotal = 0.0;
+			scopes[i].gpuSamples = 0;
+		}
+		frames = 0;
+	}
 
-		// 0
-		vertices.add(-1.0f, 1.0f, -1.0f);
-		// 1
-		vertices.add(1.0f, 1.0f, -1.0f);
-		// 2
-		vertices.add(-1.0f, -1.0f, -1.0f);
-		// 3
-		vertices.add(1.0f, -1.0f, -1.0f);
-		// 4
-		vertices.add(-1.0f, 1.0f, 1.0f);
-		// 5
-		vertices.add(1.0f, 1.0f, 1.0f);
-		// 6
-		vertices.add(-1.0f, -1.0f, 1.0f);
-		// 7
-		vertices.add(1.0f, -1.0f, 1.0f);
+	void print(double elapsed) {
+		std::cout << "---- Stats (" << frames << " frames, " << std::fixed << std::setprecision(1)
+			<< (frames * 1000.0 / elapsed) << " fps) ----" << std::endl;
 
-		vertices.upload();
+		std::cout << std::setprecision(3);
 
+		for (uint32_t i = 0; i < PT_COUNT; i++) {
+			ProfileScope& scope = scopes[i];
 
-		indincies.init();
-		// left
-		indincies.add(0, 2, 4);
-		indincies.add(4, 2, 6);
-		// right
-		indincies.add(1, 3, 5);
-		indincies.add(5, 3, 7);
-		// top
-		indincies.add(0, 1, 4);
-		indincies.add(4, 1, 5);
-		// bottom
-		indincies.add(2, 3, 6);
-		indincies.add(6, 3, 7);
-		// front
-		indincies.add(4, 5, 6);
-		indincies.add(6, 5, 7);
-		// back
-		indincies.add(0, 1, 2);
-		indincies.add(2, 1, 3);
-		indincies.upload();
-	}
+			std::cout << std::left << std::setw(16) << profileTimerNames[i] << std::right
+				<< " cpu " << std::setw(8) << ((scope.cpuSamples > 0) ? scope.cpuTotal / scope.cpuSamples : 0.0) << " ms";
 
-	virtual void render(Program& program) {
-		program.bindAttribute();
+			if (profileTimerGPU[i]) {
+				if (scope.gpuSamples > 0) {
+					std::cout << "  gpu " << std::setw(8) << (scope.gpuTotal / scope.gpuSamples) << " ms";
+				}
+				else {
+					std::cout << "  gpu      n/a";
+				}
+			}
 
-		vertices.bind();
-		program.pointerAttribute("vertices", 3, GL_FLOAT);
-		vertices.unbind();
+			std::cout << std::endl;
+		}
 
-		indincies.bind();
-		glDrawElements(GL_TRIANGLES, indincies.size(), GL_UNSIGNED_INT, 0);
-		indincies.unbind();
+		std::for_each(counters.begin(), counters.end(), [&](std::pair<const std::string, double>& counter) {
+			std::cout << std::left << std::setw(16) << counter.first << std::right << " " << counter.second << std::endl;
+		});
 
-		program.unbindAttribute();
+		std::cout << std::defaultfloat;
 	}
 
-	virtual void release() {
-		indincies.release();
-		vertices.release();
+	void release() {
+		for (uint32_t i = 0; i < PT_COUNT; i++) {
+			if (gpuSupported && profileTimerGPU[i]) {
+				glDeleteQueries(PROFILER_GPU_FRAMES * 2, &scopes[i].queries[0][0]);
+			}
+		}
 	}
-
 };
 
-struct GeometrySphere {
+/*
+	------------------ Frame Section --------------------------
+*/
+enum FrameLimit {
+	FL_VSYNC = 0,
+	FL_CAP,
+	FL_UNCAPPED
+};
 
-	VertexBuffer vertices;
-	IndexBuffer indincies;
+static const char* frameLimitNames[] = {
+	"vsync",
+	"cap",
+	"uncapped"
+};
 
-	virtual void init() {
+// The last stretch of a capped frame is spun, SDL_Delay can oversleep
+// by about a millisecond
+#define FRAME_SPIN_MARGIN 2.0
+// Frame time histogram, 0.05 ms buckets up to 100 ms
+#define FRAME_BUCKET_MS 0.05
+#define FRAME_BUCKETS 2000
+
+// Frame times without storing every sample, so percentiles can be taken
+// over a whole run
+struct FrameHistogram {
+	uint32_t buckets[FRAME_BUCKETS];
+	uint32_t count;
+	double total;
+	double jitterTotal;
+	double max;
+
+	void reset() {
+		memset(buckets, 0, sizeof(buckets));
+		count = 0;
+		total = 0.0;
+		jitterTotal = 0.0;
+		max = 0.0;
+	}
 
-		int count = 32;
+	// jitter is how much this frame differs from the previous one
+	void add(double ms, double jitter) {
+		uint32_t bucket = std::min((uint32_t)(ms / FRAME_BUCKET_MS), (uint32_t)FRAME_BUCKETS - 1);
+		buckets[bucket]++;
+		count++;
+		total += ms;
+		jitterTotal += jitter;
+		max = std::max(max, ms);
+	}
 
-		float PI = 3.14159f;
-		float p = 1.0f;
-		float slice = 360.0f / (float)count;
-		float slice2 = 180.0f / (float)(count / 2);
+	double getMean() {
+		return (count > 0) ? total / count : 0.0;
+	}
 
-		vertices.init();
+	double getJitter() {
+		return (count > 0) ? jitterTotal / count : 0.0;
+	}
 
-		for (float phi = 0.0f; phi <= 180.0f; phi += slice2) {
-			for (float pheta = 0.0f; pheta < 360.0f; pheta += slice) {
-				float rphi = glm::radians(phi);
-				float rpheta = glm::radians(pheta);
+	// Upper edge of the bucket holding the percentile
+	double getPercentile(double percentile) {
+		uint32_t target = (uint32_t)ceil(count * percentile);
+		uint32_t seen = 0;
 
-				float x = p * sin(rphi) * cos(rpheta);
-				float y = p * sin(rphi) * sin(rpheta);
-				float z = p * cos(rphi);
+		for (uint32_t i = 0; i < FRAME_BUCKETS; i++) {
+			seen += buckets[i];
 
-				vertices.add(x, y, z);
+			if (seen >= target && seen > 0) {
+				return std::min((i + 1) * FRAME_BUCKET_MS, max);
 			}
 		}
-		vertices.upload();
 
-		indincies.init();
-		for (int y = 0; y < count / 2; y++) {
-			for (int x = 0; x < count; x++) {
-				int p0 = y * count + x;
-				int p1 = y * count + (x + 1);
-				int p2 = (y + 1) * count + x;
-				int p3 = (y + 1) * count + (x + 1);
+		return max;
+	}
+};
 
-				indincies.add(p0, p1, p2);
-				indincies.add(p2, p1, p3);
+// Vsync lets the driver block in SDL_GL_SwapWindow. A cap sleeps most of
+// the remaining frame and spins the rest, which costs some CPU for an
+// even frame rate. Uncapped renders as fast as possible.
+struct FramePacer {
+	FrameLimit limit = FrameLimit::FL_VSYNC;
+	double targetMs = 0.0;
+
+	FrameHistogram window;
+	FrameHistogram run;
+	double lastFrameMs = 0.0;
+	uint64_t windowStart = 0;
+
+	double sleepMs = 0.0;
+	double spinMs = 0.0;
+
+	// Results of the last finished window
+	double meanMs = 0.0;
+	double p99Ms = 0.0;
+	double jitterMs = 0.0;
+	double maxMs = 0.0;
+	double sleepAverage = 0.0;
+	double spinAverage = 0.0;
+
+	void init(bool vsync, uint32_t cap) {
+		if (vsync) {
+			limit = FrameLimit::FL_VSYNC;
+
+			if (SDL_GL_SetSwapInterval(1) != 0) {
+				std::cout << "Frame: vsync not supported, capping at 60 fps" << std::endl;
+				limit = FrameLimit::FL_CAP;
+				cap = 60;
 			}
 		}
-		indincies.upload();
-
-	}
+		else {
+			limit = (cap > 0) ? FrameLimit::FL_CAP : FrameLimit::FL_UNCAPPED;
+		}
 
-	virtual void render(Program& program) {
-		program.bindAttribute();
+		if (limit != FrameLimit::FL_VSYNC) {
+			SDL_GL_SetSwapInterval(0);
+		}
 
-		vertices.bind();
-		program.pointerAttribute("vertices", 3, GL_FLOAT);
-		vertices.unbind();
+		targetMs = (limit == FrameLimit::FL_CAP) ? 1000.0 / cap : 0.0;
 
-		indincies.bind();
-		glDrawElements(GL_TRIANGLES, indincies.size(), GL_UNSIGNED_INT, 0);
-		indincies.unbind();
+		window.reset();
+		run.reset();
+		windowStart = SDL_GetPerformanceCounter();
 
-		program.unbindAttribute();
+		std::cout << "Frame: " << frameLimitNames[limit];
+		if (limit == FrameLimit::FL_CAP) {
+			std::cout << " " << cap << " fps";
+		}
+		std::cout << std::endl;
 	}
 
-	virtual void release() {
-		indincies.release();
-		vertices.release();
-	}
+	// delta is the whole last frame, including its wait
+	void end(uint64_t frameStart, float delta) {
+		double ms = delta * 1000.0;
+		double jitter = (run.count > 0) ? fabs(ms - lastFrameMs) : 0.0;
+		lastFrameMs = ms;
 
-};
+		window.add(ms, jitter);
+		run.add(ms, jitter);
 
-struct GeometryQuad : public IGeometry {
+		if (limit == FrameLimit::FL_CAP) {
+			this->wait(frameStart);
+		}
 
-	VertexBuffer vertices;
-	VertexBuffer texCoords;
-	IndexBuffer index;
+		uint64_t now = SDL_GetPerformanceCounter();
 
-	virtual void init() {
-		vertices.init();
-		vertices.add(-1.0f, 1.0f, 0.0f);
-		vertices.add(1.0f, 1.0f, 0.0f);
-		vertices.add(-1.0f, -1.0f, 0.0f);
-		vertices.add(1.0f, -1.0f, 0.0f);
-		vertices.upload();
-
-		texCoords.init();
-		texCoords.add(0.0f, 0.0f);
-		texCoords.add(1.0f, 0.0f);
-		texCoords.add(0.0f, 1.0f);
-		texCoords.add(1.0f, 1.0f);
-		texCoords.upload();
-
-		index.init();
-		index.add(0, 1, 2);
-		index.add(2, 1, 3);
-		index.upload();
+		if (util_milliseconds(windowStart, now) >= PROFILER_PRINT_INTERVAL * 1000.0) {
+			meanMs = window.getMean();
+			p99Ms = window.getPercentile(0.99);
+			jitterMs = window.getJitter();
+			maxMs = window.max;
+			sleepAverage = (window.count > 0) ? sleepMs / window.count : 0.0;
+			spinAverage = (window.count > 0) ? spinMs / window.count : 0.0;
+
+			window.reset();
+			sleepMs = 0.0;
+			spinMs = 0.0;
+			windowStart = now;
+		}
 	}
 
-	virtual void render(Program& program) {
-		program.bindAttribute();
+	void wait(uint64_t frameStart) {
+		uint64_t now = SDL_GetPerformanceCounter();
+		double remaining = targetMs - util_milliseconds(frameStart, now);
 
-		vertices.bind();
-		program.pointerAttribute("vertices", 3, GL_FLOAT);
-		vertices.unbind();
+		if (remaining > FRAME_SPIN_MARGIN) {
+			SDL_Delay((uint32_t)(remaining - FRAME_SPIN_MARGIN));
 
-		texCoords.bind();
-		program.pointerAttribute("texCoords", 2, GL_FLOAT);
-		texCoords.unbind();
+			uint64_t woke = SDL_GetPerformanceCounter();
+			sleepMs += util_milliseconds(now, woke);
+			now = woke;
+		}
 
-		index.bind();
-		glDrawElements(GL_TRIANGLES, index.size(), GL_UNSIGNED_INT, 0);
-		index.unbind();
+		uint64_t spinStart = now;
 
-		program.unbindAttribute();
+		while (util_milliseconds(frameStart, now) < targetMs) {
+			now = SDL_GetPerformanceCounter();
+		}
+
+		spinMs += util_milliseconds(spinStart, now);
 	}
-	
-	virtual void release() {
-		index.release();
-		texCoords.release();
-		vertices.release();
+
+	void print() {
+		std::cout << "Frame: " << run.count << " frames, mean " << std::fixed << std::setprecision(2)
+			<< run.getMean() << " ms, p99 " << run.getPercentile(0.99) << " ms, max "
+			<< run.max << " ms, jitter " << run.getJitter() << " ms" << std::defaultfloat << std::endl;
 	}
+};
+
+static FramePacer framePacer;
+
+void frame_init(bool vsync, uint32_t cap) {
+	framePacer.init(vsync, cap);
+}
+
+void frame_end(uint64_t frameStart, float delta) {
+	framePacer.end(frameStart, delta);
+}
+
+void frame_release() {
+	framePacer.print();
+}
 
+/*
+	------------------ Capture Section --------------------------
+*/
+// glReadPixels goes into one of these in turn, a buffer is only mapped
+// again CAPTURE_PBO_COUNT - 1 frames later when the copy is long done
+#define CAPTURE_PBO_COUNT 3
+// Frames mapped but not yet written by the writer thread. When all are
+// in use the render thread waits, so no frame is ever dropped.
+#define CAPTURE_QUEUE_FRAMES 8
+
+#ifdef _WIN32
+#define capture_popen _popen
+#define capture_pclose _pclose
+#else
+#define capture_popen popen
+#define capture_pclose pclose
+#endif
+
+struct CaptureFrame {
+	std::vector<uint8_t> pixels;
+	uint32_t index;
 };
 
-struct Texture2D {
-	uint32_t id = 0;
+// Renders into an FBO instead of the window's back buffer. The FBO is
+// blitted to the window unless it is hidden. With a capture target the
+// FBO is read back through rotating pixel buffer objects and a writer
+// thread stores the frames, either as numbered .ppm files in a directory
+// or as raw top-down RGBA piped into a command (e.g. ffmpeg).
+struct FrameCapture {
+	bool offscreen = false;
+	bool capturing = false;
 	uint32_t width = 0;
 	uint32_t height = 0;
 
-	void init(std::string path) {
-		SDL_Surface* surf = IMG_Load(path.c_str());
-
-		if (surf == nullptr) {
-			std::cout << path << "doesn't exist..." << std::endl;
+	uint32_t framebuffer = 0;
+	uint32_t colorBuffer = 0;
+	uint32_t depthBuffer = 0;
+
+	uint32_t pbos[CAPTURE_PBO_COUNT];
+	GLsync fences[CAPTURE_PBO_COUNT];
+	uint32_t pboIndex = 0;
+	uint32_t frameIndex = 0;
+
+	std::string directory;
+	FILE* pipe = nullptr;
+
+	CaptureFrame frames[CAPTURE_QUEUE_FRAMES];
+	std::vector<CaptureFrame*> freeFrames;
+	std::deque<CaptureFrame*> writeQueue;
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool running = false;
+
+	// Stats
+	uint32_t written = 0;
+	uint32_t waits = 0;
+	uint64_t bytesWritten = 0;
+	uint64_t start = 0;
+
+	void init(bool offscreen, std::string path, uint32_t width, uint32_t height) {
+		this->offscreen = offscreen;
+		this->capturing = !path.empty();
+		this->width = width;
+		this->height = height;
+
+		if (!offscreen && !capturing) {
 			return;
 		}
 
-		width = surf->w;
-		height = surf->h;
+		glGenFramebuffers(1, &framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
 
-		if (id == 0) {
-			glGenTextures(1, &this->id);
+		glGenRenderbuffers(1, &colorBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+
+		glGenRenderbuffers(1, &depthBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			std::cout << "Capture: framebuffer incomplete" << std::endl;
 		}
 
-		uint32_t type = GL_RGB;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-		if (surf->format->BytesPerPixel == 4) {
-			type = GL_RGBA;
+		memoryStats.add(MEM_GL_TEXTURES, (int64_t)width * height * 8);
+
+		if (capturing) {
+			this->initCapture(path);
 		}
 
-		glBindTexture(GL_TEXTURE_2D, id);
+		std::cout << "Capture: " << (offscreen ? "offscreen " : "") << width << "x" << height;
+		if (capturing) {
+			std::cout << " to " << path;
+		}
+		std::cout << std::endl;
+	}
 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	void initCapture(std::string path) {
+		if (path[0] == '|') {
+			pipe = capture_popen(path.substr(1).c_str(), "wb");
 
-		glTexImage2D(GL_TEXTURE_2D, 0, type, this->width, this->height, 0, type, GL_UNSIGNED_BYTE, surf->pixels);
+			if (pipe == nullptr) {
+				std::cout << "Capture: couldn't start " << path.substr(1) << std::endl;
+				capturing = false;
+				return;
+			}
+		}
+		else {
+			directory = path;
+			util_makeDirectory(directory);
+		}
 
-		glBindTexture(GL_TEXTURE_2D, 0);
+		uint32_t size = width * height * 4;
 
-		SDL_FreeSurface(surf);
+		glGenBuffers(CAPTURE_PBO_COUNT, pbos);
 
+		for (uint32_t i = 0; i < CAPTURE_PBO_COUNT; i++) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, size, 0, GL_STREAM_READ);
+			fences[i] = 0;
+		}
 
-	}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 
-	void bind(uint32_t texture = GL_TEXTURE0) {
-		glActiveTexture(texture);
-		glBindTexture(GL_TEXTURE_2D, id);
-	}
+		memoryStats.add(MEM_GL_BUFFERS, (int64_t)size * CAPTURE_PBO_COUNT);
 
-	void unbind(uint32_t texture = GL_TEXTURE0) {
-		glActiveTexture(texture);
-		glBindTexture(GL_TEXTURE_2D, 0);
+		for (uint32_t i = 0; i < CAPTURE_QUEUE_FRAMES; i++) {
+			frames[i].pixels.resize(size);
+			freeFrames.push_back(&frames[i]);
+		}
+
+		running = true;
+		writer = std::thread([&]() { this->work(); });
+
+		start = SDL_GetPerformanceCounter();
 	}
 
-	void release() {
-		glDeleteTextures(1, &this->id);
+	void beginFrame() {
+		if (framebuffer != 0) {
+			glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		}
 	}
 
-};
+	void endFrame() {
+		if (framebuffer == 0) {
+			return;
+		}
 
-struct PhysicsObject {
-	btRigidBody* body;
-	int group;
-	int mask;
-};
+		if (capturing) {
+			// The oldest read is collected before its buffer is reused
+			if (fences[pboIndex] != 0) {
+				this->collect(pboIndex);
+			}
 
-struct Physics {
-	btBroadphaseInterface* broadphase;
-	btCollisionDispatcher* disp;
-	btConstraintSolver* solver;
-	btDefaultCollisionConfiguration* collisionConf;
-	btDiscreteDynamicsWorld* dynamicWorld;
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+			glReadBuffer(GL_COLOR_ATTACHMENT0);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[pboIndex]);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 
-	std::vector<PhysicsObject> physicsObjects;
+			fences[pboIndex] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			pboIndex = (pboIndex + 1) % CAPTURE_PBO_COUNT;
+		}
 
-	void init() {
-		this->collisionConf = new btDefaultCollisionConfiguration();
-		this->disp = new btCollisionDispatcher(this->collisionConf);
-		this->broadphase = new btDbvtBroadphase();
-		this->solver = new btSequentialImpulseConstraintSolver;
-		this->dynamicWorld = new btDiscreteDynamicsWorld(
-			disp,
-			broadphase,
-			this->solver,
-			this->collisionConf
-		);
+		if (!offscreen) {
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+			glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		}
 
-		dynamicWorld->setGravity(btVector3(0, -10, 0));
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	}
 
-	btDiscreteDynamicsWorld* getWorld() { return this->dynamicWorld; }
+	// Maps a finished read and hands a copy to the writer thread
+	void collect(uint32_t index) {
+		glClientWaitSync(fences[index], GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+		glDeleteSync(fences[index]);
+		fences[index] = 0;
 
-	void stepSimulation() {
-		this->getWorld()->stepSimulation(FIXED_FRAME_60);
-	}
+		CaptureFrame* frame = nullptr;
 
-	btBoxShape* createBoxShape(const btVector3& halfExtents) {
-		btBoxShape* box = new btBoxShape(halfExtents);
-		return box;
-	}
+		{
+			std::unique_lock<std::mutex> lock(mutex);
 
-	btSphereShape* createSphereShape(btScalar scalar) {
-		btSphereShape* sphere = new btSphereShape(scalar);
-		return sphere;
-	}
+			if (freeFrames.empty()) {
+				waits++;
+				cond.wait(lock, [&]() { return !freeFrames.empty(); });
+			}
 
-	btStaticPlaneShape* createStaticPlaneShape(const btVector3& planeNormal, btScalar planeConstant) {
+			frame = freeFrames.back();
+			freeFrames.pop_back();
+		}
 
-		btStaticPlaneShape* plane = new btStaticPlaneShape(planeNormal, planeConstant);
-		return plane;
-	}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[index]);
+		void* src = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frame->pixels.size(), GL_MAP_READ_BIT);
 
-	btCapsuleShape* createCapsuleShape(btScalar radius, btScalar height) {
-		btCapsuleShape* capsule = new btCapsuleShape(radius, height);
-		return capsule;
-	}
+		if (src != nullptr) {
+			memcpy(frame->pixels.data(), src, frame->pixels.size());
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
 
-	btRigidBody* createRigid(float mass, const btTransform& startTransform, btCollisionShape* shape) {
-		bool isDynamic = (mass != 0.f);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 
-		btVector3 localInertial(0, 0, 0);
+		frame->index = frameIndex++;
 
-		if (isDynamic) {
-			shape->calculateLocalInertia(mass, localInertial);
-		}
-
-		btDefaultMotionState* ms = new btDefaultMotionState(startTransform);
+		std::unique_lock<std::mutex> lock(mutex);
+		writeQueue.push_back(frame);
+		cond.notify_all();
+	}
 
-		btRigidBody::btRigidBodyConstructionInfo cinfo(mass, ms, shape, localInertial);
+	void work() {
+		std::vector<uint8_t> row(width * 3);
 
-		btRigidBody* body = new btRigidBody(cinfo);
+		while (true) {
+			CaptureFrame* frame = nullptr;
 
-		body->setUserIndex(-1);
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cond.wait(lock, [&]() { return !writeQueue.empty() || !running; });
 
-		PhysicsObject po = {
-			body,
-			-1,
-			-1
-		};
+				if (writeQueue.empty()) {
+					return;
+				}
 
-		physicsObjects.push_back(po);
+				frame = writeQueue.front();
+				writeQueue.pop_front();
+			}
 
-		this->getWorld()->addRigidBody(po.body);
-		//this->rigidBodies.push_back(body);
+			this->write(*frame, row);
 
-		return body;
+			std::unique_lock<std::mutex> lock(mutex);
+			freeFrames.push_back(frame);
+			cond.notify_all();
+		}
 	}
 
-	btRigidBody* createRigid(float mass, const btTransform& startTransform, btCollisionShape* shape, int collisionFilterGroup, int mask) {
-		bool isDynamic = (mass != 0.f);
+	// GL rows start at the bottom, both outputs are written top down
+	void write(CaptureFrame& frame, std::vector<uint8_t>& row) {
+		uint32_t stride = width * 4;
 
-		btVector3 localInertial(0, 0, 0);
+		if (pipe != nullptr) {
+			for (uint32_t y = 0; y < height; y++) {
+				fwrite(frame.pixels.data() + (height - 1 - y) * stride, 1, stride, pipe);
+			}
 
-		if (isDynamic) {
-			shape->calculateLocalInertia(mass, localInertial);
+			bytesWritten += (uint64_t)stride * height;
+			written++;
+			return;
 		}
 
-		btDefaultMotionState* ms = new btDefaultMotionState(startTransform);
+		char name[32];
+		snprintf(name, sizeof(name), "/frame_%06u.ppm", frame.index);
 
-		btRigidBody::btRigidBodyConstructionInfo cinfo(mass, ms, shape, localInertial);
+		FILE* file = fopen((directory + name).c_str(), "wb");
 
-		btRigidBody* body = new btRigidBody(cinfo);
+		if (file == nullptr) {
+			return;
+		}
 
-		//body->setUserIndex(-1);
-		PhysicsObject po = {
-			body,
-			collisionFilterGroup,
-			mask
-		};
+		fprintf(file, "P6\n%u %u\n255\n", width, height);
 
-		physicsObjects.push_back(po);
+		for (uint32_t y = 0; y < height; y++) {
+			const uint8_t* src = frame.pixels.data() + (height - 1 - y) * stride;
 
-		this->getWorld()->addRigidBody(body,collisionFilterGroup, mask);
+			for (uint32_t x = 0; x < width; x++) {
+				row[x * 3 + 0] = src[x * 4 + 0];
+				row[x * 3 + 1] = src[x * 4 + 1];
+				row[x * 3 + 2] = src[x * 4 + 2];
+			}
 
-		return body;
+			fwrite(row.data(), 1, row.size(), file);
+		}
+
+		bytesWritten += (uint64_t)row.size() * height;
+		fclose(file);
+		written++;
 	}
 
-	void removeRigidBody(btRigidBody* body) {
-		int i = 0;
-		for (; i < physicsObjects.size(); i++) {
-			if (body == physicsObjects[i].body) {
-				break;
+	void release() {
+		if (capturing) {
+			// Reads still in flight, oldest first
+			for (uint32_t i = 0; i < CAPTURE_PBO_COUNT; i++) {
+				uint32_t index = (pboIndex + i) % CAPTURE_PBO_COUNT;
+
+				if (fences[index] != 0) {
+					this->collect(index);
+				}
 			}
-		}
 
-		physicsObjects.erase(physicsObjects.begin() + i);
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				running = false;
+				cond.notify_all();
+			}
 
-		getWorld()->removeRigidBody(body);
-		btMotionState* ms = body->getMotionState();
-		delete body;
-		delete ms;
-	}
+			writer.join();
 
-	void release() {
-		delete this->dynamicWorld;
-		delete this->solver;
-		delete this->broadphase;
-		delete this->disp;
-		delete this->collisionConf;
-	}
+			if (pipe != nullptr) {
+				capture_pclose(pipe);
+				pipe = nullptr;
+			}
 
-	void getRigidBodiesFromAABB(const btVector3& minAABB, const btVector3& maxAABB, std::vector<btRigidBody*>& rigidBodies, int mask) {
+			double seconds = util_milliseconds(start, SDL_GetPerformanceCounter()) / 1000.0;
 
-		std::function<bool(const btVector3&, const btVector3&, const btVector3&)> pointInAABB = [](const btVector3& minAABB, const btVector3& maxAABB, const btVector3& point) {
+			std::cout << "Capture: " << written << " frames, " << std::fixed << std::setprecision(1)
+				<< (bytesWritten / (1024.0 * 1024.0)) << " MiB, " << (written / seconds) << " frames/s, "
+				<< waits << " waits on the writer" << std::defaultfloat << std::endl;
 
-			return 
-				minAABB.x() <= point.x() &&
-				minAABB.y() <= point.y() &&
-				minAABB.z() <= point.z() &&
-				maxAABB.x() >= point.x() &&
-				maxAABB.y() >= point.y() &&
-				maxAABB.z() >= point.z();
-		};
+			glDeleteBuffers(CAPTURE_PBO_COUNT, pbos);
+			memoryStats.remove(MEM_GL_BUFFERS, (int64_t)width * height * 4 * CAPTURE_PBO_COUNT);
+
+			freeFrames.clear();
+			capturing = false;
+		}
 
-		//std::cout << physicsObjects.size() << std::endl;
+		if (framebuffer != 0) {
+			glDeleteRenderbuffers(1, &depthBuffer);
+			glDeleteRenderbuffers(1, &colorBuffer);
+			glDeleteFramebuffers(1, &framebuffer);
+			framebuffer = 0;
 
-		for (int i = 0; i < physicsObjects.size(); i++) {
-			if (physicsObjects[i].group == mask) {
-				btVector3 point = physicsObjects[i].body->getCenterOfMassPosition();
-				if (pointInAABB(minAABB, maxAABB, point)) {
-					rigidBodies.push_back(physicsObjects[i].body);
-				}
-			}
+			memoryStats.remove(MEM_GL_TEXTURES, (int64_t)width * height * 8);
 		}
 	}
 };
 
-struct Camera {
-	glm::vec3 pos;
-	glm::vec2 rot;
+static FrameCapture frameCapture;
 
-	float fov;
-	float aspect;
-	float znear;
-	float zfar;
+void capture_init(bool offscreen, std::string path) {
+	frameCapture.init(offscreen, path, g_width, g_height);
+}
 
-	float speed = 64.0f;
-	float walkSpeed = 32.0f;
+void capture_beginFrame() {
+	frameCapture.beginFrame();
+}
 
-	void init(
-		glm::vec3 pos,
-		glm::vec2 rot,
-		float fov,
-		float aspect,
-		float znear,
-		float zfar) {
-		this->pos = pos;
-		this->rot = rot;
-		this->fov = fov;
-		this->aspect = aspect;
-		this->znear = znear;
-		this->zfar = zfar;
+void capture_endFrame() {
+	frameCapture.endFrame();
+}
 
-		SDL_SetRelativeMouseMode(SDL_TRUE);
-	}
+void capture_release() {
+	frameCapture.release();
+}
 
-	void update(float delta) {
-		int x = 0, y = 0;
-		uint32_t buttons = SDL_GetRelativeMouseState(&x, &y);
-		const uint8_t* keys = SDL_GetKeyboardState(nullptr);
+/*
+	------------------ App Section --------------------------
+*/
+#define PROGRAM_CACHE_DIR "data/cache/"
+#define PROGRAM_CACHE_MAGIC 0x42505243 // CRPB
+#define PROGRAM_CACHE_VERSION 1
 
-		rot.x += this->speed * y * ((delta - 0.001f < 0) ? 0.001f : delta);
-		rot.y += this->speed * x * ((delta - 0.001f < 0) ? 0.001f : delta);
+struct Shader {
+	uint32_t id = 0;
+	GLenum type;
+	std::string path;
+	std::string source;
 
-		if (rot.y <= -360.0f) {
-			rot.y += 360.0f;
-		}
+	// Only reads the source, compile() is deferred to Program::init
+	// so a cached program binary can skip compilation entirely.
+	void init(GLenum type, std::string path) {
+		this->type = type;
+		this->path = path;
 
-		if (rot.y >= 360.0f) {
-			rot.y -= 360.0f;
+		if (!util_readFile(path, this->source)) {
+			std::cout << path << " doesn't exist..." << std::endl;
 		}
+	}
 
-		if (rot.x < -90.0f) {
-			rot.x = -90.0f;
-		}
+	void compile() {
+		id = glCreateShader(type);
 
-		if (rot.x > 90.0f) {
-			rot.x = 90.0f;
-		}
+		const char* c_src = this->source.c_str();
 
-		float yrad = glm::radians(rot.y);
+		glShaderSource(id, 1, &c_src, 0);
+		glCompileShader(id);
 
-		float sp = this->walkSpeed;
+		char log[1024];
+		int len;
 
-		if (keys[SDL_SCANCODE_E]) {
-			sp *= 3.0f;
-		}
+		glGetShaderiv(id, GL_INFO_LOG_LENGTH, &len);
 
-		if (keys[SDL_SCANCODE_W]) {
-			pos.x += sp * glm::sin(yrad) * delta;
-			pos.z -= sp * glm::cos(yrad) * delta;
+		if (len > 0) {
+			glGetShaderInfoLog(id, len, 0, log);
+			std::cout << log << std::endl;
 		}
+	}
 
-		if (keys[SDL_SCANCODE_S]) {
-			pos.x -= sp * glm::sin(yrad) * delta;
-			pos.z += sp * glm::cos(yrad) * delta;
+	void release() {
+		if (this->id != 0) {
+			glDeleteShader(this->id);
 		}
+	}
 
-		if (keys[SDL_SCANCODE_A]) {
-			pos.x -= sp * glm::cos(yrad) * delta;
-			pos.z -= sp * glm::sin(yrad) * delta;
-		}
+};
 
-		if (keys[SDL_SCANCODE_D]) {
-			pos.x += sp * glm::cos(yrad) * delta;
-			pos.z += sp * glm::sin(yrad) * delta;
-		}
+struct ProgramCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t sourceHash;
+	uint64_t driverHash;
+	uint32_t format;
+	uint32_t length;
+};
 
-		if (keys[SDL_SCANCODE_LSHIFT]) {
-			pos.y -= sp * delta;
-		}
+struct Program {
+	uint32_t programID = 0;
+	// Shaders
+	std::vector<Shader*> shaders;
+	// Attributes
+	uint32_t attributeID = 0;
+	std::map<std::string, uint32_t> attributeMapping;
+	// Uniforms
+	std::map<std::string, uint32_t> uniformsMapping;
 
-		if (keys[SDL_SCANCODE_SPACE]) {
-			pos.y += sp * delta;
+	// Program Section
+	void init() {
+		uint64_t start = SDL_GetPerformanceCounter();
+
+		this->programID = glCreateProgram();
+
+		bool cached = this->loadBinary();
+
+		if (!cached) {
+			// Create Program and Uploading shaders
+			std::for_each(shaders.begin(), shaders.end(), [&](Shader* shader) {
+				shader->compile();
+				glAttachShader(this->programID, shader->id);
+			});
+			glProgramParameteri(this->programID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+			glLinkProgram(this->programID);
+
+			int len;
+			char log[1024];
+
+			glGetProgramiv(programID, GL_INFO_LOG_LENGTH, &len);
+
+			if (len > 0) {
+				glGetProgramInfoLog(programID, len, 0, log);
+				std::cout << log << std::endl;
+			}
+
+			int status = GL_FALSE;
+			glGetProgramiv(programID, GL_LINK_STATUS, &status);
+
+			// Never cache a broken program, and drop a stale entry so the
+			// next launch compiles again too
+			if (status == GL_TRUE) {
+				this->saveBinary();
+			}
+			else {
+				std::remove((PROGRAM_CACHE_DIR + this->getCacheName() + ".bin").c_str());
+			}
 		}
+
+		std::cout << "Program " << this->getCacheName() << ": " 
+			<< (cached ? "binary cache hit" : "compiled") << " in " 
+			<< util_milliseconds(start, SDL_GetPerformanceCounter()) << " ms" << std::endl;
+
+		// Setting Up Attributes
+		glGenVertexArrays(1, &this->attributeID);
 	}
 
-	glm::mat4 getProjection() {
-		return glm::perspective(
-			glm::radians(this->fov),
-			aspect,
-			znear,
-			zfar);
+	// Program Binary Cache
+	uint64_t getSourceHash() {
+		uint64_t hash = util_hash(std::string());
+		std::for_each(shaders.begin(), shaders.end(), [&](Shader* shader) {
+			hash = util_hash(&shader->type, sizeof(shader->type), hash);
+			hash = util_hash(shader->source, hash);
+		});
+		return hash;
 	}
 
-	glm::mat4 getView() {
-		return
-			glm::rotate(glm::mat4(1.0f), glm::radians(this->rot.x), glm::vec3(1.0f, 0.0f, 0.0f)) *
-			glm::rotate(glm::mat4(1.0f), glm::radians(this->rot.y), glm::vec3(0.0f, 1.0f, 0.0f)) *
-			glm::translate(glm::mat4(1.0f), -this->pos);
+	uint64_t getDriverHash() {
+		std::string driver;
+		driver += (const char*)glGetString(GL_VENDOR);
+		driver += (const char*)glGetString(GL_RENDERER);
+		driver += (const char*)glGetString(GL_VERSION);
+		return util_hash(driver);
 	}
-};
 
-struct DebugLine {
-	VertexBuffer buffer;
+	std::string getCacheName() {
+		std::stringstream ss;
+		ss << std::hex << this->getSourceHash();
+		return ss.str();
+	}
 
-	glm::vec3 from;
-	glm::vec3 to;
+	bool isBinarySupported() {
+		int formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		return GLEW_ARB_get_program_binary && formats > 0;
+	}
 
-	GeometrySphere sphere;
+	bool loadBinary() {
+		if (!this->isBinarySupported()) {
+			return false;
+		}
 
-	void init() {
-		buffer.init(true);
+		std::string data;
 
-		sphere.init();
-	}
+		if (!util_readFile(PROGRAM_CACHE_DIR + this->getCacheName() + ".bin", data) ||
+			data.size() < sizeof(ProgramCacheHeader)) {
+			return false;
+		}
 
-	void render(Program& program) {
-		if (buffer.size() > 0) {
-			glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, 0.0f));
+		ProgramCacheHeader header;
+		memcpy(&header, data.data(), sizeof(ProgramCacheHeader));
 
-			program.setMat4("model", model);
-			program.set4f("frag_Color", glm::vec4(1.0f, 0.0f, 1.0f, 1.0f));
+		if (header.magic != PROGRAM_CACHE_MAGIC ||
+			header.version != PROGRAM_CACHE_VERSION ||
+			header.sourceHash != this->getSourceHash() ||
+			header.driverHash != this->getDriverHash() ||
+			header.length != data.size() - sizeof(ProgramCacheHeader)) {
+			return false;
+		}
 
-			program.bindAttribute();
+		glProgramBinary(this->programID, header.format, data.data() + sizeof(ProgramCacheHeader), header.length);
 
-			buffer.bind();
-			program.pointerAttribute("vertices", 3, GL_FLOAT);
-			buffer.unbind();
+		// The driver may still reject the binary, fall back to compiling
+		int status = GL_FALSE;
+		glGetProgramiv(this->programID, GL_LINK_STATUS, &status);
 
-			glDrawArrays(GL_LINES, 0, buffer.size() / 2);
+		return status == GL_TRUE;
+	}
 
-			program.unbindAttribute();
+	void saveBinary() {
+		if (!this->isBinarySupported()) {
+			return;
+		}
 
-			model = 
-				glm::translate(glm::mat4(1.0f), this->from) * 
-				glm::scale(glm::mat4(1.0f), glm::vec3(0.25f));
+		int length = 0;
+		glGetProgramiv(this->programID, GL_PROGRAM_BINARY_LENGTH, &length);
 
-			program.setMat4("model", model);
-			sphere.render(program);
+		if (length <= 0) {
+			return;
+		}
 
-			model =
-				glm::translate(glm::mat4(1.0f), this->to) *
-				glm::scale(glm::mat4(1.0f), glm::vec3(0.25f));
+		std::vector<uint8_t> data(sizeof(ProgramCacheHeader) + length);
 
-			program.setMat4("model", model);
-			sphere.render(program);
+		ProgramCacheHeader header;
+		header.magic = PROGRAM_CACHE_MAGIC;
+		header.version = PROGRAM_CACHE_VERSION;
+		header.sourceHash = this->getSourceHash();
+		header.driverHash = this->getDriverHash();
 
+		GLenum format = 0;
+		glGetProgramBinary(this->programID, length, 0, &format, data.data() + sizeof(ProgramCacheHeader));
 
-		}
-	}
+		header.format = format;
+		header.length = length;
+		memcpy(data.data(), &header, sizeof(ProgramCacheHeader));
 
-	void release() {
-		sphere.release();
-		buffer.release();
+		util_makeDirectory(PROGRAM_CACHE_DIR);
+		util_writeFile(PROGRAM_CACHE_DIR + this->getCacheName() + ".bin", data.data(), data.size());
 	}
 
-	void setLine(btVector3 from, btVector3 to) {
-		this->from = this->covert(from);
-		this->to = this->covert(to);
-
-		buffer.clear();
-		buffer.add(from.x(), from.y(), from.z());
-		buffer.add(to.x(), to.y(), to.z());
-		buffer.upload();
+	void bind() {
+		glUseProgram(this->programID);
 	}
 
-	glm::vec3 covert(const btVector3& v) {
-		return glm::vec3(v.x(), v.y(), v.z());
+	void unbind() {
+		glUseProgram(0);
 	}
-};
 
-// Main Shader
-static Shader vertexShader;
-static Shader fragmentShader;
-static Program program;
+	void release() {
+		// Delete Vertex Array
+		glDeleteVertexArrays(1, &this->attributeID);
 
-static Shader hubVertexShader;
-static Shader hubFragmentShader;
+		std::for_each(shaders.begin(), shaders.end(), [&](Shader* shader) {
+			if (shader->id != 0) {
+				glDetachShader(this->programID, shader->id);
+			}
+		});
+
+		glDeleteProgram(this->programID);
+	}
+
+	// Shader
+	void addShader(Shader* shader) {
+		this->shaders.push_back(shader);
+	}
+
+	// Uniform
+	void createUniform(std::string name) {
+		this->uniformsMapping[name] = glGetUniformLocation(this->programID, name.c_str());
+	}
+
+	uint32_t getUniform(std::string name) {
+		return this->uniformsMapping[name];
+	}
+
+	void set1i(std::string name, int x) {
+		glUniform1i(this->uniformsMapping[name], x);
+	}
+
+	void set2i(std::string name, const glm::ivec2& v) {
+		glUniform2i(this->uniformsMapping[name], v.x, v.y);
+	}
+
+	void set3i(std::string name, const glm::ivec3& v) {
+		glUniform3i(this->uniformsMapping[name], v.x, v.y, v.z);
+	}
+
+	void set4i(std::string name, const glm::ivec4& v) {
+		glUniform4i(this->uniformsMapping[name], v.x, v.y, v.z, v.w);
+	}
+
+	void set1f(std::string name, float x) {
+		glUniform1f(this->uniformsMapping[name], x);
+	}
+
+	void set2f(std::string name, const glm::vec2& v) {
+		glUniform2f(this->uniformsMapping[name], v.x, v.y);
+	}
+
+	void set3f(std::string name, const glm::vec3& v) {
+		glUniform3f(this->uniformsMapping[name], v.x, v.y, v.z);
+	}
+
+	void set4f(std::string name, const glm::vec4& v) {
+		glUniform4f(this->uniformsMapping[name], v.x, v.y, v.z, v.w);
+	}
+
+	void setMat2(std::string name, const glm::mat2& m) {
+		glUniformMatrix2fv(this->uniformsMapping[name], 1, GL_FALSE, &m[0][0]);
+	}
+
+	void setMat3(std::string name, const glm::mat3& m) {
+		glUniformMatrix3fv(this->uniformsMapping[name], 1, GL_FALSE, &m[0][0]);
+	}
+
+	void setMat4(std::string name, const glm::mat4& m) {
+		glUniformMatrix4fv(this->uniformsMapping[name], 1, GL_FALSE, &m[0][0]);
+	}
+
+	// Location versions used in hot loops to skip the map lookup
+	void set4f(uint32_t location, const glm::vec4& v) {
+		glUniform4f(location, v.x, v.y, v.z, v.w);
+	}
+
+	void setMat4(uint32_t location, const glm::mat4& m) {
+		glUniformMatrix4fv(location, 1, GL_FALSE, &m[0][0]);
+	}
+
+	// Attribute
+	void setAttribute(std::string name, uint32_t id) {
+		this->attributeMapping[name] = id;
+	}
+
+	void enableAttribute(std::string name) {
+		glEnableVertexAttribArray(this->attributeMapping[name]);
+	}
+
+	void disableAttribute(std::string name) {
+		glDisableVertexAttribArray(this->attributeMapping[name]);
+	}
+
+	void pointerAttribute(
+		std::string name,
+		uint32_t size,
+		GLenum type) {
+		glVertexAttribPointer(
+			this->attributeMapping[name],
+			size,
+			type,
+			GL_FALSE,
+			0,
+			0
+		);
+	}
+
+	// Interleaved buffers, offset is in bytes from the vertex start
+	void pointerAttribute(
+		std::string name,
+		uint32_t size,
+		GLenum type,
+		bool normalized,
+		uint32_t stride,
+		uint32_t offset) {
+		glVertexAttribPointer(
+			this->attributeMapping[name],
+			size,
+			type,
+			(normalized) ? GL_TRUE : GL_FALSE,
+			stride,
+			(const void*)(uintptr_t)offset
+		);
+	}
+
+	// Instanced attributes advance once per instance instead of per vertex
+	void divisorAttribute(std::string name, uint32_t divisor) {
+		glVertexAttribDivisor(this->attributeMapping[name], divisor);
+	}
+
+	void bindAttribute() {
+		glBindVertexArray(this->attributeID);
+	}
+
+	void unbindAttribute() {
+		glBindVertexArray(0);
+	}
+
+};
+
+/*
+	Vertex layouts. A vertex is a plain struct of fixed size arrays, its
+	static describe() lists which member feeds which shader attribute and
+	the component type and count are taken from the member's type. All
+	attributes live interleaved in one buffer.
+*/
+// Round to nearest even, overflow becomes infinity
+uint16_t vertex_toHalf(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(uint32_t));
+
+	uint32_t sign = (bits >> 16) & 0x8000;
+	uint32_t exponentBits = (bits >> 23) & 0xff;
+	int32_t exponent = (int32_t)exponentBits - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (exponentBits == 0xff) {
+		return sign | 0x7c00 | ((mantissa != 0) ? 0x200 : 0);
+	}
+
+	if (exponent >= 31) {
+		return sign | 0x7c00;
+	}
+
+	if (exponent <= 0) {
+		if (exponent < -10) {
+			return sign;
+		}
+
+		// Denormal, the implicit one becomes part of the mantissa
+		mantissa |= 0x800000;
+		uint32_t shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+
+		if (rest > halfway || (rest == halfway && (half & 1))) {
+			half++;
+		}
+		return sign | half;
+	}
+
+	uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+
+	// A carry out of the mantissa correctly bumps the exponent
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+		half++;
+	}
+	return sign | half;
+}
+
+int16_t vertex_snorm16(float value) {
+	return (int16_t)roundf(std::min(std::max(value, -1.0f), 1.0f) * 32767.0f);
+}
+
+uint8_t vertex_unorm8(float value) {
+	return (uint8_t)roundf(std::min(std::max(value, 0.0f), 1.0f) * 255.0f);
+}
+
+struct Half {
+	uint16_t bits;
+
+	Half() : bits(0) {}
+	Half(float value) : bits(vertex_toHalf(value)) {}
+};
+
+template<typename T> struct VertexComponent;
+template<> struct VertexComponent<float> { static const GLenum type = GL_FLOAT; };
+template<> struct VertexComponent<Half> { static const GLenum type = GL_HALF_FLOAT; };
+template<> struct VertexComponent<int8_t> { static const GLenum type = GL_BYTE; };
+template<> struct VertexComponent<uint8_t> { static const GLenum type = GL_UNSIGNED_BYTE; };
+template<> struct VertexComponent<int16_t> { static const GLenum type = GL_SHORT; };
+template<> struct VertexComponent<uint16_t> { static const GLenum type = GL_UNSIGNED_SHORT; };
+template<> struct VertexComponent<uint32_t> { static const GLenum type = GL_UNSIGNED_INT; };
+
+template<typename T> struct VertexMember;
+template<typename T, size_t N> struct VertexMember<T[N]> {
+	typedef T Component;
+	static const uint32_t count = N;
+};
+
+struct VertexAttribute {
+	std::string name;
+	uint32_t size;
+	GLenum type;
+	bool normalized;
+	uint32_t offset;
+};
+
+struct VertexLayout {
+	std::vector<VertexAttribute> attributes;
+	uint32_t stride = 0;
+	// 1 for per instance data
+	uint32_t divisor = 0;
+
+	// Member is the array type of the field, e.g. float[3] or Half[2].
+	// Normalized integers read as [0, 1] or [-1, 1] in the shader.
+	template<typename Member>
+	void add(std::string name, size_t offset, bool normalized = false) {
+		typedef VertexMember<Member> M;
+
+		VertexAttribute attribute = {
+			name,
+			M::count,
+			VertexComponent<typename M::Component>::type,
+			normalized,
+			(uint32_t)offset
+		};
+
+		attributes.push_back(attribute);
+	}
+
+	// The vertex buffer has to be bound, base is added to every offset
+	void pointer(Program& program, uint32_t base = 0) {
+		for (uint32_t i = 0; i < attributes.size(); i++) {
+			VertexAttribute& a = attributes[i];
+			program.pointerAttribute(a.name, a.size, a.type, a.normalized, stride, base + a.offset);
+			program.divisorAttribute(a.name, divisor);
+		}
+	}
+};
+
+// Built once per vertex type
+template<typename Vertex>
+VertexLayout& vertex_getLayout() {
+	static VertexLayout layout = []() {
+		VertexLayout layout;
+		layout.stride = sizeof(Vertex);
+		Vertex::describe(layout);
+		return layout;
+	}();
+
+	return layout;
+}
+
+// Any position, 12 bytes
+struct PositionVertex {
+	float position[3];
+
+	PositionVertex() {}
+	PositionVertex(float x, float y, float z) {
+		position[0] = x;
+		position[1] = y;
+		position[2] = z;
+	}
+
+	static void describe(VertexLayout& layout) {
+		layout.add<decltype(position)>("vertices", offsetof(PositionVertex, position));
+	}
+};
+
+// Positions inside [-1, 1] like the unit primitives, 8 bytes. The fourth
+// component only keeps the vertex 4 byte aligned, the shader reads a vec3.
+struct UnitVertex {
+	int16_t position[4];
+
+	UnitVertex() {}
+	UnitVertex(float x, float y, float z) {
+		position[0] = vertex_snorm16(x);
+		position[1] = vertex_snorm16(y);
+		position[2] = vertex_snorm16(z);
+		position[3] = 0;
+	}
+
+	static void describe(VertexLayout& layout) {
+		layout.add<decltype(position)>("vertices", offsetof(UnitVertex, position), true);
+	}
+};
+
+// HUD quads, 16 bytes instead of two separate streams of 12 and 8
+struct TexturedVertex {
+	float position[3];
+	Half texCoord[2];
+
+	TexturedVertex() {}
+	TexturedVertex(float x, float y, float z, float u, float v) {
+		position[0] = x;
+		position[1] = y;
+		position[2] = z;
+		texCoord[0] = u;
+		texCoord[1] = v;
+	}
+
+	static void describe(VertexLayout& layout) {
+		layout.add<decltype(position)>("vertices", offsetof(TexturedVertex, position));
+		layout.add<decltype(texCoord)>("texCoords", offsetof(TexturedVertex, texCoord));
+	}
+};
+
+// Per object data of the main program, one per drawn instance. The
+// model matrix is read as four column attributes.
+struct InstanceVertex {
+	float model[16];
+	uint8_t color[4];
+
+	InstanceVertex() {}
+	InstanceVertex(const glm::mat4& model, const glm::vec4& color) {
+		memcpy(this->model, &model[0][0], sizeof(this->model));
+		this->color[0] = vertex_unorm8(color.x);
+		this->color[1] = vertex_unorm8(color.y);
+		this->color[2] = vertex_unorm8(color.z);
+		this->color[3] = vertex_unorm8(color.w);
+	}
+
+	static void describe(VertexLayout& layout) {
+		layout.divisor = 1;
+		layout.add<float[4]>("instanceModel0", offsetof(InstanceVertex, model));
+		layout.add<float[4]>("instanceModel1", offsetof(InstanceVertex, model) + sizeof(float) * 4);
+		layout.add<float[4]>("instanceModel2", offsetof(InstanceVertex, model) + sizeof(float) * 8);
+		layout.add<float[4]>("instanceModel3", offsetof(InstanceVertex, model) + sizeof(float) * 12);
+		layout.add<decltype(color)>("instanceColor", offsetof(InstanceVertex, color), true);
+	}
+};
+
+// CPU side vertex list a mesh is built in before it is optimized and
+// copied into its arena
+template<typename Vertex>
+struct VertexBuffer {
+	std::vector<Vertex> list;
+
+	void reserve(uint32_t count) {
+		list.reserve(count);
+	}
+
+	void add(const Vertex& vertex) {
+		list.push_back(vertex);
+	}
+
+	void clear() {
+		list.clear();
+	}
+
+	uint32_t size() {
+		return list.size();
+	}
+};
+
+// CPU side index list, the arena narrows it to its index width
+struct IndexBuffer {
+	std::vector<uint32_t> list;
+
+	void add(uint32_t x) {
+		list.push_back(x);
+	}
+
+	void add(uint32_t x, uint32_t y) {
+		list.push_back(x);
+		list.push_back(y);
+	}
+
+	void add(uint32_t x, uint32_t y, uint32_t z) {
+		list.push_back(x);
+		list.push_back(y);
+		list.push_back(z);
+	}
+
+	void add(uint32_t x, uint32_t y, uint32_t z, uint32_t w) {
+		list.push_back(x);
+		list.push_back(y);
+		list.push_back(z);
+		list.push_back(w);
+	}
+
+	void clear() {
+		list.clear();
+	}
+
+	uint32_t size() {
+		return list.size();
+	}
+};
+
+/*
+	Mesh optimization. Runs on the CPU copy before upload: welds bitwise
+	identical vertices, drops triangles that became degenerate, orders the
+	triangles for the post-transform vertex cache (Forsyth's linear speed
+	algorithm) and then the vertices in order of first use so fetches walk
+	the buffer forwards. Together with 16 bit indices in the mesh arenas this
+	shrinks and speeds up every mesh.
+*/
+// Cache modelled while ordering triangles
+#define MESH_CACHE_SIZE 32
+// FIFO size used to report ACMR, small enough to be pessimistic
+#define MESH_ACMR_CACHE_SIZE 16
+
+struct MeshStats {
+	uint32_t verticesBefore = 0;
+	uint32_t verticesAfter = 0;
+	uint32_t trianglesBefore = 0;
+	uint32_t trianglesAfter = 0;
+	float acmrBefore = 0.0f;
+	float acmrAfter = 0.0f;
+	uint64_t bytesBefore = 0;
+	uint64_t bytesAfter = 0;
+
+	void print(std::string name) {
+		std::cout << "Mesh " << name << ": " << verticesBefore << " -> " << verticesAfter << " vertices, "
+			<< trianglesBefore << " -> " << trianglesAfter << " triangles, acmr "
+			<< std::fixed << std::setprecision(3) << acmrBefore << " -> " << acmrAfter << ", "
+			<< std::setprecision(1) << (bytesBefore / 1024.0) << " -> " << (bytesAfter / 1024.0) << " KiB"
+			<< std::defaultfloat << std::endl;
+	}
+};
+
+// Average cache miss ratio, vertex shader runs per triangle
+float mesh_acmr(const uint32_t* indices, uint32_t indexCount, uint32_t vertexCount) {
+	if (indexCount < 3) {
+		return 0.0f;
+	}
+
+	std::vector<uint32_t> cachedAt(vertexCount, UINT32_MAX);
+	uint32_t misses = 0;
+
+	for (uint32_t i = 0; i < indexCount; i++) {
+		uint32_t v = indices[i];
+
+		if (cachedAt[v] == UINT32_MAX || misses - cachedAt[v] >= MESH_ACMR_CACHE_SIZE) {
+			cachedAt[v] = misses;
+			misses++;
+		}
+	}
+
+	return (float)misses / (indexCount / 3);
+}
+
+// Remaps indices onto the first of each group of identical vertices,
+// returns the number of distinct vertices
+uint32_t mesh_weld(const uint8_t* vertices, uint32_t vertexCount, uint32_t stride, std::vector<uint32_t>& remap) {
+	uint32_t tableSize = 1;
+
+	while (tableSize < vertexCount * 2) {
+		tableSize <<= 1;
+	}
+
+	std::vector<uint32_t> table(tableSize, UINT32_MAX);
+	remap.resize(vertexCount);
+
+	uint32_t unique = 0;
+
+	for (uint32_t i = 0; i < vertexCount; i++) {
+		const uint8_t* vertex = vertices + (size_t)i * stride;
+		uint32_t slot = (uint32_t)util_hash(vertex, stride) & (tableSize - 1);
+
+		while (table[slot] != UINT32_MAX && memcmp(vertices + (size_t)table[slot] * stride, vertex, stride) != 0) {
+			slot = (slot + 1) & (tableSize - 1);
+		}
+
+		if (table[slot] == UINT32_MAX) {
+			table[slot] = i;
+			unique++;
+		}
+
+		remap[i] = table[slot];
+	}
+
+	return unique;
+}
+
+float mesh_vertexScore(int32_t cachePosition, uint32_t remaining) {
+	if (remaining == 0) {
+		return -1.0f;
+	}
+
+	float score = 0.0f;
+
+	if (cachePosition >= 0) {
+		// The last triangle's vertices score the same so it doesn't
+		// matter in which order they were used
+		if (cachePosition < 3) {
+			score = 0.75f;
+		}
+		else {
+			float scale = 1.0f / (MESH_CACHE_SIZE - 3);
+			score = powf(1.0f - (cachePosition - 3) * scale, 1.5f);
+		}
+	}
+
+	// Favour finishing off vertices with few triangles left
+	return score + 2.0f * powf((float)remaining, -0.5f);
+}
+
+// Rewrites indices in an order that reuses cached vertices
+void mesh_orderTriangles(uint32_t* indices, uint32_t indexCount, uint32_t vertexCount) {
+	uint32_t triangleCount = indexCount / 3;
+
+	// Triangles of every vertex, the first remaining[v] are not emitted yet
+	std::vector<uint32_t> offsets(vertexCount + 1, 0);
+	std::vector<uint32_t> remaining(vertexCount, 0);
+
+	for (uint32_t i = 0; i < indexCount; i++) {
+		remaining[indices[i]]++;
+	}
+
+	for (uint32_t v = 0; v < vertexCount; v++) {
+		offsets[v + 1] = offsets[v] + remaining[v];
+	}
+
+	std::vector<uint32_t> adjacency(indexCount);
+	std::vector<uint32_t> filled(vertexCount, 0);
+
+	for (uint32_t t = 0; t < triangleCount; t++) {
+		for (uint32_t k = 0; k < 3; k++) {
+			uint32_t v = indices[t * 3 + k];
+			adjacency[offsets[v] + filled[v]++] = t;
+		}
+	}
+
+	std::vector<int32_t> cachePosition(vertexCount, -1);
+	std::vector<float> vertexScores(vertexCount);
+	std::vector<float> triangleScores(triangleCount, 0.0f);
+	std::vector<bool> emitted(triangleCount, false);
+
+	for (uint32_t v = 0; v < vertexCount; v++) {
+		vertexScores[v] = mesh_vertexScore(-1, remaining[v]);
+	}
+
+	for (uint32_t t = 0; t < triangleCount; t++) {
+		triangleScores[t] = vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] + vertexScores[indices[t * 3 + 2]];
+	}
+
+	std::vector<uint32_t> output(indexCount);
+	uint32_t cache[MESH_CACHE_SIZE + 3];
+	uint32_t cacheCount = 0;
+	uint32_t nextCache[MESH_CACHE_SIZE + 3];
+	uint32_t cursor = 0;
+	int64_t best = -1;
+
+	for (uint32_t emittedCount = 0; emittedCount < triangleCount; emittedCount++) {
+		// Dead end, continue with the next triangle in input order
+		if (best < 0) {
+			while (emitted[cursor]) {
+				cursor++;
+			}
+			best = cursor;
+		}
+
+		uint32_t t = (uint32_t)best;
+		emitted[t] = true;
+
+		uint32_t nextCount = 0;
+
+		for (uint32_t k = 0; k < 3; k++) {
+			uint32_t v = indices[t * 3 + k];
+			output[emittedCount * 3 + k] = v;
+			nextCache[nextCount++] = v;
+
+			// Take the triangle out of the vertex's remaining list
+			uint32_t* list = &adjacency[offsets[v]];
+
+			for (uint32_t j = 0; j < remaining[v]; j++) {
+				if (list[j] == t) {
+					std::swap(list[j], list[remaining[v] - 1]);
+					break;
+				}
+			}
+
+			remaining[v]--;
+		}
+
+		// Most recently used first, the old cache after it
+		for (uint32_t i = 0; i < cacheCount; i++) {
+			uint32_t v = cache[i];
+
+			if (v != nextCache[0] && v != nextCache[1] && v != nextCache[2]) {
+				nextCache[nextCount++] = v;
+			}
+		}
+
+		for (uint32_t i = 0; i < nextCount; i++) {
+			cachePosition[nextCache[i]] = (i < MESH_CACHE_SIZE) ? (int32_t)i : -1;
+		}
+
+		cacheCount = std::min(nextCount, (uint32_t)MESH_CACHE_SIZE);
+		memcpy(cache, nextCache, cacheCount * sizeof(uint32_t));
+
+		// Only vertices that moved in the cache changed score, and only
+		// their triangles can become the next best
+		best = -1;
+		float bestScore = -1.0f;
+
+		for (uint32_t i = 0; i < nextCount; i++) {
+			uint32_t v = nextCache[i];
+			float score = mesh_vertexScore(cachePosition[v], remaining[v]);
+			float change = score - vertexScores[v];
+			vertexScores[v] = score;
+
+			for (uint32_t j = 0; j < remaining[v]; j++) {
+				uint32_t triangle = adjacency[offsets[v] + j];
+				triangleScores[triangle] += change;
+			}
+		}
+
+		for (uint32_t i = 0; i < cacheCount; i++) {
+			uint32_t v = cache[i];
+
+			for (uint32_t j = 0; j < remaining[v]; j++) {
+				uint32_t triangle = adjacency[offsets[v] + j];
+
+				if (triangleScores[triangle] > bestScore) {
+					bestScore = triangleScores[triangle];
+					best = triangle;
+				}
+			}
+		}
+	}
+
+	memcpy(indices, output.data(), indexCount * sizeof(uint32_t));
+}
+
+// vertices is vertexCount * stride bytes. Both arrays are rewritten in
+// place and only shrink, the new counts are returned through them.
+void mesh_optimize(void* vertexData, uint32_t& vertexCount, uint32_t stride, uint32_t* indices, uint32_t& indexCount, MeshStats& stats) {
+	uint8_t* vertices = (uint8_t*)vertexData;
+
+	stats.verticesBefore = vertexCount;
+	stats.trianglesBefore = indexCount / 3;
+	stats.acmrBefore = mesh_acmr(indices, indexCount, vertexCount);
+	stats.bytesBefore = (uint64_t)vertexCount * stride + (uint64_t)indexCount * sizeof(uint32_t);
+
+	std::vector<uint32_t> remap;
+	mesh_weld(vertices, vertexCount, stride, remap);
+
+	uint32_t kept = 0;
+
+	for (uint32_t i = 0; i + 2 < indexCount; i += 3) {
+		uint32_t a = remap[indices[i]];
+		uint32_t b = remap[indices[i + 1]];
+		uint32_t c = remap[indices[i + 2]];
+
+		if (a == b || b == c || a == c) {
+			continue;
+		}
+
+		indices[kept++] = a;
+		indices[kept++] = b;
+		indices[kept++] = c;
+	}
+
+	indexCount = kept;
+
+	mesh_orderTriangles(indices, indexCount, vertexCount);
+
+	// Vertices in order of first use, unused ones are dropped
+	std::vector<uint32_t> order(vertexCount, UINT32_MAX);
+	std::vector<uint8_t> source(vertices, vertices + (size_t)vertexCount * stride);
+	uint32_t used = 0;
+
+	for (uint32_t i = 0; i < indexCount; i++) {
+		uint32_t v = indices[i];
+
+		if (order[v] == UINT32_MAX) {
+			order[v] = used;
+			memcpy(vertices + (size_t)used * stride, source.data() + (size_t)v * stride, stride);
+			used++;
+		}
+
+		indices[i] = order[v];
+	}
+
+	vertexCount = used;
+
+	stats.verticesAfter = vertexCount;
+	stats.trianglesAfter = indexCount / 3;
+	stats.acmrAfter = mesh_acmr(indices, indexCount, vertexCount);
+	stats.bytesAfter = (uint64_t)vertexCount * stride + (uint64_t)indexCount * ((vertexCount <= 0x10000) ? sizeof(uint16_t) : sizeof(uint32_t));
+}
+
+template<typename Vertex>
+void mesh_optimize(std::string name, VertexBuffer<Vertex>& vertices, IndexBuffer& indices) {
+	uint32_t vertexCount = vertices.list.size();
+	uint32_t indexCount = indices.list.size();
+
+	MeshStats stats;
+	mesh_optimize(vertices.list.data(), vertexCount, sizeof(Vertex), indices.list.data(), indexCount, stats);
+
+	vertices.list.resize(vertexCount);
+	indices.list.resize(indexCount);
+
+	stats.print(name);
+}
+
+/*
+	Mesh arenas. Static meshes don't own buffers, they are suballocated
+	from one vertex and one index buffer per vertex format and index
+	width, and addressed by a base vertex and first index. Every mesh in
+	an arena draws with the same bindings, so the render queue submits all
+	of them with one multi-draw indirect call. Space isn't reused, meshes
+	stay until the arenas are released on exit.
+*/
+// First allocation of each buffer, both double when full
+#define ARENA_VERTEX_BYTES (1 << 20)
+#define ARENA_INDEX_BYTES (1 << 18)
+
+// Where a mesh lives inside its arena
+struct MeshRange {
+	uint32_t baseVertex = 0;
+	uint32_t firstIndex = 0;
+	uint32_t vertexCount = 0;
+	uint32_t indexCount = 0;
+};
+
+// Same layout as GL's DrawElementsIndirectCommand
+struct DrawCommand {
+	uint32_t count;
+	uint32_t instanceCount;
+	uint32_t firstIndex;
+	int32_t baseVertex;
+	uint32_t baseInstance;
+};
+
+struct IMeshArena {
+	virtual void bind(Program& program) = 0;
+	virtual void unbind(Program& program) = 0;
+	virtual GLenum getIndexType() = 0;
+	virtual uint32_t getIndexSize() = 0;
+};
+
+template<typename Vertex, typename Index>
+struct MeshArena : public IMeshArena {
+	uint32_t vertexID = 0;
+	uint32_t indexID = 0;
+	// Bytes allocated, the used part is vertexCount/indexCount long
+	uint64_t vertexCapacity = 0;
+	uint64_t indexCapacity = 0;
+	uint32_t vertexCount = 0;
+	uint32_t indexCount = 0;
+
+	// Reallocates buffer so at least needed bytes fit, keeping the first
+	// used bytes. Goes through the copy targets so the element buffer of
+	// a bound vertex array is never touched.
+	static void grow(uint32_t& buffer, uint64_t& capacity, uint64_t used, uint64_t needed, uint64_t minimum) {
+		if (needed <= capacity) {
+			return;
+		}
+
+		uint64_t size = std::max(capacity, minimum);
+
+		while (size < needed) {
+			size *= 2;
+		}
+
+		uint32_t id = 0;
+		glGenBuffers(1, &id);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, id);
+		glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STATIC_DRAW);
+
+		if (used > 0) {
+			glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used);
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		}
+
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+		if (buffer != 0) {
+			glDeleteBuffers(1, &buffer);
+		}
+
+		memoryStats.resize(MEM_GL_BUFFERS, capacity, size);
+
+		buffer = id;
+		capacity = size;
+	}
+
+	// Indices are relative to the mesh's first vertex and have to fit Index
+	template<typename Source>
+	MeshRange add(const Vertex* vertices, uint32_t vertexCount, const Source* indices, uint32_t indexCount) {
+		MeshRange range;
+		range.baseVertex = this->vertexCount;
+		range.firstIndex = this->indexCount;
+		range.vertexCount = vertexCount;
+		range.indexCount = indexCount;
+
+		std::vector<Index> narrow(indexCount);
+
+		for (uint32_t i = 0; i < indexCount; i++) {
+			narrow[i] = (Index)indices[i];
+		}
+
+		uint64_t vertexOffset = (uint64_t)this->vertexCount * sizeof(Vertex);
+		uint64_t indexOffset = (uint64_t)this->indexCount * sizeof(Index);
+		uint64_t vertexSize = (uint64_t)vertexCount * sizeof(Vertex);
+		uint64_t indexSize = (uint64_t)indexCount * sizeof(Index);
+
+		grow(vertexID, vertexCapacity, vertexOffset, vertexOffset + vertexSize, ARENA_VERTEX_BYTES);
+		grow(indexID, indexCapacity, indexOffset, indexOffset + indexSize, ARENA_INDEX_BYTES);
+
+		glBindBuffer(GL_COPY_WRITE_BUFFER, vertexID);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, vertexOffset, vertexSize, vertices);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, indexID);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, indexOffset, indexSize, narrow.data());
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+		this->vertexCount += vertexCount;
+		this->indexCount += indexCount;
+
+		return range;
+	}
+
+	virtual void bind(Program& program) {
+		program.bindAttribute();
+
+		glBindBuffer(GL_ARRAY_BUFFER, vertexID);
+		vertex_getLayout<Vertex>().pointer(program);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexID);
+	}
+
+	virtual void unbind(Program& program) {
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		program.unbindAttribute();
+	}
+
+	virtual GLenum getIndexType() {
+		return VertexComponent<Index>::type;
+	}
+
+	virtual uint32_t getIndexSize() {
+		return sizeof(Index);
+	}
+
+	void release() {
+		if (vertexID != 0) {
+			glDeleteBuffers(1, &vertexID);
+		}
+
+		if (indexID != 0) {
+			glDeleteBuffers(1, &indexID);
+		}
+
+		memoryStats.remove(MEM_GL_BUFFERS, vertexCapacity + indexCapacity);
+
+		vertexID = 0;
+		indexID = 0;
+		vertexCapacity = 0;
+		indexCapacity = 0;
+		vertexCount = 0;
+		indexCount = 0;
+	}
+};
+
+// Unit primitives, HUD quads, and models/levels split by index width
+static MeshArena<UnitVertex, uint16_t> unitArena;
+static MeshArena<TexturedVertex, uint16_t> texturedArena;
+static MeshArena<PositionVertex, uint16_t> positionArena;
+static MeshArena<PositionVertex, uint32_t> largePositionArena;
+
+void mesh_releaseArenas() {
+	largePositionArena.release();
+	positionArena.release();
+	texturedArena.release();
+	unitArena.release();
+}
+
+struct IGeometry {
+	// Set by init once the mesh is in its arena
+	IMeshArena* arena = nullptr;
+	MeshRange range;
+
+	virtual void init() = 0;
+
+	// The arena keeps the space, the mesh just can't be drawn anymore
+	virtual void release() {
+		arena = nullptr;
+	}
+
+	// Bind/Draw/Unbind are split so several meshes of the same arena can
+	// be drawn without rebinding. The render queue doesn't need them, it
+	// draws a whole arena at once.
+	void bind(Program& program) {
+		arena->bind(program);
+	}
+
+	void draw() {
+		glDrawElementsBaseVertex(
+			GL_TRIANGLES,
+			range.indexCount,
+			arena->getIndexType(),
+			(const void*)(uintptr_t)(range.firstIndex * arena->getIndexSize()),
+			range.baseVertex);
+	}
+
+	void unbind(Program& program) {
+		arena->unbind(program);
+	}
+
+	void render(Program& program) {
+		this->bind(program);
+		this->draw();
+		this->unbind(program);
+	}
+
+	template<typename Vertex, typename Index>
+	void place(MeshArena<Vertex, Index>& arena, VertexBuffer<Vertex>& vertices, IndexBuffer& indices) {
+		this->range = arena.add(vertices.list.data(), vertices.size(), indices.list.data(), indices.size());
+		this->arena = &arena;
+	}
+
+	// Models and levels, 16 bit indices when they fit
+	template<typename Source>
+	void placePositions(const PositionVertex* vertices, uint32_t vertexCount, const Source* indices, uint32_t indexCount) {
+		if (vertexCount <= 0x10000) {
+			this->range = positionArena.add(vertices, vertexCount, indices, indexCount);
+			this->arena = &positionArena;
+		}
+		else {
+			this->range = largePositionArena.add(vertices, vertexCount, indices, indexCount);
+			this->arena = &largePositionArena;
+		}
+	}
+};
+
+struct GeometryPlane : public IGeometry {
+
+	virtual void init() {
+		VertexBuffer<UnitVertex> vertices;
+		IndexBuffer indincies;
+
+		// Vertices
+		vertices.reserve(4);
+		vertices.add(UnitVertex(1.0f, 0.0f, -1.0f));
+		vertices.add(UnitVertex(1.0f, 0.0f, 1.0f));
+		vertices.add(UnitVertex(-1.0f, 0.0f, -1.0f));
+		vertices.add(UnitVertex(-1.0f, 0.0f, 1.0f));
+
+		// Indencies
+		indincies.add(0, 1, 2);
+		indincies.add(2, 1, 3);
+
+		mesh_optimize("plane", vertices, indincies);
+		this->place(unitArena, vertices, indincies);
+	}
+
+};
+
+struct GeometryCube : public IGeometry {
+
+	virtual void init() {
+		VertexBuffer<UnitVertex> vertices;
+		IndexBuffer indincies;
+
+		vertices.reserve(8);
+
+		// 0
+		vertices.add(UnitVertex(-1.0f, 1.0f, -1.0f));
+		// 1
+		vertices.add(UnitVertex(1.0f, 1.0f, -1.0f));
+		// 2
+		vertices.add(UnitVertex(-1.0f, -1.0f, -1.0f));
+		// 3
+		vertices.add(UnitVertex(1.0f, -1.0f, -1.0f));
+		// 4
+		vertices.add(UnitVertex(-1.0f, 1.0f, 1.0f));
+		// 5
+		vertices.add(UnitVertex(1.0f, 1.0f, 1.0f));
+		// 6
+		vertices.add(UnitVertex(-1.0f, -1.0f, 1.0f));
+		// 7
+		vertices.add(UnitVertex(1.0f, -1.0f, 1.0f));
+
+
+		// left
+		indincies.add(0, 2, 4);
+		indincies.add(4, 2, 6);
+		// right
+		indincies.add(1, 3, 5);
+		indincies.add(5, 3, 7);
+		// top
+		indincies.add(0, 1, 4);
+		indincies.add(4, 1, 5);
+		// bottom
+		indincies.add(2, 3, 6);
+		indincies.add(6, 3, 7);
+		// front
+		indincies.add(4, 5, 6);
+		indincies.add(6, 5, 7);
+		// back
+		indincies.add(0, 1, 2);
+		indincies.add(2, 1, 3);
+
+		mesh_optimize("cube", vertices, indincies);
+		this->place(unitArena, vertices, indincies);
+	}
+
+};
+
+struct GeometrySphere : public IGeometry {
+
+	virtual void init() {
+		VertexBuffer<UnitVertex> vertices;
+		IndexBuffer indincies;
+
+		int count = 32;
+
+		float PI = 3.14159f;
+		float p = 1.0f;
+		float slice = 360.0f / (float)count;
+		float slice2 = 180.0f / (float)(count / 2);
+
+		vertices.reserve((count / 2 + 1) * count);
+
+		for (float phi = 0.0f; phi <= 180.0f; phi += slice2) {
+			for (float pheta = 0.0f; pheta < 360.0f; pheta += slice) {
+				float rphi = glm::radians(phi);
+				float rpheta = glm::radians(pheta);
+
+				float x = p * sin(rphi) * cos(rpheta);
+				float y = p * sin(rphi) * sin(rpheta);
+				float z = p * cos(rphi);
+
+				vertices.add(UnitVertex(x, y, z));
+			}
+		}
+
+		for (int y = 0; y < count / 2; y++) {
+			for (int x = 0; x < count; x++) {
+				int p0 = y * count + x;
+				int p1 = y * count + (x + 1);
+				int p2 = (y + 1) * count + x;
+				int p3 = (y + 1) * count + (x + 1);
+
+				indincies.add(p0, p1, p2);
+				indincies.add(p2, p1, p3);
+			}
+		}
+
+		// Welds the repeated pole vertices
+		mesh_optimize("sphere", vertices, indincies);
+		this->place(unitArena, vertices, indincies);
+
+	}
+
+};
+
+struct GeometryQuad : public IGeometry {
+
+	virtual void init() {
+		VertexBuffer<TexturedVertex> vertices;
+		IndexBuffer index;
+
+		vertices.reserve(4);
+		vertices.add(TexturedVertex(-1.0f, 1.0f, 0.0f, 0.0f, 0.0f));
+		vertices.add(TexturedVertex(1.0f, 1.0f, 0.0f, 1.0f, 0.0f));
+		vertices.add(TexturedVertex(-1.0f, -1.0f, 0.0f, 0.0f, 1.0f));
+		vertices.add(TexturedVertex(1.0f, -1.0f, 0.0f, 1.0f, 1.0f));
+
+		index.add(0, 1, 2);
+		index.add(2, 1, 3);
+
+		mesh_optimize("quad", vertices, index);
+		this->place(texturedArena, vertices, index);
+	}
+
+};
+
+/*
+	------------------ Model Section --------------------------
+*/
+#define MODEL_CACHE_DIR "data/cache/models/"
+#define MODEL_CACHE_MAGIC 0x4C444F4D // MODL
+#define MODEL_CACHE_VERSION 2
+// Mesh parts past this are merged into the last hull
+#define MODEL_MAX_HULLS 16
+
+struct ModelCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t sourceHash;
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	uint32_t hullCount;
+	uint32_t padding;
+};
+
+// Simplified convex hull of one mesh part, in model space
+struct ModelHull {
+	std::vector<float> points;
+};
+
+// Everything stored in the cache, render and collision data
+struct ModelData {
+	std::vector<float> vertices;
+	std::vector<uint32_t> indices;
+	std::vector<ModelHull> hulls;
+};
+
+struct GeometryModel : public IGeometry {
+	ModelData* data = nullptr;
+
+	virtual void init() {
+		static_assert(sizeof(PositionVertex) == sizeof(float) * 3, "PositionVertex has to match the packed model positions");
+
+		this->placePositions(
+			(const PositionVertex*)data->vertices.data(),
+			data->vertices.size() / 3,
+			data->indices.data(),
+			data->indices.size());
+	}
+};
+
+struct Model {
+	std::string path;
+	ModelData data;
+	GeometryModel geometry;
+
+	// Single hull, or a compound of one hull per mesh part
+	btCollisionShape* shape = nullptr;
+	std::vector<btConvexHullShape*> hulls;
+
+	bool init(std::string path) {
+		uint64_t start = SDL_GetPerformanceCounter();
+
+		this->path = path;
+
+		std::string source;
+
+		if (!util_readFile(path, source)) {
+			std::cout << "Model " << path << ": not found" << std::endl;
+			return false;
+		}
+
+		uint64_t sourceHash = util_hash(source);
+
+		bool cached = this->loadCache(sourceHash);
+
+		if (!cached) {
+			if (!this->import()) {
+				return false;
+			}
+			this->optimize();
+			this->saveCache(sourceHash);
+		}
+
+		this->geometry.data = &this->data;
+		this->geometry.init();
+
+		this->createShape();
+
+		std::cout << "Model " << path << ": " << (cached ? "cache hit" : "imported") << " in "
+			<< util_milliseconds(start, SDL_GetPerformanceCounter()) << " ms, "
+			<< (data.vertices.size() / 3) << " vertices, "
+			<< (data.indices.size() / 3) << " triangles, "
+			<< data.hulls.size() << " hulls" << std::endl;
+
+		return true;
+	}
+
+	// Assimp Import
+	bool import() {
+		Assimp::Importer importer;
+
+		const aiScene* scene = importer.ReadFile(path,
+			aiProcess_Triangulate |
+			aiProcess_JoinIdenticalVertices |
+			aiProcess_PreTransformVertices |
+			aiProcess_SortByPType |
+			aiProcess_FindDegenerates);
+
+		if (scene == nullptr || (scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE)) {
+			std::cout << "Model " << path << ": " << importer.GetErrorString() << std::endl;
+			return false;
+		}
+
+		data.vertices.clear();
+		data.indices.clear();
+		data.hulls.clear();
+
+		for (uint32_t m = 0; m < scene->mNumMeshes; m++) {
+			const aiMesh* mesh = scene->mMeshes[m];
+
+			if ((mesh->mPrimitiveTypes & aiPrimitiveType_TRIANGLE) == 0) {
+				continue;
+			}
+
+			uint32_t base = data.vertices.size() / 3;
+
+			for (uint32_t i = 0; i < mesh->mNumVertices; i++) {
+				data.vertices.push_back(mesh->mVertices[i].x);
+				data.vertices.push_back(mesh->mVertices[i].y);
+				data.vertices.push_back(mesh->mVertices[i].z);
+			}
+
+			for (uint32_t i = 0; i < mesh->mNumFaces; i++) {
+				const aiFace& face = mesh->mFaces[i];
+
+				if (face.mNumIndices != 3) {
+					continue;
+				}
+
+				data.indices.push_back(base + face.mIndices[0]);
+				data.indices.push_back(base + face.mIndices[1]);
+				data.indices.push_back(base + face.mIndices[2]);
+			}
+
+			if (data.hulls.size() < MODEL_MAX_HULLS) {
+				data.hulls.push_back(ModelHull());
+			}
+
+			this->addHullPoints(data.hulls.back(), mesh);
+		}
+
+		if (data.indices.empty()) {
+			std::cout << "Model " << path << ": no triangles" << std::endl;
+			return false;
+		}
+
+		for (uint32_t i = 0; i < data.hulls.size(); i++) {
+			this->simplifyHull(data.hulls[i]);
+		}
+
+		return true;
+	}
+
+	// Stored optimized, so cache hits skip this too
+	void optimize() {
+		uint32_t vertexCount = data.vertices.size() / 3;
+		uint32_t indexCount = data.indices.size();
+
+		MeshStats stats;
+		mesh_optimize(data.vertices.data(), vertexCount, 3 * sizeof(float), data.indices.data(), indexCount, stats);
+
+		data.vertices.resize(vertexCount * 3);
+		data.indices.resize(indexCount);
+
+		stats.print(path);
+	}
+
+	void addHullPoints(ModelHull& hull, const aiMesh* mesh) {
+		for (uint32_t i = 0; i < mesh->mNumVertices; i++) {
+			hull.points.push_back(mesh->mVertices[i].x);
+			hull.points.push_back(mesh->mVertices[i].y);
+			hull.points.push_back(mesh->mVertices[i].z);
+		}
+	}
+
+	// Reduces a part to the low vertex count hull btShapeHull builds,
+	// this is the slow step the cache exists to skip.
+	void simplifyHull(ModelHull& hull) {
+		btConvexHullShape full;
+
+		for (uint32_t i = 0; i < hull.points.size(); i += 3) {
+			full.addPoint(btVector3(hull.points[i], hull.points[i + 1], hull.points[i + 2]), false);
+		}
+		full.recalcLocalAabb();
+
+		btShapeHull reduced(&full);
+		reduced.buildHull(full.getMargin());
+
+		hull.points.clear();
+
+		for (int i = 0; i < reduced.numVertices(); i++) {
+			const btVector3& p = reduced.getVertexPointer()[i];
+			hull.points.push_back(p.x());
+			hull.points.push_back(p.y());
+			hull.points.push_back(p.z());
+		}
+	}
+
+	// Hulls stay in model space, so the body's origin is the model's
+	// origin and not its center of mass. Models are expected to be
+	// authored roughly centered, an offset origin makes them tumble as if
+	// weighted towards it.
+	void createShape() {
+		uint32_t category = memory_setCategory(MEM_SHAPES);
+
+		for (uint32_t i = 0; i < data.hulls.size(); i++) {
+			const ModelHull& hull = data.hulls[i];
+			btConvexHullShape* shape = new btConvexHullShape(hull.points.data(), hull.points.size() / 3, sizeof(float) * 3);
+			shape->optimizeConvexHull();
+			hulls.push_back(shape);
+		}
+
+		if (hulls.size() == 1) {
+			this->shape = hulls[0];
+			memory_setCategory(category);
+			return;
+		}
+
+		btCompoundShape* compound = new btCompoundShape(true, hulls.size());
+		btTransform identity;
+		identity.setIdentity();
+
+		for (uint32_t i = 0; i < hulls.size(); i++) {
+			compound->addChildShape(identity, hulls[i]);
+		}
+
+		this->shape = compound;
+		memory_setCategory(category);
+	}
+
+	// Binary Cache
+	std::string getCacheName() {
+		std::stringstream ss;
+		ss << std::hex << util_hash(path);
+		return ss.str();
+	}
+
+	bool loadCache(uint64_t sourceHash) {
+		std::string file;
+
+		if (!util_readFile(MODEL_CACHE_DIR + this->getCacheName() + ".bin", file) ||
+			file.size() < sizeof(ModelCacheHeader)) {
+			return false;
+		}
+
+		ModelCacheHeader header;
+		memcpy(&header, file.data(), sizeof(ModelCacheHeader));
+
+		if (header.magic != MODEL_CACHE_MAGIC ||
+			header.version != MODEL_CACHE_VERSION ||
+			header.sourceHash != sourceHash) {
+			return false;
+		}
+
+		size_t offset = sizeof(ModelCacheHeader);
+
+		std::function<bool(void*, size_t)> read = [&](void* out, size_t size) {
+			if (offset + size > file.size()) {
+				return false;
+			}
+			memcpy(out, file.data() + offset, size);
+			offset += size;
+			return true;
+		};
+
+		// Checked before resizing, so a corrupt count can't allocate more
+		// than the file holds
+		std::function<bool(uint64_t, uint64_t)> fits = [&](uint64_t count, uint64_t stride) {
+			return count * stride <= file.size() - offset;
+		};
+
+		if (header.hullCount == 0 || header.hullCount > MODEL_MAX_HULLS || header.indexCount % 3 != 0 ||
+			!fits(header.vertexCount, 3 * sizeof(float)) ||
+			!fits(header.indexCount, sizeof(uint32_t))) {
+			return false;
+		}
+
+		data.vertices.resize((size_t)header.vertexCount * 3);
+		data.indices.resize(header.indexCount);
+		data.hulls.resize(header.hullCount);
+
+		if (!read(data.vertices.data(), data.vertices.size() * sizeof(float)) ||
+			!read(data.indices.data(), data.indices.size() * sizeof(uint32_t))) {
+			return false;
+		}
+
+		// mesh_optimize and the draw index straight into the vertices
+		for (uint32_t i = 0; i < data.indices.size(); i++) {
+			if (data.indices[i] >= header.vertexCount) {
+				return false;
+			}
+		}
+
+		for (uint32_t i = 0; i < header.hullCount; i++) {
+			uint32_t count = 0;
+
+			if (!read(&count, sizeof(uint32_t)) || count == 0 || !fits(count, 3 * sizeof(float))) {
+				return false;
+			}
+
+			data.hulls[i].points.resize((size_t)count * 3);
+
+			if (!read(data.hulls[i].points.data(), count * 3 * sizeof(float))) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	void saveCache(uint64_t sourceHash) {
+		std::vector<uint8_t> file;
+
+		std::function<void(const void*, size_t)> write = [&](const void* in, size_t size) {
+			const uint8_t* bytes = (const uint8_t*)in;
+			file.insert(file.end(), bytes, bytes + size);
+		};
+
+		ModelCacheHeader header;
+		header.magic = MODEL_CACHE_MAGIC;
+		header.version = MODEL_CACHE_VERSION;
+		header.sourceHash = sourceHash;
+		header.vertexCount = data.vertices.size() / 3;
+		header.indexCount = data.indices.size();
+		header.hullCount = data.hulls.size();
+		header.padding = 0;
+
+		write(&header, sizeof(ModelCacheHeader));
+		write(data.vertices.data(), data.vertices.size() * sizeof(float));
+		write(data.indices.data(), data.indices.size() * sizeof(uint32_t));
+
+		for (uint32_t i = 0; i < data.hulls.size(); i++) {
+			uint32_t count = data.hulls[i].points.size() / 3;
+			write(&count, sizeof(uint32_t));
+			write(data.hulls[i].points.data(), data.hulls[i].points.size() * sizeof(float));
+		}
+
+		util_makeDirectory(PROGRAM_CACHE_DIR);
+		util_makeDirectory(MODEL_CACHE_DIR);
+		util_writeFile(MODEL_CACHE_DIR + this->getCacheName() + ".bin", file.data(), file.size());
+	}
+
+	void release() {
+		if (shape != nullptr && shape != hulls[0]) {
+			delete shape;
+		}
+
+		for (uint32_t i = 0; i < hulls.size(); i++) {
+			delete hulls[i];
+		}
+		hulls.clear();
+		shape = nullptr;
+
+		geometry.release();
+	}
+};
+
+// 1x1 texture bound in place of textures that are still loading
+static uint32_t texture_placeholderID = 0;
+
+#define DDS_MAGIC 0x20534444
+// DDS_HEADER.dwFlags bit telling dwMipMapCount is valid
+#define DDSD_MIPMAPCOUNT 0x20000
+// DDS_PIXELFORMAT.dwFlags bit telling dwFourCC is valid
+#define DDPF_FOURCC 0x4
+#define FOURCC(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+#define KTX_ENDIANNESS 0x04030201
+
+static const uint8_t KTX_IDENTIFIER[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+struct KTXHeader {
+	uint8_t identifier[12];
+	uint32_t endianness;
+	uint32_t glType;
+	uint32_t glTypeSize;
+	uint32_t glFormat;
+	uint32_t glInternalFormat;
+	uint32_t glBaseInternalFormat;
+	uint32_t pixelWidth;
+	uint32_t pixelHeight;
+	uint32_t pixelDepth;
+	uint32_t numberOfArrayElements;
+	uint32_t numberOfFaces;
+	uint32_t numberOfMipmapLevels;
+	uint32_t bytesOfKeyValueData;
+};
+
+std::string texture_formatName(GLenum internalFormat) {
+	switch (internalFormat) {
+	case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+	case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+		return "DXT1";
+	case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+		return "DXT3";
+	case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+		return "DXT5";
+	case GL_RGB:
+	case GL_RGB8:
+		return "RGB8";
+	default:
+		return "RGBA8";
+	}
+}
+
+struct TextureLevel {
+	uint32_t width;
+	uint32_t height;
+	uint32_t offset;
+	uint32_t size;
+};
+
+// CPU side copy of a texture, either decoded from an image file or read
+// from a KTX/DDS container with its mip chain already built. Rows are
+// kept in file order (top row first), same as the SDL_image path.
+struct TextureImage {
+	std::vector<uint8_t> data;
+	std::vector<TextureLevel> levels;
+	GLenum internalFormat = GL_RGBA8;
+	GLenum format = GL_RGBA;
+	GLenum type = GL_UNSIGNED_BYTE;
+	bool compressed = false;
+	bool generateMips = false;
+
+	uint32_t getWidth() {
+		return levels.empty() ? 0 : levels[0].width;
+	}
+
+	uint32_t getHeight() {
+		return levels.empty() ? 0 : levels[0].height;
+	}
+
+	uint32_t getBlockSize() {
+		return (internalFormat == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || internalFormat == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) ? 8 : 16;
+	}
+
+	uint32_t getBytesPerPixel() {
+		return (format == GL_RGB) ? 3 : 4;
+	}
+
+	// Uploads are split in rows, which are 4 pixel block rows for
+	// compressed formats.
+	uint32_t getRowHeight() {
+		return compressed ? 4 : 1;
+	}
+
+	uint32_t getRowCount(uint32_t level) {
+		return (levels[level].height + getRowHeight() - 1) / getRowHeight();
+	}
+
+	uint32_t getRowSize(uint32_t level) {
+		if (compressed) {
+			return ((levels[level].width + 3) / 4) * getBlockSize();
+		}
+		// GL_UNPACK_ALIGNMENT defaults to 4
+		return (levels[level].width * getBytesPerPixel() + 3) & ~3u;
+	}
+
+	uint32_t getMipCount() {
+		if (!generateMips) {
+			return levels.size();
+		}
+		uint32_t count = 1;
+		uint32_t size = std::max(getWidth(), getHeight());
+		while (size > 1) {
+			size >>= 1;
+			count++;
+		}
+		return count;
+	}
+
+	uint64_t getGPUSize() {
+		uint64_t size = 0;
+		std::for_each(levels.begin(), levels.end(), [&](TextureLevel& level) {
+			size += level.size;
+		});
+		// A full generated chain adds a third of the base level
+		if (generateMips) {
+			size += size / 3;
+		}
+		return size;
+	}
+
+	void addLevel(uint32_t width, uint32_t height, uint32_t offset) {
+		TextureLevel level = { width, height, offset, 0 };
+		levels.push_back(level);
+
+		uint32_t index = levels.size() - 1;
+		levels[index].size = getRowSize(index) * getRowCount(index);
+	}
+
+	bool load(std::string path) {
+		std::string ext = path.substr(path.find_last_of('.') + 1);
+
+		if (ext == "ktx") {
+			return this->loadKTX(path);
+		}
+
+		// Prefer a converted container next to the source image
+		std::string base = path.substr(0, path.find_last_of('.'));
+
+		if (ext == "dds") {
+			// Without S3TC the .png next to it is loaded instead
+			return this->loadDDS(path) || this->loadImage(base + ".png");
+		}
+
+		if (this->loadKTX(base + ".ktx")) {
+			return true;
+		}
+
+		return this->loadImage(path);
+	}
+
+	bool loadImage(std::string path) {
+		SDL_Surface* surf = IMG_Load(path.c_str());
+
+		if (surf == nullptr) {
+			return false;
+		}
+
+		// Normalize everything to tightly packed RGBA8 so uploads never
+		// depend on the source format.
+		SDL_Surface* rgba = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGBA32, 0);
+		SDL_FreeSurface(surf);
+
+		if (rgba == nullptr) {
+			return false;
+		}
+
+		internalFormat = GL_RGBA8;
+		format = GL_RGBA;
+		type = GL_UNSIGNED_BYTE;
+		compressed = false;
+		generateMips = true;
+
+		levels.clear();
+		this->addLevel(rgba->w, rgba->h, 0);
+		data.resize(levels[0].size);
+
+		for (int y = 0; y < rgba->h; y++) {
+			memcpy(
+				data.data() + y * rgba->w * 4,
+				(uint8_t*)rgba->pixels + y * rgba->pitch,
+				rgba->w * 4);
+		}
+
+		SDL_FreeSurface(rgba);
+
+		return true;
+	}
+
+	bool loadKTX(std::string path) {
+		std::string file;
+
+		if (!util_readFile(path, file) || file.size() < sizeof(KTXHeader)) {
+			return false;
+		}
+
+		KTXHeader header;
+		memcpy(&header, file.data(), sizeof(KTXHeader));
+
+		if (memcmp(header.identifier, KTX_IDENTIFIER, sizeof(KTX_IDENTIFIER)) != 0 ||
+			header.endianness != KTX_ENDIANNESS ||
+			header.pixelDepth > 1 ||
+			header.numberOfArrayElements > 0 ||
+			header.numberOfFaces != 1) {
+			std::cout << path << ": unsupported KTX file..." << std::endl;
+			return false;
+		}
+
+		compressed = (header.glType == 0);
+
+		// The converter only writes S3TC, load skips to the source image
+		if (compressed && !GLEW_EXT_texture_compression_s3tc) {
+			std::cout << path << ": S3TC isn't supported by the driver..." << std::endl;
+			return false;
+		}
+
+		internalFormat = header.glInternalFormat;
+		format = compressed ? header.glBaseInternalFormat : header.glFormat;
+		type = header.glType;
+		// glGenerateMipmap can't fill compressed levels, those keep one
+		generateMips = !compressed && header.numberOfMipmapLevels == 0;
+
+		uint32_t mipCount = std::max(header.numberOfMipmapLevels, 1u);
+		size_t offset = sizeof(KTXHeader) + header.bytesOfKeyValueData;
+
+		levels.clear();
+		data.clear();
+
+		uint32_t width = header.pixelWidth;
+		uint32_t height = header.pixelHeight;
+
+		for (uint32_t i = 0; i < mipCount; i++) {
+			if (offset + sizeof(uint32_t) > file.size()) {
+				return false;
+			}
+
+			uint32_t imageSize;
+			memcpy(&imageSize, file.data() + offset, sizeof(uint32_t));
+			offset += sizeof(uint32_t);
+
+			this->addLevel(width, height, data.size());
+
+			if (imageSize != levels.back().size || offset + imageSize > file.size()) {
+				std::cout << path << ": corrupt KTX level " << i << "..." << std::endl;
+				return false;
+			}
+
+			data.insert(data.end(), file.begin() + offset, file.begin() + offset + imageSize);
+			offset += (imageSize + 3) & ~3u;
+
+			width = std::max(width / 2, 1u);
+			height = std::max(height / 2, 1u);
+		}
+
+		return true;
+	}
+
+	bool loadDDS(std::string path) {
+		std::string file;
+
+		// magic + 124 byte header
+		if (!util_readFile(path, file) || file.size() < 128) {
+			return false;
+		}
+
+		const uint8_t* bytes = (const uint8_t*)file.data();
+		uint32_t header[32];
+		memcpy(header, bytes, sizeof(header));
+
+		if (header[0] != DDS_MAGIC) {
+			return false;
+		}
+
+		if (!GLEW_EXT_texture_compression_s3tc) {
+			std::cout << path << ": S3TC isn't supported by the driver..." << std::endl;
+			return false;
+		}
+
+		uint32_t height = header[3];
+		uint32_t width = header[4];
+		uint32_t mipCount = (header[2] & DDSD_MIPMAPCOUNT) ? std::max(header[7], 1u) : 1;
+		// DDS_PIXELFORMAT starts at header[19], dwFlags then dwFourCC
+		uint32_t fourCC = (header[20] & DDPF_FOURCC) ? header[21] : 0;
+
+		switch (fourCC) {
+		case FOURCC('D', 'X', 'T', '1'):
+			internalFormat = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+			break;
+		case FOURCC('D', 'X', 'T', '3'):
+			internalFormat = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
+			break;
+		case FOURCC('D', 'X', 'T', '5'):
+			internalFormat = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+			break;
+		default:
+			std::cout << path << ": only DXT1/DXT3/DXT5 DDS files are supported..." << std::endl;
+			return false;
+		}
+
+		compressed = true;
+		format = GL_RGBA;
+		type = 0;
+		generateMips = false;
+
+		levels.clear();
+
+		uint32_t offset = 0;
+
+		for (uint32_t i = 0; i < mipCount; i++) {
+			this->addLevel(width, height, offset);
+			offset += levels.back().size;
+
+			width = std::max(width / 2, 1u);
+			height = std::max(height / 2, 1u);
+		}
+
+		if (128 + offset > file.size()) {
+			std::cout << path << ": corrupt DDS file..." << std::endl;
+			return false;
+		}
+
+		data.assign(bytes + 128, bytes + 128 + offset);
+
+		return true;
+	}
+};
+
+struct Texture2D {
+	uint32_t id = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t levels = 0;
+	uint64_t gpuSize = 0;
+	bool ready = false;
+
+	void init(std::string path) {
+		TextureImage image;
+
+		if (!image.load(path)) {
+			std::cout << path << " doesn't exist..." << std::endl;
+			return;
+		}
+
+		this->allocate(image);
+
+		for (uint32_t i = 0; i < image.levels.size(); i++) {
+			this->uploadRows(image, i, 0, image.getRowCount(i), image.data.data() + image.levels[i].offset);
+		}
+
+		this->finalize(image);
+		this->printInfo(path, image);
+	}
+
+	// Creates storage for every level in the image
+	void allocate(TextureImage& image) {
+		width = image.getWidth();
+		height = image.getHeight();
+		levels = image.getMipCount();
+
+		memoryStats.resize(MEM_GL_TEXTURES, gpuSize, image.getGPUSize());
+		gpuSize = image.getGPUSize();
+
+		if (id == 0) {
+			glGenTextures(1, &this->id);
+		}
+
+		glBindTexture(GL_TEXTURE_2D, id);
+
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (levels > 1) ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+
+		for (uint32_t i = 0; i < image.levels.size(); i++) {
+			TextureLevel& level = image.levels[i];
+
+			if (image.compressed) {
+				glCompressedTexImage2D(GL_TEXTURE_2D, i, image.internalFormat, level.width, level.height, 0, level.size, 0);
+			}
+			else {
+				glTexImage2D(GL_TEXTURE_2D, i, image.internalFormat, level.width, level.height, 0, image.format, image.type, 0);
+			}
+		}
+
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	// data is either client memory or an offset into the bound
+	// GL_PIXEL_UNPACK_BUFFER
+	void uploadRows(TextureImage& image, uint32_t level, uint32_t row, uint32_t count, const void* data) {
+		TextureLevel& l = image.levels[level];
+
+		uint32_t y = row * image.getRowHeight();
+		uint32_t h = std::min(l.height - y, count * image.getRowHeight());
+
+		glBindTexture(GL_TEXTURE_2D, id);
+
+		if (image.compressed) {
+			glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, y, l.width, h, image.internalFormat, count * image.getRowSize(level), data);
+		}
+		else {
+			glTexSubImage2D(GL_TEXTURE_2D, level, 0, y, l.width, h, image.format, image.type, data);
+		}
+
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	// Builds the mip chain at runtime when the source didn't have one
+	void finalize(TextureImage& image) {
+		if (image.generateMips) {
+			glBindTexture(GL_TEXTURE_2D, id);
+			glGenerateMipmap(GL_TEXTURE_2D);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
+
+		ready = true;
+	}
+
+	void printInfo(std::string path, TextureImage& image) {
+		std::cout << "Texture " << path << ": " << width << "x" << height << " "
+			<< texture_formatName(image.internalFormat) << ", " << levels << " levels"
+			<< (image.generateMips ? " (generated)" : "") << ", "
+			<< (gpuSize / 1024.0) << " KiB" << std::endl;
+	}
+
+	bool isReady() {
+		return ready;
+	}
+
+	void bind(uint32_t texture = GL_TEXTURE0) {
+		glActiveTexture(texture);
+		glBindTexture(GL_TEXTURE_2D, (ready) ? id : texture_placeholderID);
+	}
+
+	void unbind(uint32_t texture = GL_TEXTURE0) {
+		glActiveTexture(texture);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	void release() {
+		glDeleteTextures(1, &this->id);
+		memoryStats.remove(MEM_GL_TEXTURES, gpuSize);
+		id = 0;
+		gpuSize = 0;
+		ready = false;
+	}
+
+};
+
+/*
+	------------------ Texture Loader Section --------------------------
+*/
+#define TEXTURE_LOADER_MAX_THREADS 4
+#define TEXTURE_UPLOAD_BUDGET (256 * 1024)
+#define TEXTURE_PBO_COUNT 2
+
+struct TextureRequest {
+	Texture2D* texture;
+	std::string path;
+	TextureImage image;
+	uint32_t level = 0;
+	uint32_t uploadedRows = 0;
+	bool failed = false;
+};
+
+// Decodes images on worker threads and streams the pixels to GL through
+// pixel buffer objects, at most TEXTURE_UPLOAD_BUDGET bytes per frame.
+// Textures bind the placeholder until their last level is uploaded.
+struct TextureLoader {
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<TextureRequest*> decodeQueue;
+	std::deque<TextureRequest*> uploadQueue;
+	bool running = false;
+
+	TextureRequest* uploading = nullptr;
+	uint32_t pbos[TEXTURE_PBO_COUNT];
+	uint64_t pboSizes[TEXTURE_PBO_COUNT] = {};
+	uint32_t pboIndex = 0;
+	uint32_t pending = 0;
+
+	void init() {
+		// Transparent so alpha tested HUD elements simply don't show
+		uint8_t pixel[4] = { 0, 0, 0, 0 };
+		glGenTextures(1, &texture_placeholderID);
+		glBindTexture(GL_TEXTURE_2D, texture_placeholderID);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixel);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glGenBuffers(TEXTURE_PBO_COUNT, pbos);
+
+		uint32_t count = std::thread::hardware_concurrency();
+		count = (count > 1) ? count - 1 : 1;
+		count = (count > TEXTURE_LOADER_MAX_THREADS) ? TEXTURE_LOADER_MAX_THREADS : count;
+
+		running = true;
+
+		for (uint32_t i = 0; i < count; i++) {
+			workers.push_back(std::thread([&]() { this->work(); }));
+		}
+	}
+
+	void load(Texture2D* texture, std::string path) {
+		texture->ready = false;
+
+		if (texture->id == 0) {
+			glGenTextures(1, &texture->id);
+		}
+
+		TextureRequest* request = new TextureRequest();
+		request->texture = texture;
+		request->path = path;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		decodeQueue.push_back(request);
+		pending++;
+		cond.notify_one();
+	}
+
+	bool isIdle() {
+		return pending == 0;
+	}
+
+	// Worker Thread
+	void work() {
+		while (true) {
+			TextureRequest* request = nullptr;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cond.wait(lock, [&]() { return !running || !decodeQueue.empty(); });
+
+				if (!running) {
+					return;
+				}
+
+				request = decodeQueue.front();
+				decodeQueue.pop_front();
+			}
+
+			request->failed = !request->image.load(request->path);
+
+			std::unique_lock<std::mutex> lock(mutex);
+			uploadQueue.push_back(request);
+		}
+	}
+
+	// Main Thread
+	void update() {
+		uint32_t budget = TEXTURE_UPLOAD_BUDGET;
+
+		while (budget > 0) {
+			if (uploading == nullptr) {
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+
+					if (uploadQueue.empty()) {
+						return;
+					}
+
+					uploading = uploadQueue.front();
+					uploadQueue.pop_front();
+				}
+
+				if (uploading->failed) {
+					std::cout << uploading->path << " doesn't exist..." << std::endl;
+					this->finish();
+					continue;
+				}
+
+				uploading->texture->allocate(uploading->image);
+			}
+
+			TextureImage& image = uploading->image;
+
+			uint32_t rowSize = image.getRowSize(uploading->level);
+			uint32_t rows = budget / rowSize;
+			rows = (rows == 0) ? 1 : rows;
+			rows = std::min(rows, image.getRowCount(uploading->level) - uploading->uploadedRows);
+
+			uint32_t size = rows * rowSize;
+
+			// Orphan the buffer each time so mapping never waits on
+			// the previous transfer.
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[pboIndex]);
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, size, 0, GL_STREAM_DRAW);
+			memoryStats.resize(MEM_GL_BUFFERS, pboSizes[pboIndex], size);
+			pboSizes[pboIndex] = size;
+			pboIndex = (pboIndex + 1) % TEXTURE_PBO_COUNT;
+
+			void* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+
+			if (dst != nullptr) {
+				memcpy(dst, image.data.data() + image.levels[uploading->level].offset + uploading->uploadedRows * rowSize, size);
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+				uploading->texture->uploadRows(image, uploading->level, uploading->uploadedRows, rows, 0);
+			}
+
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+			uploading->uploadedRows += rows;
+			budget = (size >= budget) ? 0 : budget - size;
+
+			if (uploading->uploadedRows >= image.getRowCount(uploading->level)) {
+				uploading->level++;
+				uploading->uploadedRows = 0;
+			}
+
+			if (uploading->level >= image.levels.size()) {
+				uploading->texture->finalize(image);
+				uploading->texture->printInfo(uploading->path, image);
+				this->finish();
+			}
+		}
+	}
+
+	void finish() {
+		delete uploading;
+		uploading = nullptr;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		pending--;
+	}
+
+	void release() {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			running = false;
+			cond.notify_all();
+		}
+
+		std::for_each(workers.begin(), workers.end(), [&](std::thread& worker) {
+			worker.join();
+		});
+		workers.clear();
+
+		std::for_each(decodeQueue.begin(), decodeQueue.end(), [&](TextureRequest* request) { delete request; });
+		std::for_each(uploadQueue.begin(), uploadQueue.end(), [&](TextureRequest* request) { delete request; });
+		decodeQueue.clear();
+		uploadQueue.clear();
+
+		delete uploading;
+		uploading = nullptr;
+		pending = 0;
+
+		glDeleteBuffers(TEXTURE_PBO_COUNT, pbos);
+		glDeleteTextures(1, &texture_placeholderID);
+		texture_placeholderID = 0;
+
+		for (uint32_t i = 0; i < TEXTURE_PBO_COUNT; i++) {
+			memoryStats.remove(MEM_GL_BUFFERS, pboSizes[i]);
+			pboSizes[i] = 0;
+		}
+	}
+};
+
+/*
+	------------------ Texture Converter Section --------------------------
+*/
+// Offline converter, run as: run.exe --convert-textures data/textures/a.png ...
+// Writes a .ktx next to each image holding a box filtered mip chain,
+// DXT1 when the image is opaque and DXT5 when it uses alpha.
+struct TextureConverter {
+
+	void downsample(const std::vector<uint8_t>& src, uint32_t w, uint32_t h, std::vector<uint8_t>& dst, uint32_t nw, uint32_t nh) {
+		dst.resize(nw * nh * 4);
+
+		for (uint32_t y = 0; y < nh; y++) {
+			for (uint32_t x = 0; x < nw; x++) {
+				uint32_t x0 = std::min(x * 2, w - 1), x1 = std::min(x * 2 + 1, w - 1);
+				uint32_t y0 = std::min(y * 2, h - 1), y1 = std::min(y * 2 + 1, h - 1);
+
+				for (uint32_t c = 0; c < 4; c++) {
+					uint32_t sum =
+						src[(y0 * w + x0) * 4 + c] + src[(y0 * w + x1) * 4 + c] +
+						src[(y1 * w + x0) * 4 + c] + src[(y1 * w + x1) * 4 + c];
+					dst[(y * nw + x) * 4 + c] = (uint8_t)((sum + 2) / 4);
+				}
+			}
+		}
+	}
+
+	uint16_t toRGB565(const uint8_t* c) {
+		return (uint16_t)(((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3));
+	}
+
+	void fromRGB565(uint16_t v, uint8_t* c) {
+		uint8_t r = (v >> 11) & 0x1F, g = (v >> 5) & 0x3F, b = v & 0x1F;
+		c[0] = (r << 3) | (r >> 2);
+		c[1] = (g << 2) | (g >> 4);
+		c[2] = (b << 3) | (b >> 2);
+	}
+
+	// Bounding box endpoints, inset by 1/16 of the range
+	void encodeColorBlock(const uint8_t* block, uint8_t* out) {
+		uint8_t minC[3] = { 255, 255, 255 };
+		uint8_t maxC[3] = { 0, 0, 0 };
+
+		for (uint32_t i = 0; i < 16; i++) {
+			for (uint32_t c = 0; c < 3; c++) {
+				minC[c] = std::min(minC[c], block[i * 4 + c]);
+				maxC[c] = std::max(maxC[c], block[i * 4 + c]);
+			}
+		}
+
+		for (uint32_t c = 0; c < 3; c++) {
+			uint8_t inset = (maxC[c] - minC[c]) >> 4;
+			minC[c] += inset;
+			maxC[c] -= inset;
+		}
+
+		uint16_t c0 = toRGB565(maxC);
+		uint16_t c1 = toRGB565(minC);
+
+		// c0 > c1 selects the 4 color mode in DXT1
+		if (c0 < c1) {
+			std::swap(c0, c1);
+		}
+
+		uint8_t palette[4][3];
+		fromRGB565(c0, palette[0]);
+		fromRGB565(c1, palette[1]);
+
+		for (uint32_t c = 0; c < 3; c++) {
+			palette[2][c] = (uint8_t)((2 * palette[0][c] + palette[1][c]) / 3);
+			palette[3][c] = (uint8_t)((palette[0][c] + 2 * palette[1][c]) / 3);
+		}
+
+		uint32_t indices = 0;
+
+		if (c0 != c1) {
+			for (uint32_t i = 0; i < 16; i++) {
+				uint32_t best = 0;
+				int32_t bestDist = INT32_MAX;
+
+				for (uint32_t p = 0; p < 4; p++) {
+					int32_t dr = block[i * 4 + 0] - palette[p][0];
+					int32_t dg = block[i * 4 + 1] - palette[p][1];
+					int32_t db = block[i * 4 + 2] - palette[p][2];
+					int32_t dist = dr * dr + dg * dg + db * db;
+
+					if (dist < bestDist) {
+						bestDist = dist;
+						best = p;
+					}
+				}
+
+				indices |= best << (i * 2);
+			}
+		}
+
+		out[0] = c0 & 0xFF;
+		out[1] = c0 >> 8;
+		out[2] = c1 & 0xFF;
+		out[3] = c1 >> 8;
+		out[4] = indices & 0xFF;
+		out[5] = (indices >> 8) & 0xFF;
+		out[6] = (indices >> 16) & 0xFF;
+		out[7] = (indices >> 24) & 0xFF;
+	}
+
+	// 8 alpha interpolation mode (a0 > a1)
+	void encodeAlphaBlock(const uint8_t* block, uint8_t* out) {
+		uint8_t a0 = 0, a1 = 255;
+
+		for (uint32_t i = 0; i < 16; i++) {
+			a0 = std::max(a0, block[i * 4 + 3]);
+			a1 = std::min(a1, block[i * 4 + 3]);
+		}
+
+		uint8_t palette[8];
+		palette[0] = a0;
+		palette[1] = a1;
+
+		for (uint32_t i = 1; i < 7; i++) {
+			palette[i + 1] = (uint8_t)(((7 - i) * a0 + i * a1) / 7);
+		}
+
+		uint64_t indices = 0;
+
+		if (a0 != a1) {
+			for (uint32_t i = 0; i < 16; i++) {
+				uint64_t best = 0;
+				int32_t bestDist = INT32_MAX;
+
+				for (uint32_t p = 0; p < 8; p++) {
+					int32_t dist = std::abs((int32_t)block[i * 4 + 3] - (int32_t)palette[p]);
+
+					if (dist < bestDist) {
+						bestDist = dist;
+						best = p;
+					}
+				}
+
+				indices |= best << (i * 3);
+			}
+		}
+
+		out[0] = a0;
+		out[1] = a1;
+
+		for (uint32_t i = 0; i < 6; i++) {
+			out[2 + i] = (indices >> (i * 8)) & 0xFF;
+		}
+	}
+
+	void compress(const std::vector<uint8_t>& pixels, uint32_t w, uint32_t h, bool alpha, std::vector<uint8_t>& out) {
+		uint32_t bw = (w + 3) / 4;
+		uint32_t bh = (h + 3) / 4;
+		uint32_t blockSize = alpha ? 16 : 8;
+
+		out.resize(bw * bh * blockSize);
+
+		uint8_t block[64];
+
+		for (uint32_t by = 0; by < bh; by++) {
+			for (uint32_t bx = 0; bx < bw; bx++) {
+				// Edge blocks repeat the last row/column
+				for (uint32_t y = 0; y < 4; y++) {
+					for (uint32_t x = 0; x < 4; x++) {
+						uint32_t px = std::min(bx * 4 + x, w - 1);
+						uint32_t py = std::min(by * 4 + y, h - 1);
+						memcpy(&block[(y * 4 + x) * 4], &pixels[(py * w + px) * 4], 4);
+					}
+				}
+
+				uint8_t* dst = &out[(by * bw + bx) * blockSize];
+
+				if (alpha) {
+					encodeAlphaBlock(block, dst);
+					encodeColorBlock(block, dst + 8);
+				}
+				else {
+					encodeColorBlock(block, dst);
+				}
+			}
+		}
+	}
+
+	bool convert(std::string path) {
+		TextureImage image;
+
+		if (!image.loadImage(path)) {
+			std::cout << path << " doesn't exist..." << std::endl;
+			return false;
+		}
+
+		uint32_t w = image.getWidth();
+		uint32_t h = image.getHeight();
+
+		std::vector<uint8_t> pixels = image.data;
+
+		bool alpha = false;
+		for (uint32_t i = 0; i < w * h; i++) {
+			if (pixels[i * 4 + 3] != 255) {
+				alpha = true;
+				break;
+			}
+		}
+
+		KTXHeader header;
+		memset(&header, 0, sizeof(KTXHeader));
+		memcpy(header.identifier, KTX_IDENTIFIER, sizeof(KTX_IDENTIFIER));
+		header.endianness = KTX_ENDIANNESS;
+		header.glTypeSize = 1;
+		header.glInternalFormat = alpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		header.glBaseInternalFormat = alpha ? GL_RGBA : GL_RGB;
+		header.pixelWidth = w;
+		header.pixelHeight = h;
+		header.numberOfFaces = 1;
+		header.numberOfMipmapLevels = image.getMipCount();
+
+		std::vector<uint8_t> file(sizeof(KTXHeader));
+		memcpy(file.data(), &header, sizeof(KTXHeader));
+
+		std::vector<uint8_t> blocks;
+		std::vector<uint8_t> next;
+
+		for (uint32_t i = 0; i < header.numberOfMipmapLevels; i++) {
+			compress(pixels, w, h, alpha, blocks);
+
+			uint32_t size = blocks.size();
+			file.insert(file.end(), (uint8_t*)&size, (uint8_t*)&size + sizeof(uint32_t));
+			file.insert(file.end(), blocks.begin(), blocks.end());
+
+			uint32_t nw = std::max(w / 2, 1u);
+			uint32_t nh = std::max(h / 2, 1u);
+			downsample(pixels, w, h, next, nw, nh);
+			pixels.swap(next);
+			w = nw;
+			h = nh;
+		}
+
+		std::string out = path.substr(0, path.find_last_of('.')) + ".ktx";
+
+		if (!util_writeFile(out, file.data(), file.size())) {
+			std::cout << "Couldn't write " << out << "..." << std::endl;
+			return false;
+		}
+
+		std::cout << path << " -> " << out << " (" << texture_formatName(header.glInternalFormat) << ", "
+			<< header.numberOfMipmapLevels << " levels, " << image.data.size() << " -> " << file.size() << " bytes)" << std::endl;
+
+		return true;
+	}
+};
+
+int tool_convertTextures(int argc, char** argv) {
+	TextureConverter converter;
+
+	int failed = 0;
+
+	for (int i = 0; i < argc; i++) {
+		if (!converter.convert(argv[i])) {
+			failed++;
+		}
+	}
+
+	return (failed == 0) ? 0 : 1;
+}
+
+/*
+	------------------ Input Section --------------------------
+*/
+#define INPUT_QUEUE_SIZE 256
+#define INPUT_MOUSE_BUTTONS 8
+#define INPUT_LATENCY_WINDOW 64
+
+enum InputActionType {
+	IA_NONE = 0,
+	IA_FORWARD,
+	IA_BACKWARD,
+	IA_LEFT,
+	IA_RIGHT,
+	IA_JUMP,
+	IA_SPRINT,
+	IA_PRIMARY,
+	IA_SECONDARY,
+	IA_MODE_PUSH,
+	IA_MODE_PULL,
+	IA_MODE_MASS_PUSH,
+	IA_MODE_MASS_PULL,
+	IA_MODE_GRAB,
+	IA_COUNT
+};
+
+struct InputAction {
+	uint8_t type;
+	bool pressed;
+	// SDL_GetPerformanceCounter() when the event was polled
+	uint64_t timestamp;
+};
+
+// Fixed size ring buffer, nothing is allocated after init
+struct InputQueue {
+	InputAction actions[INPUT_QUEUE_SIZE];
+	uint32_t head = 0;
+	uint32_t tail = 0;
+
+	bool isEmpty() {
+		return head == tail;
+	}
+
+	bool push(const InputAction& action) {
+		uint32_t next = (tail + 1) % INPUT_QUEUE_SIZE;
+
+		if (next == head) {
+			return false;
+		}
+
+		actions[tail] = action;
+		tail = next;
+		return true;
+	}
+
+	InputAction& front() {
+		return actions[head];
+	}
+
+	void pop() {
+		head = (head + 1) % INPUT_QUEUE_SIZE;
+	}
+};
+
+// Turns SDL events into timestamped actions. The actions are consumed
+// from inside the physics tick so each one lands on the sub-step that
+// covers the moment it happened.
+struct InputSystem {
+	uint8_t keyBindings[SDL_NUM_SCANCODES];
+	uint8_t buttonBindings[INPUT_MOUSE_BUTTONS];
+
+	InputQueue queue;
+	uint32_t dropped = 0;
+
+	// Wall clock window of the current physics tick
+	uint64_t tickStart = 0;
+	uint64_t tickEnd = 0;
+	uint32_t substep = 0;
+	uint32_t substepCount = 1;
+
+	double latencyTotal = 0.0;
+	double latencyPeak = 0.0;
+	uint32_t latencySamples = 0;
+	double latencyAverage = 0.0;
+	double latencyMax = 0.0;
+
+	void init() {
+		memset(keyBindings, IA_NONE, sizeof(keyBindings));
+		memset(buttonBindings, IA_NONE, sizeof(buttonBindings));
+
+		keyBindings[SDL_SCANCODE_W] = IA_FORWARD;
+		keyBindings[SDL_SCANCODE_S] = IA_BACKWARD;
+		keyBindings[SDL_SCANCODE_A] = IA_LEFT;
+		keyBindings[SDL_SCANCODE_D] = IA_RIGHT;
+		keyBindings[SDL_SCANCODE_SPACE] = IA_JUMP;
+		keyBindings[SDL_SCANCODE_E] = IA_SPRINT;
+		keyBindings[SDL_SCANCODE_1] = IA_MODE_PUSH;
+		keyBindings[SDL_SCANCODE_2] = IA_MODE_PULL;
+		keyBindings[SDL_SCANCODE_3] = IA_MODE_MASS_PUSH;
+		keyBindings[SDL_SCANCODE_4] = IA_MODE_MASS_PULL;
+		keyBindings[SDL_SCANCODE_5] = IA_MODE_GRAB;
+
+		buttonBindings[SDL_BUTTON_LEFT] = IA_PRIMARY;
+		buttonBindings[SDL_BUTTON_RIGHT] = IA_SECONDARY;
+
+		tickStart = tickEnd = SDL_GetPerformanceCounter();
+	}
+
+	void doEvent(SDL_Event& e) {
+		InputAction action;
+		action.type = IA_NONE;
+		action.timestamp = SDL_GetPerformanceCounter();
+
+		if ((e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) && !e.key.repeat) {
+			action.type = keyBindings[e.key.keysym.scancode];
+			action.pressed = (e.type == SDL_KEYDOWN);
+		}
+		else if ((e.type == SDL_MOUSEBUTTONDOWN || e.type == SDL_MOUSEBUTTONUP) && e.button.button < INPUT_MOUSE_BUTTONS) {
+			action.type = buttonBindings[e.button.button];
+			action.pressed = (e.type == SDL_MOUSEBUTTONDOWN);
+		}
+
+		if (action.type != IA_NONE && !queue.push(action)) {
+			dropped++;
+		}
+	}
+
+	// Spreads the wall clock time since the last tick over the sub-steps
+	// the physics world is about to take.
+	void beginTick(uint32_t substepCount) {
+		this->tickStart = this->tickEnd;
+		this->tickEnd = SDL_GetPerformanceCounter();
+		this->substep = 0;
+		this->substepCount = substepCount;
+	}
+
+	// Pops the next action that happened before the end of the current
+	// sub-step.
+	bool next(InputAction& action) {
+		uint64_t until = tickStart + (tickEnd - tickStart) * (substep + 1) / substepCount;
+
+		// The last sub-step takes everything, including events polled
+		// after the tick began.
+		if (queue.isEmpty() || (substep + 1 < substepCount && queue.front().timestamp > until)) {
+			return false;
+		}
+
+		action = queue.front();
+		queue.pop();
+
+		this->recordLatency(action.timestamp);
+
+		return true;
+	}
+
+	void endSubstep() {
+		substep++;
+	}
+
+	void recordLatency(uint64_t timestamp) {
+		double latency = util_milliseconds(timestamp, SDL_GetPerformanceCounter());
+
+		latencyTotal += latency;
+		latencyPeak = std::max(latencyPeak, latency);
+		latencySamples++;
+
+		if (latencySamples >= INPUT_LATENCY_WINDOW) {
+			latencyAverage = latencyTotal / latencySamples;
+			latencyMax = latencyPeak;
+			latencyTotal = 0.0;
+			latencyPeak = 0.0;
+			latencySamples = 0;
+		}
+	}
+};
+
+/*
+	------------------ Network Section --------------------------
+*/
+#define NET_DEFAULT_PORT 27960
+#define NET_MAX_PACKET 1200
+#define NET_MAX_CLIENTS 8
+#define NET_TIMEOUT 5.0
+// Positions are sent as 16 bit fixed point, +-512 units at 1/64 unit
+#define NET_POSITION_SCALE 64.0f
+
+enum NetPacketType {
+	NP_HELLO = 0,
+	NP_INPUT,
+	NP_SNAPSHOT,
+	NP_BYE
+};
+
+#ifdef _WIN32
+typedef SOCKET net_socket;
+#define NET_INVALID_SOCKET INVALID_SOCKET
+#else
+typedef int net_socket;
+#define NET_INVALID_SOCKET -1
+#endif
+
+bool net_init() {
+#ifdef _WIN32
+	WSADATA data;
+	return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+	return true;
+#endif
+}
+
+void net_release() {
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+// IPv4 address and port, both in network byte order
+struct NetAddress {
+	uint32_t host = 0;
+	uint16_t port = 0;
+
+	bool operator==(const NetAddress& other) const {
+		return host == other.host && port == other.port;
+	}
+
+	// "host", "host:port", localhost is accepted as a name
+	bool parse(std::string text) {
+		uint16_t hostPort = NET_DEFAULT_PORT;
+		size_t colon = text.find(':');
+
+		if (colon != std::string::npos) {
+			hostPort = (uint16_t)atoi(text.substr(colon + 1).c_str());
+			text = text.substr(0, colon);
+		}
+
+		if (text == "localhost") {
+			text = "127.0.0.1";
+		}
+
+		in_addr addr;
+
+		if (inet_pton(AF_INET, text.c_str(), &addr) != 1) {
+			return false;
+		}
+
+		host = addr.s_addr;
+		port = htons(hostPort);
+		return true;
+	}
+};
+
+// Non blocking UDP socket
+struct UdpSocket {
+	net_socket handle = NET_INVALID_SOCKET;
+
+	bool open(uint16_t port) {
+		handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+		if (handle == NET_INVALID_SOCKET) {
+			return false;
+		}
+
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(port);
+
+		if (bind(handle, (sockaddr*)&addr, sizeof(addr)) != 0) {
+			this->close();
+			return false;
+		}
+
+#ifdef _WIN32
+		u_long nonBlocking = 1;
+		ioctlsocket(handle, FIONBIO, &nonBlocking);
+#else
+		fcntl(handle, F_SETFL, fcntl(handle, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+		return true;
+	}
+
+	void send(const NetAddress& to, const void* data, uint32_t size) {
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = to.host;
+		addr.sin_port = to.port;
+
+		sendto(handle, (const char*)data, size, 0, (sockaddr*)&addr, sizeof(addr));
+	}
+
+	// Returns the packet size, or 0 when nothing is waiting
+	uint32_t receive(NetAddress& from, void* data, uint32_t size) {
+		sockaddr_in addr;
+		socklen_t length = sizeof(addr);
+
+		int received = recvfrom(handle, (char*)data, size, 0, (sockaddr*)&addr, &length);
+
+		if (received <= 0) {
+			return 0;
+		}
+
+		from.host = addr.sin_addr.s_addr;
+		from.port = addr.sin_port;
+		return (uint32_t)received;
+	}
+
+	void close() {
+		if (handle == NET_INVALID_SOCKET) {
+			return;
+		}
+#ifdef _WIN32
+		closesocket(handle);
+#else
+		::close(handle);
+#endif
+		handle = NET_INVALID_SOCKET;
+	}
+};
+
+// Packets are written and read in host byte order, every peer this
+// build talks to is little endian.
+struct NetWriter {
+	uint8_t data[NET_MAX_PACKET];
+	uint32_t size = 0;
+
+	template<typename T>
+	bool write(const T& value) {
+		if (size + sizeof(T) > NET_MAX_PACKET) {
+			return false;
+		}
+		memcpy(data + size, &value, sizeof(T));
+		size += sizeof(T);
+		return true;
+	}
+
+	uint32_t remaining() {
+		return NET_MAX_PACKET - size;
+	}
+};
+
+struct NetReader {
+	const uint8_t* data;
+	uint32_t size;
+	uint32_t offset = 0;
+
+	NetReader(const uint8_t* data, uint32_t size) : data(data), size(size) {}
+
+	template<typename T>
+	bool read(T& value) {
+		if (offset + sizeof(T) > size) {
+			return false;
+		}
+		memcpy(&value, data + offset, sizeof(T));
+		offset += sizeof(T);
+		return true;
+	}
+};
+
+// Entity id layout: type in the top 2 bits, removed flag, 13 bit index
+#define NET_ID_INDEX_MASK 0x1FFF
+#define NET_ID_REMOVED 0x2000
+#define NET_ID_TYPE_SHIFT 14
+
+enum NetEntityType {
+	NET_BOX = 0,
+	NET_SPHERE,
+	NET_PLAYER
+};
+
+// Quantized body state, 12 bytes on the wire
+struct NetEntity {
+	uint16_t id;
+	int16_t position[3];
+	uint32_t rotation;
+
+	bool operator==(const NetEntity& other) const {
+		return id == other.id &&
+			position[0] == other.position[0] &&
+			position[1] == other.position[1] &&
+			position[2] == other.position[2] &&
+			rotation == other.rotation;
+	}
+};
+
+int16_t net_quantizePosition(float v) {
+	float q = roundf(v * NET_POSITION_SCALE);
+	return (int16_t)std::max(-32767.0f, std::min(32767.0f, q));
+}
+
+// Smallest three: index of the largest component in 2 bits, the other
+// three in 10 bits each, the largest is rebuilt from unit length
+uint32_t net_quantizeRotation(const btQuaternion& q) {
+	float v[4] = { q.x(), q.y(), q.z(), q.w() };
+	uint32_t largest = 0;
+
+	for (uint32_t i = 1; i < 4; i++) {
+		if (fabsf(v[i]) > fabsf(v[largest])) {
+			largest = i;
+		}
+	}
+
+	float sign = (v[largest] < 0.0f) ? -1.0f : 1.0f;
+	uint32_t bits = largest;
+
+	for (uint32_t i = 0; i < 4; i++) {
+		if (i == largest) {
+			continue;
+		}
+		float n = (v[i] * sign * 0.70710678f) + 0.5f;
+		uint32_t c = (uint32_t)std::max(0.0f, std::min(1023.0f, roundf(n * 1023.0f)));
+		bits = (bits << 10) | c;
+	}
+
+	return bits;
+}
+
+btQuaternion net_dequantizeRotation(uint32_t bits) {
+	uint32_t largest = bits >> 30;
+	float v[4];
+	float sum = 0.0f;
+
+	for (int i = 3; i >= 0; i--) {
+		if ((uint32_t)i == largest) {
+			continue;
+		}
+		float n = (bits & 1023) / 1023.0f;
+		v[i] = (n - 0.5f) * 1.41421356f;
+		sum += v[i] * v[i];
+		bits >>= 10;
+	}
+
+	v[largest] = sqrtf(std::max(0.0f, 1.0f - sum));
+
+	return btQuaternion(v[0], v[1], v[2], v[3]);
+}
+
+/*
+	------------------ Render Queue Section --------------------------
+*/
+// Sort key layout (high to low): program | mesh | material
+#define RQ_PROGRAM_BITS 8
+#define RQ_MESH_BITS 12
+#define RQ_MATERIAL_BITS 12
+
+#define RQ_PROGRAM_SHIFT (RQ_MESH_BITS + RQ_MATERIAL_BITS)
+#define RQ_MESH_SHIFT RQ_MATERIAL_BITS
+
+#define RQ_MASK(bits) ((1u << (bits)) - 1u)
+
+struct Material {
+	glm::vec4 color;
+};
+
+struct RenderProgram {
+	Program* program;
+	uint32_t proj;
+	uint32_t view;
+};
+
+struct DrawPacket {
+	uint32_t key;
+	glm::mat4 model;
+};
+
+// Commands of one program and arena, drawn with a single call
+struct DrawBatch {
+	uint32_t program;
+	uint32_t arena;
+	uint32_t firstCommand;
+	uint32_t commandCount;
+};
+
+struct RenderQueueStats {
+	uint32_t packets = 0;
+	uint32_t commands = 0;
+	uint32_t drawCalls = 0;
+	uint32_t programBinds = 0;
+	uint32_t arenaBinds = 0;
+};
+
+// Initial instance and command buffer sizes, both double when full
+#define RQ_INSTANCE_CAPACITY 1024
+#define RQ_COMMAND_CAPACITY 64
+
+struct RenderQueue {
+	std::vector<RenderProgram> programs;
+	std::vector<IGeometry*> meshes;
+	std::vector<Material> materials;
+	// Distinct arenas of the meshes, meshArenas maps a mesh to its index
+	std::vector<IMeshArena*> arenas;
+	std::vector<uint32_t> meshArenas;
+
+	// Packets are submitted unsorted, then sorted through (key << 32 | index)
+	// pairs so the packets themselves never move.
+	std::vector<DrawPacket> packets;
+	std::vector<uint64_t> sortKeys;
+	std::vector<uint64_t> sortTemp;
+
+	// Rebuilt every flush. Packets sharing a program and mesh become one
+	// instanced command, the instances are in sorted packet order.
+	std::vector<InstanceVertex> instances;
+	std::vector<DrawCommand> commands;
+	std::vector<DrawBatch> batches;
+	std::vector<std::vector<DrawCommand>> arenaCommands;
+
+	uint32_t instanceID = 0;
+	uint32_t commandID = 0;
+	uint64_t instanceCapacity = 0;
+	uint64_t commandCapacity = 0;
+
+	// GL 4.3 plus base instance (4.2) so each command finds its instances,
+	// otherwise every command is its own instanced draw
+	bool multiDraw = false;
+
+	glm::mat4 proj;
+	glm::mat4 view;
+
+	RenderQueueStats stats;
+
+	void init() {
+		glGenBuffers(1, &instanceID);
+		glGenBuffers(1, &commandID);
+
+		multiDraw = GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance;
+
+		std::cout << "Render Queue: " << (multiDraw ? "multi-draw indirect" : "one draw per mesh, no multi-draw indirect or base instance") << std::endl;
+	}
+
+	void release() {
+		glDeleteBuffers(1, &commandID);
+		glDeleteBuffers(1, &instanceID);
+
+		memoryStats.remove(MEM_GL_BUFFERS, instanceCapacity + commandCapacity);
+
+		commandID = 0;
+		instanceID = 0;
+		instanceCapacity = 0;
+		commandCapacity = 0;
+	}
+
+	uint32_t addProgram(Program* program) {
+		RenderProgram rp;
+		rp.program = program;
+		rp.proj = program->getUniform("proj");
+		rp.view = program->getUniform("view");
+		programs.push_back(rp);
+		return programs.size() - 1;
+	}
+
+	// The mesh has to be in its arena already
+	uint32_t addMesh(IGeometry* mesh) {
+		std::vector<IMeshArena*>::iterator it = std::find(arenas.begin(), arenas.end(), mesh->arena);
+
+		if (it == arenas.end()) {
+			arenas.push_back(mesh->arena);
+			arenaCommands.resize(arenas.size());
+			it = arenas.end() - 1;
+		}
+
+		meshes.push_back(mesh);
+		meshArenas.push_back(it - arenas.begin());
+		return meshes.size() - 1;
+	}
+
+	uint32_t addMaterial(const glm::vec4& color) {
+		Material material = { color };
+		materials.push_back(material);
+		return materials.size() - 1;
+	}
+
+	void begin(const glm::mat4& proj, const glm::mat4& view) {
+		this->proj = proj;
+		this->view = view;
+		packets.clear();
+	}
+
+	void submit(uint32_t program, uint32_t mesh, uint32_t material, const glm::mat4& model) {
+		DrawPacket packet;
+		packet.key =
+			((program & RQ_MASK(RQ_PROGRAM_BITS)) << RQ_PROGRAM_SHIFT) |
+			((mesh & RQ_MASK(RQ_MESH_BITS)) << RQ_MESH_SHIFT) |
+			(material & RQ_MASK(RQ_MATERIAL_BITS));
+		packet.model = model;
+		packets.push_back(packet);
+	}
+
+	// LSD radix sort on the 32 bit key, 8 bits per pass. Passes where every
+	// key shares the same digit are skipped, which is the common case
+	// since only a handful of programs and meshes exist.
+	void sort() {
+		uint32_t count = packets.size();
+
+		sortKeys.resize(count);
+		sortTemp.resize(count);
+
+		for (uint32_t i = 0; i < count; i++) {
+			sortKeys[i] = ((uint64_t)packets[i].key << 32) | i;
+		}
+
+		for (uint32_t pass = 0; pass < 4; pass++) {
+			uint32_t shift = 32 + pass * 8;
+			uint32_t histogram[256] = { 0 };
+
+			for (uint32_t i = 0; i < count; i++) {
+				histogram[(sortKeys[i] >> shift) & 0xFF]++;
+			}
+
+			if (count == 0 || histogram[(sortKeys[0] >> shift) & 0xFF] == count) {
+				continue;
+			}
+
+			uint32_t offset = 0;
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t c = histogram[i];
+				histogram[i] = offset;
+				offset += c;
+			}
+
+			for (uint32_t i = 0; i < count; i++) {
+				sortTemp[histogram[(sortKeys[i] >> shift) & 0xFF]++] = sortKeys[i];
+			}
+
+			sortKeys.swap(sortTemp);
+		}
+	}
+
+	// Sorted packets to instances, commands and per arena batches
+	void build() {
+		uint32_t count = sortKeys.size();
+
+		instances.resize(count);
+		commands.clear();
+		batches.clear();
+
+		uint32_t i = 0;
+
+		while (i < count) {
+			uint32_t programID = packets[sortKeys[i] & 0xFFFFFFFF].key >> RQ_PROGRAM_SHIFT;
+
+			for (uint32_t a = 0; a < arenaCommands.size(); a++) {
+				arenaCommands[a].clear();
+			}
+
+			// Everything up to the next program
+			while (i < count && (packets[sortKeys[i] & 0xFFFFFFFF].key >> RQ_PROGRAM_SHIFT) == programID) {
+				// Program and mesh, the material only changes the instance color
+				uint32_t group = packets[sortKeys[i] & 0xFFFFFFFF].key >> RQ_MESH_SHIFT;
+				uint32_t meshID = group & RQ_MASK(RQ_MESH_BITS);
+				uint32_t first = i;
+
+				while (i < count) {
+					DrawPacket& packet = packets[sortKeys[i] & 0xFFFFFFFF];
+
+					if ((packet.key >> RQ_MESH_SHIFT) != group) {
+						break;
+					}
+
+					instances[i] = InstanceVertex(packet.model, materials[packet.key & RQ_MASK(RQ_MATERIAL_BITS)].color);
+					i++;
+				}
+
+				MeshRange& range = meshes[meshID]->range;
+
+				DrawCommand command;
+				command.count = range.indexCount;
+				command.instanceCount = i - first;
+				command.firstIndex = range.firstIndex;
+				command.baseVertex = range.baseVertex;
+				command.baseInstance = first;
+
+				arenaCommands[meshArenas[meshID]].push_back(command);
+			}
+
+			for (uint32_t a = 0; a < arenaCommands.size(); a++) {
+				if (arenaCommands[a].empty()) {
+					continue;
+				}
+
+				DrawBatch batch;
+				batch.program = programID;
+				batch.arena = a;
+				batch.firstCommand = commands.size();
+				batch.commandCount = arenaCommands[a].size();
+				batches.push_back(batch);
+
+				commands.insert(commands.end(), arenaCommands[a].begin(), arenaCommands[a].end());
+			}
+		}
+	}
+
+	// Orphans the buffer every frame, it only grows
+	void upload(uint32_t buffer, uint64_t& capacity, uint64_t minimum, const void* data, uint64_t size) {
+		uint64_t newCapacity = std::max(capacity, minimum);
+
+		while (newCapacity < size) {
+			newCapacity *= 2;
+		}
+
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, newCapacity, nullptr, GL_STREAM_DRAW);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, 0, size, data);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+		memoryStats.resize(MEM_GL_BUFFERS, capacity, newCapacity);
+		capacity = newCapacity;
+	}
+
+	void flush() {
+		this->sort();
+		this->build();
+
+		stats = RenderQueueStats();
+		stats.packets = packets.size();
+		stats.commands = commands.size();
+
+		if (batches.empty()) {
+			return;
+		}
+
+		this->upload(instanceID, instanceCapacity, RQ_INSTANCE_CAPACITY * sizeof(InstanceVertex), instances.data(), instances.size() * sizeof(InstanceVertex));
+		this->upload(commandID, commandCapacity, RQ_COMMAND_CAPACITY * sizeof(DrawCommand), commands.data(), commands.size() * sizeof(DrawCommand));
+
+		VertexLayout& instanceLayout = vertex_getLayout<InstanceVertex>();
+		int32_t currProgram = -1;
+
+		if (multiDraw) {
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandID);
+		}
+
+		for (uint32_t i = 0; i < batches.size(); i++) {
+			DrawBatch& batch = batches[i];
+
+			if ((int32_t)batch.program != currProgram) {
+				RenderProgram& rp = programs[batch.program];
+				rp.program->bind();
+				rp.program->setMat4(rp.proj, proj);
+				rp.program->setMat4(rp.view, view);
+
+				currProgram = batch.program;
+				stats.programBinds++;
+			}
+
+			Program& program = *programs[currProgram].program;
+			IMeshArena* arena = arenas[batch.arena];
+
+			arena->bind(program);
+			stats.arenaBinds++;
+
+			glBindBuffer(GL_ARRAY_BUFFER, instanceID);
+
+			if (multiDraw) {
+				instanceLayout.pointer(program);
+
+				glMultiDrawElementsIndirect(
+					GL_TRIANGLES,
+					arena->getIndexType(),
+					(const void*)(uintptr_t)(batch.firstCommand * sizeof(DrawCommand)),
+					batch.commandCount,
+					0);
+				stats.drawCalls++;
+			}
+			else {
+				// Without base instance support the instance attributes are
+				// pointed at each command's first instance instead
+				for (uint32_t c = batch.firstCommand; c < batch.firstCommand + batch.commandCount; c++) {
+					DrawCommand& command = commands[c];
+
+					instanceLayout.pointer(program, command.baseInstance * sizeof(InstanceVertex));
+
+					glDrawElementsInstancedBaseVertex(
+						GL_TRIANGLES,
+						command.count,
+						arena->getIndexType(),
+						(const void*)(uintptr_t)(command.firstIndex * arena->getIndexSize()),
+						command.instanceCount,
+						command.baseVertex);
+					stats.drawCalls++;
+				}
+			}
+
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			arena->unbind(program);
+		}
+
+		if (multiDraw) {
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		}
+
+		programs[currProgram].program->unbind();
+	}
+};
+
+struct PhysicsObject {
+	btRigidBody* body;
+	int group;
+	int mask;
+};
+
+// Both are allocated once in Physics::init, nothing grows afterwards
+#define CONTACT_EVENT_CAPACITY 16384
+#define CONTACT_PAIR_CAPACITY 16384
+// Begin events at least this strong count as impacts in the stats
+#define CONTACT_IMPACT_IMPULSE 1.0f
+
+enum ContactEventType {
+	CE_BEGIN = 0,
+	CE_PERSIST,
+	CE_END
+};
+
+// objectA < objectB. End events carry the last known point and normal
+// and a zero impulse.
+struct ContactEvent {
+	uint8_t type;
+	const btCollisionObject* objectA;
+	const btCollisionObject* objectB;
+	float impulse;
+	btVector3 point;
+	btVector3 normal;
+};
+
+// Touching pair found in the dispatcher manifolds during one step
+struct ContactPair {
+	const btCollisionObject* objectA;
+	const btCollisionObject* objectB;
+	float impulse;
+	float depth;
+	btVector3 point;
+	btVector3 normal;
+
+	bool operator<(const ContactPair& other) const {
+		return (objectA != other.objectA) ? objectA < other.objectA : objectB < other.objectB;
+	}
+
+	bool samePair(const ContactPair& other) const {
+		return objectA == other.objectA && objectB == other.objectB;
+	}
+};
+
+// Fixed size ring buffer like InputQueue. Events written while it is
+// full are counted in dropped instead of overwriting unread ones.
+struct ContactEventQueue {
+	std::vector<ContactEvent> events;
+	uint32_t head = 0;
+	uint32_t tail = 0;
+	uint32_t dropped = 0;
+
+	void init() {
+		events.resize(CONTACT_EVENT_CAPACITY);
+		head = tail = 0;
+		dropped = 0;
+	}
+
+	bool isEmpty() {
+		return head == tail;
+	}
+
+	void push(uint8_t type, const ContactPair& pair) {
+		uint32_t next = (tail + 1) % CONTACT_EVENT_CAPACITY;
+
+		if (next == head) {
+			dropped++;
+			return;
+		}
+
+		ContactEvent& event = events[tail];
+		event.type = type;
+		event.objectA = pair.objectA;
+		event.objectB = pair.objectB;
+		event.impulse = (type == ContactEventType::CE_END) ? 0.0f : pair.impulse;
+		event.point = pair.point;
+		event.normal = pair.normal;
+		tail = next;
+	}
+
+	bool next(ContactEvent& event) {
+		if (head == tail) {
+			return false;
+		}
+
+		event = events[head];
+		head = (head + 1) % CONTACT_EVENT_CAPACITY;
+		return true;
+	}
+
+	void clear() {
+		head = tail = 0;
+	}
+};
+
+/*
+	Broadphases. Physics::init builds the one chosen in broadphaseType:
+	Bullet's dynamic AABB tree, its sweep and prune over fixed world bounds
+	with 16 or 32 bit handles, or the uniform grid below. Whichever it is
+	gets wrapped in a BroadphaseTimer so pair finding can be measured.
+*/
+enum BroadphaseType {
+	BP_DBVT = 0,
+	BP_AXIS_SWEEP,
+	BP_AXIS_SWEEP_32,
+	BP_GRID,
+	BP_COUNT
+};
+
+static const char* broadphaseNames[BP_COUNT] = {
+	"dbvt",
+	"sap",
+	"sap32",
+	"grid"
+};
+
+// Bounds of the sweep and prune broadphases, bodies outside are clamped
+// to the border and pair finding degrades there
+#define PHYSICS_WORLD_MIN btVector3(-1024.0f, -256.0f, -1024.0f)
+#define PHYSICS_WORLD_MAX btVector3(1024.0f, 1024.0f, 1024.0f)
+// Bodies the sweeps can hold, 16 bit handles stop short of 32768
+#define PHYSICS_SAP_HANDLES 32766
+#define PHYSICS_SAP32_HANDLES 262144
+
+// Grid cell edge, twice the unit bodies so most sit in one to eight cells
+#define GRID_CELL_SIZE 4.0f
+// Proxies spanning more cells on an axis are tested against every proxy
+#define GRID_MAX_SPAN 8
+// Cell coordinates are biased into 21 bits, three of them make a key
+#define GRID_COORD_BITS 21
+#define GRID_COORD_BIAS (1 << (GRID_COORD_BITS - 1))
+#define GRID_COORD_MASK ((1ull << GRID_COORD_BITS) - 1)
+// Cells or proxies a worker takes from the shared cursor at once
+#define GRID_BATCH 64
+// Radix digit, small enough that clearing the histogram each pass is cheap
+#define GRID_SORT_BITS 11
+#define GRID_SORT_MASK ((1u << GRID_SORT_BITS) - 1)
+#define GRID_MAX_THREADS 8
+
+BroadphaseType broadphase_fromName(std::string name) {
+	for (uint32_t i = 0; i < BP_COUNT; i++) {
+		if (name == broadphaseNames[i]) {
+			return (BroadphaseType)i;
+		}
+	}
+
+	std::cout << "Unknown broadphase " << name << ", using " << broadphaseNames[BP_DBVT] << std::endl;
+	return BP_DBVT;
+}
+
+// Forwards everything to another broadphase and adds up the time spent
+// finding pairs, Physics resets it every step
+struct BroadphaseTimer : public btBroadphaseInterface {
+	btBroadphaseInterface* inner;
+	double ms = 0.0;
+
+	BroadphaseTimer(btBroadphaseInterface* inner) : inner(inner) {}
+
+	virtual btBroadphaseProxy* createProxy(const btVector3& aabbMin, const btVector3& aabbMax, int shapeType, void* userPtr, int collisionFilterGroup, int collisionFilterMask, btDispatcher* dispatcher) {
+		return inner->createProxy(aabbMin, aabbMax, shapeType, userPtr, collisionFilterGroup, collisionFilterMask, dispatcher);
+	}
+
+	virtual void destroyProxy(btBroadphaseProxy* proxy, btDispatcher* dispatcher) {
+		inner->destroyProxy(proxy, dispatcher);
+	}
+
+	virtual void setAabb(btBroadphaseProxy* proxy, const btVector3& aabbMin, const btVector3& aabbMax, btDispatcher* dispatcher) {
+		inner->setAabb(proxy, aabbMin, aabbMax, dispatcher);
+	}
+
+	virtual void getAabb(btBroadphaseProxy* proxy, btVector3& aabbMin, btVector3& aabbMax) const {
+		inner->getAabb(proxy, aabbMin, aabbMax);
+	}
+
+	virtual void rayTest(const btVector3& rayFrom, const btVector3& rayTo, btBroadphaseRayCallback& rayCallback, const btVector3& aabbMin, const btVector3& aabbMax) {
+		inner->rayTest(rayFrom, rayTo, rayCallback, aabbMin, aabbMax);
+	}
+
+	virtual void aabbTest(const btVector3& aabbMin, const btVector3& aabbMax, btBroadphaseAabbCallback& callback) {
+		inner->aabbTest(aabbMin, aabbMax, callback);
+	}
+
+	virtual void calculateOverlappingPairs(btDispatcher* dispatcher) {
+		uint64_t start = SDL_GetPerformanceCounter();
+		inner->calculateOverlappingPairs(dispatcher);
+		ms += util_milliseconds(start, SDL_GetPerformanceCounter());
+	}
+
+	virtual btOverlappingPairCache* getOverlappingPairCache() {
+		return inner->getOverlappingPairCache();
+	}
+
+	virtual const btOverlappingPairCache* getOverlappingPairCache() const {
+		return inner->getOverlappingPairCache();
+	}
+
+	virtual void getBroadphaseAabb(btVector3& aabbMin, btVector3& aabbMax) const {
+		inner->getBroadphaseAabb(aabbMin, aabbMax);
+	}
+
+	virtual void resetPool(btDispatcher* dispatcher) {
+		inner->resetPool(dispatcher);
+	}
+
+	virtual void printStats() {
+		inner->printStats();
+	}
+};
+
+struct GridProxy : public btBroadphaseProxy {
+	// Position in GridBroadphase::proxies
+	uint32_t index = 0;
+	// Spans more than GRID_MAX_SPAN cells, set while binning
+	bool large = false;
+
+	GridProxy(const btVector3& aabbMin, const btVector3& aabbMax, void* userPtr, int collisionFilterGroup, int collisionFilterMask)
+		: btBroadphaseProxy(aabbMin, aabbMax, userPtr, collisionFilterGroup, collisionFilterMask) {}
+};
+
+// One proxy in one cell, the key packs the cell's x, y and z
+struct GridEntry {
+	uint64_t key;
+	uint32_t proxy;
+};
+
+// Drops cached pairs whose boxes stopped overlapping
+struct GridPairCleaner : public btOverlapCallback {
+	virtual bool processOverlap(btBroadphasePair& pair) {
+		return !TestAabbAgainstAabb2(
+			pair.m_pProxy0->m_aabbMin, pair.m_pProxy0->m_aabbMax,
+			pair.m_pProxy1->m_aabbMin, pair.m_pProxy1->m_aabbMax);
+	}
+};
+
+/*
+	Uniform grid broadphase. Every step each proxy is put in the cells its
+	box touches, the entries are sorted by cell and the proxies sharing a
+	cell are tested against each other. A pair sharing several cells is
+	only reported by the cell holding the low corner of their overlap.
+	Binning and testing run on a pool of threads, only sorting and the
+	pair cache update are serial. Boxes spanning many cells (planes,
+	levels) skip the grid and are tested against every proxy.
+*/
+struct GridBroadphase : public btBroadphaseInterface {
+	btHashedOverlappingPairCache* pairCache;
+	float cellSize;
+	std::vector<GridProxy*> proxies;
+	int nextId = 1;
+
+	// Rebuilt every step, the thread vectors are indexed by thread
+	std::vector<std::vector<GridEntry>> threadEntries;
+	std::vector<std::vector<std::pair<GridProxy*, GridProxy*>>> threadPairs;
+	std::vector<GridEntry> entries;
+	std::vector<GridEntry> sortTemp;
+	// One count per digit value, kept between steps
+	std::vector<uint32_t> histogram;
+	// First and one past the last entry of every cell holding two or more
+	std::vector<std::pair<uint32_t, uint32_t>> cells;
+	std::vector<GridProxy*> large;
+	std::atomic<uint32_t> cellCursor;
+	std::atomic<uint32_t> proxyCursor;
+
+	// Worker pool, the calling thread works as thread 0
+	uint32_t threadCount = 1;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::condition_variable doneCond;
+	std::function<void(uint32_t)> job;
+	uint32_t generation = 0;
+	uint32_t pending = 0;
+	bool running = true;
+
+	GridBroadphase(float cellSize = GRID_CELL_SIZE) : cellSize(cellSize), cellCursor(0), proxyCursor(0) {
+		pairCache = new btHashedOverlappingPairCache();
+		histogram.resize(1 << GRID_SORT_BITS);
+
+		threadCount = std::min(std::max(std::thread::hardware_concurrency(), 1u), (uint32_t)GRID_MAX_THREADS);
+		threadEntries.resize(threadCount);
+		threadPairs.resize(threadCount);
+
+		for (uint32_t i = 1; i < threadCount; i++) {
+			workers.push_back(std::thread([this, i]() { this->work(i); }));
+		}
+	}
+
+	virtual ~GridBroadphase() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		cond.notify_all();
+
+		std::for_each(workers.begin(), workers.end(), [&](std::thread& thread) {
+			thread.join();
+		});
+
+		for (uint32_t i = 0; i < proxies.size(); i++) {
+			delete proxies[i];
+		}
+
+		delete pairCache;
+	}
+
+	// Worker Thread
+	void work(uint32_t thread) {
+		uint32_t seen = 0;
+
+		while (true) {
+			std::function<void(uint32_t)> current;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cond.wait(lock, [&]() { return !running || generation != seen; });
+
+				if (!running) {
+					return;
+				}
+
+				seen = generation;
+				current = job;
+			}
+
+			current(thread);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				pending--;
+			}
+			doneCond.notify_one();
+		}
+	}
+
+	// Runs job on every thread and returns once all of them finished
+	void run(std::function<void(uint32_t)> job) {
+		if (workers.empty()) {
+			job(0);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			this->job = job;
+			pending = workers.size();
+			generation++;
+		}
+		cond.notify_all();
+
+		job(0);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		doneCond.wait(lock, [&]() { return pending == 0; });
+	}
+
+	uint32_t getCoord(btScalar v) const {
+		btScalar cell = floor(v / cellSize);
+		cell = std::min(std::max(cell, (btScalar)-GRID_COORD_BIAS), (btScalar)(GRID_COORD_BIAS - 1));
+		return (uint32_t)((int32_t)cell + GRID_COORD_BIAS);
+	}
+
+	static uint64_t getKey(uint32_t x, uint32_t y, uint32_t z) {
+		return ((uint64_t)x << (GRID_COORD_BITS * 2)) | ((uint64_t)y << GRID_COORD_BITS) | z;
+	}
+
+	static bool needsPair(const GridProxy* a, const GridProxy* b) {
+		return (a->m_collisionFilterGroup & b->m_collisionFilterMask) != 0 &&
+			(b->m_collisionFilterGroup & a->m_collisionFilterMask) != 0;
+	}
+
+	static bool overlaps(const GridProxy* a, const GridProxy* b) {
+		return TestAabbAgainstAabb2(a->m_aabbMin, a->m_aabbMax, b->m_aabbMin, b->m_aabbMax);
+	}
+
+	// Proxies of one contiguous share into cell entries
+	void bin(uint32_t thread) {
+		std::vector<GridEntry>& out = threadEntries[thread];
+		out.clear();
+
+		uint32_t begin = (uint64_t)proxies.size() * thread / threadCount;
+		uint32_t end = (uint64_t)proxies.size() * (thread + 1) / threadCount;
+
+		for (uint32_t i = begin; i < end; i++) {
+			GridProxy* proxy = proxies[i];
+
+			uint32_t x0 = getCoord(proxy->m_aabbMin.x());
+			uint32_t y0 = getCoord(proxy->m_aabbMin.y());
+			uint32_t z0 = getCoord(proxy->m_aabbMin.z());
+			uint32_t x1 = getCoord(proxy->m_aabbMax.x());
+			uint32_t y1 = getCoord(proxy->m_aabbMax.y());
+			uint32_t z1 = getCoord(proxy->m_aabbMax.z());
+
+			proxy->large = (x1 - x0 >= GRID_MAX_SPAN || y1 - y0 >= GRID_MAX_SPAN || z1 - z0 >= GRID_MAX_SPAN);
+
+			if (proxy->large) {
+				continue;
+			}
+
+			for (uint32_t x = x0; x <= x1; x++) {
+				for (uint32_t y = y0; y <= y1; y++) {
+					for (uint32_t z = z0; z <= z1; z++) {
+						GridEntry entry = { getKey(x, y, z), i };
+						out.push_back(entry);
+					}
+				}
+			}
+		}
+	}
+
+	// LSD radix sort by key, GRID_SORT_BITS per pass, passes where every
+	// key shares the digit are skipped like in RenderQueue::sort
+	void sortEntries() {
+		uint32_t count = entries.size();
+		sortTemp.resize(count);
+
+		for (uint32_t shift = 0; shift < GRID_COORD_BITS * 3; shift += GRID_SORT_BITS) {
+			std::fill(histogram.begin(), histogram.end(), 0);
+
+			for (uint32_t i = 0; i < count; i++) {
+				histogram[(entries[i].key >> shift) & GRID_SORT_MASK]++;
+			}
+
+			if (count == 0 || histogram[(entries[0].key >> shift) & GRID_SORT_MASK] == count) {
+				continue;
+			}
+
+			uint32_t offset = 0;
+			for (uint32_t i = 0; i < histogram.size(); i++) {
+				uint32_t c = histogram[i];
+				histogram[i] = offset;
+				offset += c;
+			}
+
+			for (uint32_t i = 0; i < count; i++) {
+				sortTemp[histogram[(entries[i].key >> shift) & GRID_SORT_MASK]++] = entries[i];
+			}
+
+			entries.swap(sortTemp);
+		}
+	}
+
+	// Pairs inside shared cells, then pairs with large proxies
+	void test(uint32_t thread) {
+		std::vector<std::pair<GridProxy*, GridProxy*>>& out = threadPairs[thread];
+		out.clear();
+
+		uint32_t batch;
+
+		while ((batch = cellCursor.fetch_add(GRID_BATCH)) < cells.size()) {
+			uint32_t batchEnd = std::min(batch + GRID_BATCH, (uint32_t)cells.size());
+
+			for (uint32_t c = batch; c < batchEnd; c++) {
+				uint64_t key = entries[cells[c].first].key;
+
+				for (uint32_t i = cells[c].first; i < cells[c].second; i++) {
+					GridProxy* a = proxies[entries[i].proxy];
+
+					for (uint32_t j = i + 1; j < cells[c].second; j++) {
+						GridProxy* b = proxies[entries[j].proxy];
+
+						if (!needsPair(a, b) || !overlaps(a, b)) {
+							continue;
+						}
+
+						uint64_t corner = getKey(
+							getCoord(std::max(a->m_aabbMin.x(), b->m_aabbMin.x())),
+							getCoord(std::max(a->m_aabbMin.y(), b->m_aabbMin.y())),
+							getCoord(std::max(a->m_aabbMin.z(), b->m_aabbMin.z())));
+
+						if (corner == key) {
+							out.push_back(std::make_pair(a, b));
+						}
+					}
+				}
+			}
+		}
+
+		if (large.empty()) {
+			return;
+		}
+
+		while ((batch = proxyCursor.fetch_add(GRID_BATCH)) < proxies.size()) {
+			uint32_t batchEnd = std::min(batch + GRID_BATCH, (uint32_t)proxies.size());
+
+			for (uint32_t i = batch; i < batchEnd; i++) {
+				GridProxy* a = proxies[i];
+
+				for (uint32_t l = 0; l < large.size(); l++) {
+					GridProxy* b = large[l];
+
+					// Two large proxies meet twice, keep one
+					if (a->large && a->index >= b->index) {
+						continue;
+					}
+
+					if (needsPair(a, b) && overlaps(a, b)) {
+						out.push_back(std::make_pair(a, b));
+					}
+				}
+			}
+		}
+	}
+
+	virtual btBroadphaseProxy* createProxy(const btVector3& aabbMin, const btVector3& aabbMax, int shapeType, void* userPtr, int collisionFilterGroup, int collisionFilterMask, btDispatcher* dispatcher) {
+		GridProxy* proxy = new GridProxy(aabbMin, aabbMax, userPtr, collisionFilterGroup, collisionFilterMask);
+		proxy->m_uniqueId = nextId++;
+		proxy->index = proxies.size();
+		proxies.push_back(proxy);
+		return proxy;
+	}
+
+	virtual void destroyProxy(btBroadphaseProxy* proxy, btDispatcher* dispatcher) {
+		GridProxy* gridProxy = (GridProxy*)proxy;
+
+		pairCache->removeOverlappingPairsContainingProxy(gridProxy, dispatcher);
+
+		GridProxy* last = proxies.back();
+		proxies[gridProxy->index] = last;
+		last->index = gridProxy->index;
+		proxies.pop_back();
+
+		delete gridProxy;
+	}
+
+	virtual void setAabb(btBroadphaseProxy* proxy, const btVector3& aabbMin, const btVector3& aabbMax, btDispatcher* dispatcher) {
+		proxy->m_aabbMin = aabbMin;
+		proxy->m_aabbMax = aabbMax;
+	}
+
+	virtual void getAabb(btBroadphaseProxy* proxy, btVector3& aabbMin, btVector3& aabbMax) const {
+		aabbMin = proxy->m_aabbMin;
+		aabbMax = proxy->m_aabbMax;
+	}
+
+	// Rays and box queries are rare next to pair finding, they test every
+	// proxy
+	virtual void rayTest(const btVector3& rayFrom, const btVector3& rayTo, btBroadphaseRayCallback& rayCallback, const btVector3& aabbMin, const btVector3& aabbMax) {
+		for (uint32_t i = 0; i < proxies.size(); i++) {
+			GridProxy* proxy = proxies[i];
+			btVector3 bounds[2] = { proxy->m_aabbMin - aabbMax, proxy->m_aabbMax - aabbMin };
+			btScalar lambda = 0;
+
+			if (btRayAabb2(rayFrom, rayCallback.m_rayDirectionInverse, rayCallback.m_signs, bounds, lambda, 0, rayCallback.m_lambda_max)) {
+				rayCallback.process(proxy);
+			}
+		}
+	}
+
+	virtual void aabbTest(const btVector3& aabbMin, const btVector3& aabbMax, btBroadphaseAabbCallback& callback) {
+		for (uint32_t i = 0; i < proxies.size(); i++) {
+			GridProxy* proxy = proxies[i];
+
+			if (TestAabbAgainstAabb2(aabbMin, aabbMax, proxy->m_aabbMin, proxy->m_aabbMax)) {
+				callback.process(proxy);
+			}
+		}
+	}
+
+	virtual void calculateOverlappingPairs(btDispatcher* dispatcher) {
+		this->run([&](uint32_t thread) { this->bin(thread); });
+
+		entries.clear();
+		large.clear();
+
+		for (uint32_t t = 0; t < threadCount; t++) {
+			entries.insert(entries.end(), threadEntries[t].begin(), threadEntries[t].end());
+		}
+
+		for (uint32_t i = 0; i < proxies.size(); i++) {
+			if (proxies[i]->large) {
+				large.push_back(proxies[i]);
+			}
+		}
+
+		this->sortEntries();
+
+		cells.clear();
+
+		for (uint32_t i = 0; i < entries.size();) {
+			uint32_t start = i;
+
+			while (i < entries.size() && entries[i].key == entries[start].key) {
+				i++;
+			}
+
+			if (i - start > 1) {
+				cells.push_back(std::make_pair(start, i));
+			}
+		}
+
+		cellCursor = 0;
+		proxyCursor = 0;
+		this->run([&](uint32_t thread) { this->test(thread); });
+
+		GridPairCleaner cleaner;
+		pairCache->processAllOverlappingPairs(&cleaner, dispatcher);
+
+		// Returns the existing pair when it is already cached
+		for (uint32_t t = 0; t < threadCount; t++) {
+			std::vector<std::pair<GridProxy*, GridProxy*>>& pairs = threadPairs[t];
+
+			for (uint32_t i = 0; i < pairs.size(); i++) {
+				pairCache->addOverlappingPair(pairs[i].first, pairs[i].second);
+			}
+		}
+	}
+
+	virtual btOverlappingPairCache* getOverlappingPairCache() {
+		return pairCache;
+	}
+
+	virtual const btOverlappingPairCache* getOverlappingPairCache() const {
+		return pairCache;
+	}
+
+	virtual void getBroadphaseAabb(btVector3& aabbMin, btVector3& aabbMax) const {
+		aabbMin.setValue(-BT_LARGE_FLOAT, -BT_LARGE_FLOAT, -BT_LARGE_FLOAT);
+		aabbMax.setValue(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+
+		if (proxies.empty()) {
+			return;
+		}
+
+		aabbMin = proxies[0]->m_aabbMin;
+		aabbMax = proxies[0]->m_aabbMax;
+
+		for (uint32_t i = 1; i < proxies.size(); i++) {
+			aabbMin.setMin(proxies[i]->m_aabbMin);
+			aabbMax.setMax(proxies[i]->m_aabbMax);
+		}
+	}
+
+	virtual void printStats() {
+		std::cout << "Grid broadphase: " << proxies.size() << " proxies, " << large.size() << " large, "
+			<< entries.size() << " cell entries, " << cells.size() << " shared cells, "
+			<< threadCount << " threads" << std::endl;
+	}
+};
+
+// Fewest bodies per thread when createRigidBodies computes inertia
+#define PHYSICS_BULK_GRAIN 4096
+
+struct Physics {
+	btBroadphaseInterface* broadphase;
+	// Set when broadphase is the tree, for the bulk insert in createRigidBodies
+	btDbvtBroadphase* dbvt = nullptr;
+	// What the world talks to, wraps broadphase and times pair finding
+	BroadphaseTimer* broadphaseTimer = nullptr;
+	btCollisionDispatcher* disp;
+	btConstraintSolver* solver;
+	btDefaultCollisionConfiguration* collisionConf;
+	btDiscreteDynamicsWorld* dynamicWorld;
+	btGhostPairCallback* ghostPairCallback;
+
+	std::vector<PhysicsObject> physicsObjects;
+
+	// Called before every internal sub-step
+	void (*preTick)(btScalar timeStep) = nullptr;
+
+	// Internal sub-steps per fixed frame
+	int substeps = PHYSICS_SUBSTEPS;
+
+	// Broadphase built by init, the sweeps only cover worldMin to worldMax
+	BroadphaseType broadphaseType = BP_DBVT;
+	btVector3 worldMin = PHYSICS_WORLD_MIN;
+	btVector3 worldMax = PHYSICS_WORLD_MAX;
+
+	// Swept sphere CCD for dynamic bodies, see setupCcd
+	bool ccd = true;
+	uint32_t ccdBodies = 0;
+
+	// Contact begin/persist/end events, diffed after every step
+	bool contactEvents = true;
+	ContactEventQueue contacts;
+	std::vector<ContactPair> currentPairs;
+	std::vector<ContactPair> previousPairs;
+	uint32_t currentCount = 0;
+	uint32_t previousCount = 0;
+	uint32_t pairsDropped = 0;
+
+	void init() {
+		this->ccdBodies = 0;
+
+		this->contacts.init();
+		this->currentPairs.resize(CONTACT_PAIR_CAPACITY);
+		this->previousPairs.resize(CONTACT_PAIR_CAPACITY);
+		this->currentCount = 0;
+		this->previousCount = 0;
+		this->pairsDropped = 0;
+
+		uint32_t category = memory_setCategory(MEM_WORLD);
+
+		this->collisionConf = new btDefaultCollisionConfiguration();
+		this->disp = new btCollisionDispatcher(this->collisionConf);
+		this->dbvt = nullptr;
+
+		switch (this->broadphaseType) {
+		case BP_AXIS_SWEEP:
+			this->broadphase = new btAxisSweep3(this->worldMin, this->worldMax, PHYSICS_SAP_HANDLES);
+			break;
+		case BP_AXIS_SWEEP_32:
+			this->broadphase = new bt32BitAxisSweep3(this->worldMin, this->worldMax, PHYSICS_SAP32_HANDLES);
+			break;
+		case BP_GRID:
+			this->broadphase = new GridBroadphase();
+			break;
+		default:
+			this->dbvt = new btDbvtBroadphase();
+			this->broadphase = this->dbvt;
+			break;
+		}
+
+		this->broadphaseTimer = new BroadphaseTimer(this->broadphase);
+		this->solver = new btSequentialImpulseConstraintSolver;
+		this->dynamicWorld = new btDiscreteDynamicsWorld(
+			disp,
+			broadphaseTimer,
+			this->solver,
+			this->collisionConf
+		);
+
+		dynamicWorld->setGravity(btVector3(0, -10, 0));
+		dynamicWorld->setInternalTickCallback(Physics::internalPreTick, this, true);
+
+		// Keeps the overlapping pair cache of ghost objects up to date
+		this->ghostPairCallback = new btGhostPairCallback();
+		broadphase->getOverlappingPairCache()->setInternalGhostPairCallback(this->ghostPairCallback);
+
+		memory_setCategory(category);
+	}
+
+	// Objects the broadphase can hold, the sweeps have fixed handle arrays
+	uint32_t getBroadphaseCapacity() {
+		switch (this->broadphaseType) {
+		case BP_AXIS_SWEEP:
+			return PHYSICS_SAP_HANDLES;
+		case BP_AXIS_SWEEP_32:
+			return PHYSICS_SAP32_HANDLES;
+		default:
+			return UINT32_MAX;
+		}
+	}
+
+	// Called before count objects are added. A sweep running out of
+	// handles asserts or overruns its array, so before that happens every
+	// proxy moves over to a tree, which has no limit.
+	void reserveProxies(uint32_t count) {
+		uint32_t capacity = this->getBroadphaseCapacity();
+
+		if ((uint64_t)dynamicWorld->getNumCollisionObjects() + count <= capacity) {
+			return;
+		}
+
+		std::cout << "Physics: " << broadphaseNames[broadphaseType] << " holds " << capacity
+			<< " objects, switching to " << broadphaseNames[BP_DBVT] << std::endl;
+
+		uint32_t category = memory_setCategory(MEM_WORLD);
+
+		btAlignedObjectArray<btCollisionObject*>& objects = dynamicWorld->getCollisionObjectArray();
+		std::vector<int> groups(objects.size());
+		std::vector<int> masks(objects.size());
+
+		// Destroying the proxies also drops their pairs and manifolds
+		for (int i = 0; i < objects.size(); i++) {
+			btBroadphaseProxy* proxy = objects[i]->getBroadphaseHandle();
+			groups[i] = proxy->m_collisionFilterGroup;
+			masks[i] = proxy->m_collisionFilterMask;
+			broadphase->destroyProxy(proxy, disp);
+			objects[i]->setBroadphaseHandle(nullptr);
+		}
+
+		delete this->broadphase;
+
+		this->broadphaseType = BP_DBVT;
+		this->dbvt = new btDbvtBroadphase();
+		this->broadphase = this->dbvt;
+		this->broadphaseTimer->inner = this->broadphase;
+		broadphase->getOverlappingPairCache()->setInternalGhostPairCallback(this->ghostPairCallback);
+
+		for (int i = 0; i < objects.size(); i++) {
+			btCollisionShape* shape = objects[i]->getCollisionShape();
+			btVector3 aabbMin;
+			btVector3 aabbMax;
+			shape->getAabb(objects[i]->getWorldTransform(), aabbMin, aabbMax);
+
+			objects[i]->setBroadphaseHandle(broadphase->createProxy(
+				aabbMin, aabbMax, shape->getShapeType(), objects[i], groups[i], masks[i], disp));
+		}
+
+		memory_setCategory(category);
+	}
+
+	static void internalPreTick(btDynamicsWorld* world, btScalar timeStep) {
+		Physics* physics = (Physics*)world->getWorldUserInfo();
+
+		if (physics->preTick != nullptr) {
+			physics->preTick(timeStep);
+		}
+	}
+
+	btDiscreteDynamicsWorld* getWorld() { return this->dynamicWorld; }
+
+	void stepSimulation() {
+		// Manifolds, pair cache growth and solver pools
+		uint32_t category = memory_setCategory(MEM_SIMULATION);
+		this->broadphaseTimer->ms = 0.0;
+		this->getWorld()->stepSimulation(FIXED_FRAME_60, this->substeps, FIXED_FRAME_60 / this->substeps);
+		memory_setCategory(category);
+
+		if (this->contactEvents) {
+			this->updateContacts();
+		}
+	}
+
+	// Collects every touching pair from the manifolds, sorts them and
+	// walks them against last step's sorted pairs. Only in this step is a
+	// begin, in both is a persist, only in last step is an end.
+	void updateContacts() {
+		std::swap(currentPairs, previousPairs);
+		previousCount = currentCount;
+		currentCount = 0;
+
+		int manifolds = disp->getNumManifolds();
+
+		for (int i = 0; i < manifolds; i++) {
+			btPersistentManifold* manifold = disp->getManifoldByIndexInternal(i);
+			int points = manifold->getNumContacts();
+
+			if (points == 0) {
+				continue;
+			}
+
+			if (currentCount >= CONTACT_PAIR_CAPACITY) {
+				pairsDropped++;
+				continue;
+			}
+
+			const btCollisionObject* a = manifold->getBody0();
+			const btCollisionObject* b = manifold->getBody1();
+			bool swapped = b < a;
+
+			ContactPair& pair = currentPairs[currentCount++];
+			pair.objectA = swapped ? b : a;
+			pair.objectB = swapped ? a : b;
+			pair.impulse = 0.0f;
+			pair.depth = BT_LARGE_FLOAT;
+
+			// Total impulse, position and normal of the deepest point
+			for (int p = 0; p < points; p++) {
+				const btManifoldPoint& point = manifold->getContactPoint(p);
+				pair.impulse += point.getAppliedImpulse();
+
+				if (point.getDistance() < pair.depth) {
+					pair.depth = point.getDistance();
+					pair.point = point.getPositionWorldOnB();
+					pair.normal = swapped ? -point.m_normalWorldOnB : point.m_normalWorldOnB;
+				}
+			}
+		}
+
+		std::sort(currentPairs.begin(), currentPairs.begin() + currentCount);
+
+		// Compound shapes can give one pair several manifolds
+		uint32_t merged = 0;
+
+		for (uint32_t i = 0; i < currentCount; i++) {
+			if (merged > 0 && currentPairs[merged - 1].samePair(currentPairs[i])) {
+				ContactPair& pair = currentPairs[merged - 1];
+				pair.impulse += currentPairs[i].impulse;
+
+				if (currentPairs[i].depth < pair.depth) {
+					pair.depth = currentPairs[i].depth;
+					pair.point = currentPairs[i].point;
+					pair.normal = currentPairs[i].normal;
+				}
+				continue;
+			}
+
+			currentPairs[merged++] = currentPairs[i];
+		}
+
+		currentCount = merged;
+
+		uint32_t c = 0;
+		uint32_t p = 0;
+
+		while (c < currentCount || p < previousCount) {
+			if (p >= previousCount || (c < currentCount && currentPairs[c] < previousPairs[p])) {
+				contacts.push(ContactEventType::CE_BEGIN, currentPairs[c++]);
+			}
+			else if (c >= currentCount || previousPairs[p] < currentPairs[c]) {
+				contacts.push(ContactEventType::CE_END, previousPairs[p++]);
+			}
+			else {
+				contacts.push(ContactEventType::CE_PERSIST, currentPairs[c++]);
+				p++;
+			}
+		}
+	}
+
+	// Forgets pairs of an object that is about to be deleted, so no end
+	// event is sent with a dangling pointer
+	void forgetContacts(const btCollisionObject* object) {
+		uint32_t kept = 0;
+
+		for (uint32_t i = 0; i < currentCount; i++) {
+			if (currentPairs[i].objectA != object && currentPairs[i].objectB != object) {
+				currentPairs[kept++] = currentPairs[i];
+			}
+		}
+
+		currentCount = kept;
+	}
+
+	// Bullet only sweeps a body when it moves further than the motion
+	// threshold in one sub-step, so slow bodies keep the cheap discrete
+	// path and only fast movers pay for the sweep. The threshold is half
+	// the thinnest extent of the shape and the swept sphere sits inside it.
+	void setupCcd(btRigidBody* body, btCollisionShape* shape) {
+		if (!this->ccd || body->isStaticOrKinematicObject()) {
+			return;
+		}
+
+		btVector3 minAABB;
+		btVector3 maxAABB;
+		btTransform identity;
+		identity.setIdentity();
+		shape->getAabb(identity, minAABB, maxAABB);
+
+		btVector3 halfExtents = (maxAABB - minAABB) * 0.5f;
+		btScalar thinnest = std::min(halfExtents.x(), std::min(halfExtents.y(), halfExtents.z()));
+
+		body->setCcdMotionThreshold(thinnest * 0.5f);
+		body->setCcdSweptSphereRadius(thinnest * 0.8f);
+
+		this->ccdBodies++;
+	}
+
+	btBoxShape* createBoxShape(const btVector3& halfExtents) {
+		uint32_t category = memory_setCategory(MEM_SHAPES);
+		btBoxShape* box = new btBoxShape(halfExtents);
+		memory_setCategory(category);
+		return box;
+	}
+
+	btSphereShape* createSphereShape(btScalar scalar) {
+		uint32_t category = memory_setCategory(MEM_SHAPES);
+		btSphereShape* sphere = new btSphereShape(scalar);
+		memory_setCategory(category);
+		return sphere;
+	}
+
+	btStaticPlaneShape* createStaticPlaneShape(const btVector3& planeNormal, btScalar planeConstant) {
+		uint32_t category = memory_setCategory(MEM_SHAPES);
+		btStaticPlaneShape* plane = new btStaticPlaneShape(planeNormal, planeConstant);
+		memory_setCategory(category);
+		return plane;
+	}
+
+	btCapsuleShape* createCapsuleShape(btScalar radius, btScalar height) {
+		uint32_t category = memory_setCategory(MEM_SHAPES);
+		btCapsuleShape* capsule = new btCapsuleShape(radius, height);
+		memory_setCategory(category);
+		return capsule;
+	}
+
+	btRigidBody* createRigid(float mass, const btTransform& startTransform, btCollisionShape* shape) {
+		bool isDynamic = (mass != 0.f);
+
+		btVector3 localInertial(0, 0, 0);
+
+		if (isDynamic) {
+			shape->calculateLocalInertia(mass, localInertial);
+		}
+
+		this->reserveProxies(1);
+
+		uint32_t category = memory_setCategory(MEM_BODIES);
+
+		btDefaultMotionState* ms = new btDefaultMotionState(startTransform);
+
+		btRigidBody::btRigidBodyConstructionInfo cinfo(mass, ms, shape, localInertial);
+
+		btRigidBody* body = new btRigidBody(cinfo);
+
+		body->setUserIndex(-1);
+
+		if (isDynamic) {
+			this->setupCcd(body, shape);
+		}
+
+		PhysicsObject po = {
+			body,
+			-1,
+			-1
+		};
+
+		physicsObjects.push_back(po);
+
+		this->getWorld()->addRigidBody(po.body);
+		//this->rigidBodies.push_back(body);
+
+		memory_setCategory(category);
+
+		return body;
+	}
+
+	btRigidBody* createRigid(float mass, const btTransform& startTransform, btCollisionShape* shape, int collisionFilterGroup, int mask) {
+		bool isDynamic = (mass != 0.f);
+
+		btVector3 localInertial(0, 0, 0);
+
+		if (isDynamic) {
+			shape->calculateLocalInertia(mass, localInertial);
+		}
+
+		this->reserveProxies(1);
+
+		uint32_t category = memory_setCategory(MEM_BODIES);
+
+		btDefaultMotionState* ms = new btDefaultMotionState(startTransform);
+
+		btRigidBody::btRigidBodyConstructionInfo cinfo(mass, ms, shape, localInertial);
+
+		btRigidBody* body = new btRigidBody(cinfo);
+
+		//body->setUserIndex(-1);
+
+		if (isDynamic) {
+			this->setupCcd(body, shape);
+		}
+
+		PhysicsObject po = {
+			body,
+			collisionFilterGroup,
+			mask
+		};
+
+		physicsObjects.push_back(po);
+
+		this->getWorld()->addRigidBody(body,collisionFilterGroup, mask);
+
+		memory_setCategory(category);
+
+		return body;
+	}
+
+	// Creates count bodies at once, bodies receives them in order. Inertia
+	// is computed on several threads, then every body is inserted without
+	// querying the tree, the tree is rebuilt top-down from all its leaves
+	// and the new pairs are found by one tree against tree pass.
+	void createRigidBodies(
+		uint32_t count,
+		btCollisionShape* const* shapes,
+		const btTransform* transforms,
+		const float* masses,
+		int collisionFilterGroup,
+		int mask,
+		btRigidBody** bodies) {
+
+		this->reserveProxies(count);
+
+		std::vector<btVector3> inertia(count);
+
+		std::function<void(uint32_t, uint32_t)> computeInertia = [&](uint32_t begin, uint32_t end) {
+			for (uint32_t i = begin; i < end; i++) {
+				inertia[i].setValue(0, 0, 0);
+
+				if (masses[i] != 0.f) {
+					shapes[i]->calculateLocalInertia(masses[i], inertia[i]);
+				}
+			}
+		};
+
+		uint32_t threads = std::min(std::max(std::thread::hardware_concurrency(), 1u), std::max(count / PHYSICS_BULK_GRAIN, 1u));
+
+		if (threads == 1) {
+			computeInertia(0, count);
+		}
+		else {
+			std::vector<std::thread> pool;
+
+			for (uint32_t t = 0; t < threads; t++) {
+				pool.push_back(std::thread(computeInertia, (uint64_t)count * t / threads, (uint64_t)count * (t + 1) / threads));
+			}
+
+			std::for_each(pool.begin(), pool.end(), [&](std::thread& thread) {
+				thread.join();
+			});
+		}
+
+		uint32_t category = memory_setCategory(MEM_BODIES);
+
+		physicsObjects.reserve(physicsObjects.size() + count);
+
+		// The other broadphases find the new pairs on the next step
+		bool deferred = false;
+
+		if (dbvt != nullptr) {
+			deferred = dbvt->m_deferedcollide;
+			dbvt->m_deferedcollide = true;
+		}
+
+		for (uint32_t i = 0; i < count; i++) {
+			btDefaultMotionState* ms = new btDefaultMotionState(transforms[i]);
+
+			btRigidBody::btRigidBodyConstructionInfo cinfo(masses[i], ms, shapes[i], inertia[i]);
+
+			btRigidBody* body = new btRigidBody(cinfo);
+
+			if (masses[i] != 0.f) {
+				this->setupCcd(body, shapes[i]);
+			}
+
+			PhysicsObject po = {
+				body,
+				collisionFilterGroup,
+				mask
+			};
+
+			physicsObjects.push_back(po);
+
+			this->getWorld()->addRigidBody(body, collisionFilterGroup, mask);
+
+			bodies[i] = body;
+		}
+
+		// Pair creation goes through the simulation category like a step
+		memory_setCategory(MEM_SIMULATION);
+
+		if (dbvt != nullptr) {
+			dbvt->m_sets[0].optimizeTopDown();
+			dbvt->calculateOverlappingPairs(this->disp);
+			dbvt->m_deferedcollide = deferred;
+		}
+
+		memory_setCategory(category);
+	}
+
+	void removeRigidBody(btRigidBody* body) {
+		int i = 0;
+		for (; i < physicsObjects.size(); i++) {
+			if (body == physicsObjects[i].body) {
+				break;
+			}
+		}
+
+		physicsObjects.erase(physicsObjects.begin() + i);
+
+		if (body->getCcdMotionThreshold() > 0.0f) {
+			this->ccdBodies--;
+		}
+
+		this->forgetContacts(body);
+
+		getWorld()->removeRigidBody(body);
+		btMotionState* ms = body->getMotionState();
+		delete body;
+		delete ms;
+	}
+
+	void release() {
+		delete this->dynamicWorld;
+		delete this->solver;
+		delete this->ghostPairCallback;
+		delete this->broadphaseTimer;
+		delete this->broadphase;
+		delete this->disp;
+		delete this->collisionConf;
+
+		// Bodies that were never removed, deleting the world first avoids
+		// Bullet's linear search per removed body
+		for (uint32_t i = 0; i < physicsObjects.size(); i++) {
+			btMotionState* ms = physicsObjects[i].body->getMotionState();
+			delete physicsObjects[i].body;
+			delete ms;
+		}
+		physicsObjects.clear();
+	}
+
+	void getRigidBodiesFromAABB(const btVector3& minAABB, const btVector3& maxAABB, std::vector<btRigidBody*>& rigidBodies, int mask) {
+
+		std::function<bool(const btVector3&, const btVector3&, const btVector3&)> pointInAABB = [](const btVector3& minAABB, const btVector3& maxAABB, const btVector3& point) {
+
+			return 
+				minAABB.x() <= point.x() &&
+				minAABB.y() <= point.y() &&
+				minAABB.z() <= point.z() &&
+				maxAABB.x() >= point.x() &&
+				maxAABB.y() >= point.y() &&
+				maxAABB.z() >= point.z();
+		};
+
+		for (int i = 0; i < physicsObjects.size(); i++) {
+			if (physicsObjects[i].group == mask) {
+				btVector3 point = physicsObjects[i].body->getCenterOfMassPosition();
+				if (pointInAABB(minAABB, maxAABB, point)) {
+					rigidBodies.push_back(physicsObjects[i].body);
+				}
+			}
+		}
+	}
+};
+
+struct Camera {
+	glm::vec3 pos;
+	glm::vec2 rot;
+
+	float fov;
+	float aspect;
+	float znear;
+	float zfar;
+
+	float speed = 64.0f;
+	float walkSpeed = 32.0f;
+
+	void init(
+		glm::vec3 pos,
+		glm::vec2 rot,
+		float fov,
+		float aspect,
+		float znear,
+		float zfar) {
+		this->pos = pos;
+		this->rot = rot;
+		this->fov = fov;
+		this->aspect = aspect;
+		this->znear = znear;
+		this->zfar = zfar;
+
+		SDL_SetRelativeMouseMode(SDL_TRUE);
+	}
+
+	void update(float delta) {
+		int x = 0, y = 0;
+		uint32_t buttons = SDL_GetRelativeMouseState(&x, &y);
+		const uint8_t* keys = SDL_GetKeyboardState(nullptr);
+
+		rot.x += this->speed * y * ((delta - 0.001f < 0) ? 0.001f : delta);
+		rot.y += this->speed * x * ((delta - 0.001f < 0) ? 0.001f : delta);
+
+		if (rot.y <= -360.0f) {
+			rot.y += 360.0f;
+		}
+
+		if (rot.y >= 360.0f) {
+			rot.y -= 360.0f;
+		}
+
+		if (rot.x < -90.0f) {
+			rot.x = -90.0f;
+		}
+
+		if (rot.x > 90.0f) {
+			rot.x = 90.0f;
+		}
+
+		float yrad = glm::radians(rot.y);
+
+		float sp = this->walkSpeed;
+
+		if (keys[SDL_SCANCODE_E]) {
+			sp *= 3.0f;
+		}
+
+		if (keys[SDL_SCANCODE_W]) {
+			pos.x += sp * glm::sin(yrad) * delta;
+			pos.z -= sp * glm::cos(yrad) * delta;
+		}
+
+		if (keys[SDL_SCANCODE_S]) {
+			pos.x -= sp * glm::sin(yrad) * delta;
+			pos.z += sp * glm::cos(yrad) * delta;
+		}
+
+		if (keys[SDL_SCANCODE_A]) {
+			pos.x -= sp * glm::cos(yrad) * delta;
+			pos.z -= sp * glm::sin(yrad) * delta;
+		}
+
+		if (keys[SDL_SCANCODE_D]) {
+			pos.x += sp * glm::cos(yrad) * delta;
+			pos.z += sp * glm::sin(yrad) * delta;
+		}
+
+		if (keys[SDL_SCANCODE_LSHIFT]) {
+			pos.y -= sp * delta;
+		}
+
+		if (keys[SDL_SCANCODE_SPACE]) {
+			pos.y += sp * delta;
+		}
+	}
+
+	glm::mat4 getProjection() {
+		return glm::perspective(
+			glm::radians(this->fov),
+			aspect,
+			znear,
+			zfar);
+	}
+
+	glm::mat4 getView() {
+		return
+			glm::rotate(glm::mat4(1.0f), glm::radians(this->rot.x), glm::vec3(1.0f, 0.0f, 0.0f)) *
+			glm::rotate(glm::mat4(1.0f), glm::radians(this->rot.y), glm::vec3(0.0f, 1.0f, 0.0f)) *
+			glm::translate(glm::mat4(1.0f), -this->pos);
+	}
+};
+
+// Upper bound for one frame, lines past it are counted and skipped
+#define DEBUG_DRAW_MAX_LINES (1 << 19)
+#define DEBUG_DRAW_CONTACT_LENGTH 0.25f
+
+struct DebugVertex {
+	float position[3];
+	uint8_t color[4];
+
+	DebugVertex() {}
+	DebugVertex(const btVector3& p, const btVector3& c) {
+		position[0] = p.x();
+		position[1] = p.y();
+		position[2] = p.z();
+		color[0] = vertex_unorm8(c.x());
+		color[1] = vertex_unorm8(c.y());
+		color[2] = vertex_unorm8(c.z());
+		color[3] = 255;
+	}
+
+	static void describe(VertexLayout& layout) {
+		layout.add<decltype(position)>("vertices", offsetof(DebugVertex, position));
+		layout.add<decltype(color)>("colors", offsetof(DebugVertex, color), true);
+	}
+};
+
+// Collects everything Bullet draws in debugDrawWorld into one array and
+// draws it with a single glDrawArrays. The GL buffer is allocated once at
+// the maximum size and orphaned every frame before the new lines are
+// written, so the driver never waits on last frame's draw.
+struct DebugDrawer : public btIDebugDraw {
+	uint32_t id = 0;
+	std::vector<DebugVertex> vertices;
+	int debugMode = DBG_DrawWireframe | DBG_DrawAabb | DBG_DrawContactPoints | DBG_DrawConstraints;
+
+	uint32_t lines = 0;
+	uint32_t dropped = 0;
+
+	void init() {
+		vertices.reserve(DEBUG_DRAW_MAX_LINES * 2);
+
+		glGenBuffers(1, &id);
+		glBindBuffer(GL_ARRAY_BUFFER, id);
+		glBufferData(GL_ARRAY_BUFFER, DEBUG_DRAW_MAX_LINES * 2 * sizeof(DebugVertex), 0, GL_STREAM_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		memoryStats.add(MEM_GL_BUFFERS, DEBUG_DRAW_MAX_LINES * 2 * sizeof(DebugVertex));
+	}
+
+	void begin() {
+		vertices.clear();
+		dropped = 0;
+	}
+
+	virtual void drawLine(const btVector3& from, const btVector3& to, const btVector3& color) {
+		this->drawLine(from, to, color, color);
+	}
+
+	virtual void drawLine(const btVector3& from, const btVector3& to, const btVector3& fromColor, const btVector3& toColor) {
+		if (vertices.size() >= DEBUG_DRAW_MAX_LINES * 2) {
+			dropped++;
+			return;
+		}
+
+		vertices.push_back(DebugVertex(from, fromColor));
+		vertices.push_back(DebugVertex(to, toColor));
+	}
+
+	virtual void drawContactPoint(const btVector3& point, const btVector3& normal, btScalar distance, int lifeTime, const btVector3& color) {
+		this->drawLine(point, point + normal * DEBUG_DRAW_CONTACT_LENGTH, color);
+	}
+
+	virtual void reportErrorWarning(const char* warning) {
+		std::cout << "Bullet: " << warning << std::endl;
+	}
+
+	virtual void draw3dText(const btVector3& location, const char* text) {
+	}
+
+	virtual void setDebugMode(int debugMode) {
+		this->debugMode = debugMode;
+	}
+
+	virtual int getDebugMode() const {
+		return debugMode;
+	}
+
+	void flush(Program& program, const glm::mat4& proj, const glm::mat4& view) {
+		lines = vertices.size() / 2;
+
+		if (lines == 0) {
+			return;
+		}
+
+		program.bind();
+		program.setMat4("proj", proj);
+		program.setMat4("view", view);
+
+		glBindBuffer(GL_ARRAY_BUFFER, id);
+		glBufferData(GL_ARRAY_BUFFER, DEBUG_DRAW_MAX_LINES * 2 * sizeof(DebugVertex), 0, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, vertices.size() * sizeof(DebugVertex), vertices.data());
+
+		program.bindAttribute();
+		vertex_getLayout<DebugVertex>().pointer(program);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		glDrawArrays(GL_LINES, 0, vertices.size());
+
+		program.unbindAttribute();
+		program.unbind();
+	}
+
+	void release() {
+		glDeleteBuffers(1, &id);
+		id = 0;
+
+		memoryStats.remove(MEM_GL_BUFFERS, DEBUG_DRAW_MAX_LINES * 2 * sizeof(DebugVertex));
+	}
+};
+
+// Last ray cast by the player, drawn with the physics debug lines
+struct DebugLine {
+	btVector3 from;
+	btVector3 to;
+	bool hasLine = false;
+
+	void draw(btIDebugDraw& drawer) {
+		if (!hasLine) {
+			return;
+		}
+
+		btVector3 color(1.0f, 0.0f, 1.0f);
+
+		drawer.drawLine(from, to, color);
+		drawer.drawSphere(from, 0.25f, color);
+		drawer.drawSphere(to, 0.25f, color);
+	}
+
+	void setLine(btVector3 from, btVector3 to) {
+		this->from = from;
+		this->to = to;
+		this->hasLine = true;
+	}
+};
+
+// Main Shader
+static Shader vertexShader;
+static Shader fragmentShader;
+static Program program;
+
+static Shader hubVertexShader;
+static Shader hubFragmentShader;
 static Program hubProgram;
 
-static Physics physics;
-static DebugLine debugLine;
+static Shader debugVertexShader;
+static Shader debugFragmentShader;
+static Program debugProgram;
+
+static DebugDrawer debugDrawer;
+static DebugLine debugLine;
+
+/*
+	------------------ Force Field Section --------------------------
+*/
+// Bodies are processed in batches of this size, the per type loops only
+// touch flat float arrays so the compiler can vectorize them.
+#define FORCE_FIELD_BATCH 256
+
+enum ForceFieldType {
+	FF_RADIAL = 0,
+	FF_VORTEX,
+	FF_WIND
+};
+
+struct ForceField {
+	uint32_t id = 0;
+	ForceFieldType type = ForceFieldType::FF_RADIAL;
+	btVector3 center = btVector3(0, 0, 0);
+	// Wind direction or vortex axis, normalized
+	btVector3 direction = btVector3(0, 1, 0);
+	float radius = 16.0f;
+	// Acceleration at the center, negative radial fields pull
+	float strength = 64.0f;
+	// 0 = constant, 1 = linear, 2 = quadratic towards the edge
+	uint32_t falloff = 1;
+	// Seconds left, negative lives until removed
+	float lifetime = -1.0f;
+};
+
+// Collects the dynamic objects overlapping a field from the broadphase
+struct ForceFieldQuery : public btBroadphaseAabbCallback {
+	std::vector<btRigidBody*>* bodies;
+	int mask;
+
+	virtual bool process(const btBroadphaseProxy* proxy) {
+		if ((proxy->m_collisionFilterGroup & mask) == 0) {
+			return true;
+		}
+
+		btRigidBody* body = btRigidBody::upcast((btCollisionObject*)proxy->m_clientObject);
+
+		if (body != nullptr && !body->isStaticOrKinematicObject()) {
+			bodies->push_back(body);
+		}
+
+		return true;
+	}
+};
+
+struct ForceFieldSystem {
+	Physics* physics = nullptr;
+	std::vector<ForceField> fields;
+	uint32_t nextID = 1;
+	int mask = COL_OBJECT;
+
+	// Scratch space reused every tick
+	std::vector<btRigidBody*> bodies;
+	float px[FORCE_FIELD_BATCH];
+	float py[FORCE_FIELD_BATCH];
+	float pz[FORCE_FIELD_BATCH];
+	float fx[FORCE_FIELD_BATCH];
+	float fy[FORCE_FIELD_BATCH];
+	float fz[FORCE_FIELD_BATCH];
+
+	uint32_t affected = 0;
+
+	void init(Physics* physics) {
+		this->physics = physics;
+		fields.reserve(64);
+		bodies.reserve(1024);
+	}
+
+	uint32_t add(ForceField field) {
+		field.id = nextID++;
+		fields.push_back(field);
+		return field.id;
+	}
+
+	ForceField* get(uint32_t id) {
+		for (uint32_t i = 0; i < fields.size(); i++) {
+			if (fields[i].id == id) {
+				return &fields[i];
+			}
+		}
+		return nullptr;
+	}
+
+	void remove(uint32_t id) {
+		for (uint32_t i = 0; i < fields.size(); i++) {
+			if (fields[i].id == id) {
+				fields[i] = fields.back();
+				fields.pop_back();
+				return;
+			}
+		}
+	}
+
+	void clear() {
+		fields.clear();
+	}
+
+	// Runs before each internal sub-step. Impulses are used instead of
+	// forces since Bullet only clears forces once per stepSimulation.
+	void tick(btScalar timeStep) {
+		affected = 0;
+
+		for (uint32_t i = 0; i < fields.size();) {
+			this->apply(fields[i], timeStep);
+
+			if (fields[i].lifetime >= 0.0f) {
+				fields[i].lifetime -= timeStep;
+
+				if (fields[i].lifetime <= 0.0f) {
+					fields[i] = fields.back();
+					fields.pop_back();
+					continue;
+				}
+			}
+
+			i++;
+		}
+	}
+
+	void apply(ForceField& field, btScalar timeStep) {
+		btVector3 extents(field.radius, field.radius, field.radius);
+
+		bodies.clear();
+
+		ForceFieldQuery query;
+		query.bodies = &bodies;
+		query.mask = mask;
+		physics->getWorld()->getBroadphase()->aabbTest(field.center - extents, field.center + extents, query);
+
+		for (uint32_t start = 0; start < bodies.size(); start += FORCE_FIELD_BATCH) {
+			uint32_t count = std::min((uint32_t)bodies.size() - start, (uint32_t)FORCE_FIELD_BATCH);
+
+			for (uint32_t i = 0; i < count; i++) {
+				const btVector3& p = bodies[start + i]->getCenterOfMassPosition();
+				px[i] = p.x() - field.center.x();
+				py[i] = p.y() - field.center.y();
+				pz[i] = p.z() - field.center.z();
+			}
+
+			this->compute(field, count);
+
+			for (uint32_t i = 0; i < count; i++) {
+				if (fx[i] == 0.0f && fy[i] == 0.0f && fz[i] == 0.0f) {
+					continue;
+				}
+
+				btRigidBody* body = bodies[start + i];
+				float mass = (body->getInvMass() > 0.0f) ? 1.0f / body->getInvMass() : 0.0f;
+
+				body->activate(true);
+				body->applyCentralImpulse(btVector3(fx[i], fy[i], fz[i]) * (mass * timeStep));
+				affected++;
+			}
+		}
+	}
+
+	// Fills fx/fy/fz with the acceleration at each relative position
+	void compute(ForceField& field, uint32_t count) {
+		float invRadius = 1.0f / field.radius;
+		float strength = field.strength;
+		float dx = field.direction.x();
+		float dy = field.direction.y();
+		float dz = field.direction.z();
+		uint32_t falloff = field.falloff;
+
+		switch (field.type) {
+		case ForceFieldType::FF_RADIAL:
+			for (uint32_t i = 0; i < count; i++) {
+				float dist = sqrtf(px[i] * px[i] + py[i] * py[i] + pz[i] * pz[i]) + 1e-4f;
+				float s = strength * weight(1.0f - dist * invRadius, falloff) / dist;
+				fx[i] = px[i] * s;
+				fy[i] = py[i] * s;
+				fz[i] = pz[i] * s;
+			}
+			break;
+		case ForceFieldType::FF_VORTEX:
+			// Spin around the axis with a little pull towards it
+			for (uint32_t i = 0; i < count; i++) {
+				float dist = sqrtf(px[i] * px[i] + py[i] * py[i] + pz[i] * pz[i]) + 1e-4f;
+				float s = strength * weight(1.0f - dist * invRadius, falloff) / dist;
+				fx[i] = (dy * pz[i] - dz * py[i] - 0.5f * px[i]) * s;
+				fy[i] = (dz * px[i] - dx * pz[i] - 0.5f * py[i]) * s;
+				fz[i] = (dx * py[i] - dy * px[i] - 0.5f * pz[i]) * s;
+			}
+			break;
+		case ForceFieldType::FF_WIND:
+			for (uint32_t i = 0; i < count; i++) {
+				float dist = sqrtf(px[i] * px[i] + py[i] * py[i] + pz[i] * pz[i]);
+				float s = strength * weight(1.0f - dist * invRadius, falloff);
+				fx[i] = dx * s;
+				fy[i] = dy * s;
+				fz[i] = dz * s;
+			}
+			break;
+		}
+	}
+
+	// t is 1 at the center and <= 0 outside the field
+	static inline float weight(float t, uint32_t falloff) {
+		float inside = (t > 0.0f) ? 1.0f : 0.0f;
+		t = std::max(t, 0.0f);
+
+		switch (falloff) {
+		case 0:
+			return inside;
+		case 1:
+			return t;
+		default:
+			return t * t;
+		}
+	}
+};
+
+
+/*
+	------------------ Level Section --------------------------
+*/
+#define LEVEL_CACHE_DIR "data/cache/levels/"
+#define LEVEL_CACHE_MAGIC 0x4C564C42 // BLVL
+#define LEVEL_CACHE_VERSION 2
+
+// Sections after the header are 16 byte aligned, mapped files start on a
+// page boundary so the BVH nodes can be used in place.
+struct LevelCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t sourceStamp;
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	uint32_t bvhOffset;
+	uint32_t bvhSize;
+	float aabbMin[4];
+	float aabbMax[4];
+};
+
+struct GeometryLevel : public IGeometry {
+	const float* vertexData = nullptr;
+	const int* indexData = nullptr;
+	uint32_t vertexCount = 0;
+	uint32_t indexCount = 0;
+
+	// The mapped indices stay 32 bit for Bullet, the arena copy is
+	// narrowed when it can be
+	virtual void init() {
+		this->placePositions((const PositionVertex*)vertexData, vertexCount, indexData, indexCount);
+	}
+};
+
+// Static environment mesh. On the first load the triangles are imported
+// and the BVH is built, both are then written to one cache file. Later
+// loads map that file and hand its memory straight to Bullet, so nothing
+// is parsed, copied or rebuilt.
+struct Level {
+	std::string name;
+
+	// Storage when built this launch, otherwise everything lives in file
+	std::vector<float> vertices;
+	std::vector<int> indices;
+	MappedFile file;
+	bool cached = false;
+
+	const float* vertexData = nullptr;
+	const int* indexData = nullptr;
+	uint32_t vertexCount = 0;
+	uint32_t indexCount = 0;
+	btVector3 aabbMin;
+	btVector3 aabbMax;
+
+	btTriangleIndexVertexArray* mesh = nullptr;
+	btBvhTriangleMeshShape* shape = nullptr;
+	Physics* physics = nullptr;
+	btRigidBody* body = nullptr;
+	GeometryLevel geometry;
+
+	// Level from any model file Assimp reads
+	bool init(std::string path) {
+		return this->load(path, util_fileStamp(path), [&]() {
+			return this->importModel(path);
+		});
+	}
+
+	// Generated height field, size x size vertices
+	bool initTerrain(uint32_t size) {
+		std::stringstream ss;
+		ss << "terrain" << size;
+		return this->load(ss.str(), util_hash(ss.str()), [&]() {
+			this->generateTerrain(size);
+			return true;
+		});
+	}
+
+	bool load(std::string name, uint64_t stamp, std::function<bool()> build) {
+		uint64_t start = SDL_GetPerformanceCounter();
+
+		this->name = name;
+		this->cached = this->loadCache(stamp);
+
+		if (!this->cached) {
+			if (!build()) {
+				return false;
+			}
+
+			this->optimize();
+
+			this->vertexData = vertices.data();
+			this->indexData = indices.data();
+			this->vertexCount = vertices.size() / 3;
+			this->indexCount = indices.size();
+			this->computeAabb();
+			this->createShape(true);
+			this->saveCache(stamp);
+		}
+
+		std::cout << "Level " << name << ": " << (cached ? "mapped from cache" : "imported and built") << " in "
+			<< util_milliseconds(start, SDL_GetPerformanceCounter()) << " ms, "
+			<< (indexCount / 3) << " triangles" << std::endl;
+
+		return true;
+	}
+
+	bool importModel(std::string path) {
+		Assimp::Importer importer;
+
+		const aiScene* scene = importer.ReadFile(path,
+			aiProcess_Triangulate |
+			aiProcess_JoinIdenticalVertices |
+			aiProcess_PreTransformVertices |
+			aiProcess_SortByPType);
+
+		if (scene == nullptr || (scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE)) {
+			std::cout << "Level " << path << ": " << importer.GetErrorString() << std::endl;
+			return false;
+		}
+
+		for (uint32_t m = 0; m < scene->mNumMeshes; m++) {
+			const aiMesh* mesh = scene->mMeshes[m];
+			int base = vertices.size() / 3;
+
+			for (uint32_t i = 0; i < mesh->mNumVertices; i++) {
+				vertices.push_back(mesh->mVertices[i].x);
+				vertices.push_back(mesh->mVertices[i].y);
+				vertices.push_back(mesh->mVertices[i].z);
+			}
+
+			for (uint32_t i = 0; i < mesh->mNumFaces; i++) {
+				if (mesh->mFaces[i].mNumIndices == 3) {
+					indices.push_back(base + mesh->mFaces[i].mIndices[0]);
+					indices.push_back(base + mesh->mFaces[i].mIndices[1]);
+					indices.push_back(base + mesh->mFaces[i].mIndices[2]);
+				}
+			}
+		}
+
+		return !indices.empty();
+	}
+
+	void generateTerrain(uint32_t size) {
+		float spacing = 2.0f;
+		float offset = (size - 1) * spacing * 0.5f;
+
+		vertices.reserve(size * size * 3);
+		indices.reserve((size - 1) * (size - 1) * 6);
+
+		for (uint32_t z = 0; z < size; z++) {
+			for (uint32_t x = 0; x < size; x++) {
+				float fx = x * spacing - offset;
+				float fz = z * spacing - offset;
+				vertices.push_back(fx);
+				vertices.push_back(sinf(fx * 0.05f) * cosf(fz * 0.07f) * 6.0f + sinf(fx * 0.31f + fz * 0.17f) * 0.5f);
+				vertices.push_back(fz);
+			}
+		}
+
+		for (uint32_t z = 0; z < size - 1; z++) {
+			for (uint32_t x = 0; x < size - 1; x++) {
+				int i = z * size + x;
+				indices.push_back(i);
+				indices.push_back(i + size);
+				indices.push_back(i + 1);
+				indices.push_back(i + 1);
+				indices.push_back(i + size);
+				indices.push_back(i + size + 1);
+			}
+		}
+	}
+
+	// Before the BVH is built, collision uses the same triangle order
+	void optimize() {
+		uint32_t optimizedVertices = vertices.size() / 3;
+		uint32_t optimizedIndices = indices.size();
+
+		MeshStats stats;
+		mesh_optimize(vertices.data(), optimizedVertices, 3 * sizeof(float), (uint32_t*)indices.data(), optimizedIndices, stats);
+
+		vertices.resize(optimizedVertices * 3);
+		indices.resize(optimizedIndices);
+
+		stats.print(name);
+	}
+
+	void computeAabb() {
+		aabbMin = btVector3(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+		aabbMax = btVector3(-BT_LARGE_FLOAT, -BT_LARGE_FLOAT, -BT_LARGE_FLOAT);
+
+		for (uint32_t i = 0; i < vertexCount; i++) {
+			btVector3 v(vertexData[i * 3], vertexData[i * 3 + 1], vertexData[i * 3 + 2]);
+			aabbMin.setMin(v);
+			aabbMax.setMax(v);
+		}
+	}
+
+	void createShape(bool buildBvh) {
+		uint32_t category = memory_setCategory(MEM_SHAPES);
+
+		mesh = new btTriangleIndexVertexArray(
+			indexCount / 3, (int*)indexData, 3 * sizeof(int),
+			vertexCount, (btScalar*)vertexData, 3 * sizeof(float));
+
+		// The quantized BVH is relative to this AABB, so the same one is
+		// used when building and when loading
+		shape = new btBvhTriangleMeshShape(mesh, true, aabbMin, aabbMax, buildBvh);
+
+		memory_setCategory(category);
+	}
+
+	void createBody(Physics* physics) {
+		this->physics = physics;
+		btTransform transform;
+		transform.setIdentity();
+		body = physics->createRigid(0, transform, shape, COL_GROUND, COL_EVERYTHING);
+	}
+
+	void initGeometry() {
+		geometry.vertexData = vertexData;
+		geometry.indexData = indexData;
+		geometry.vertexCount = vertexCount;
+		geometry.indexCount = indexCount;
+		geometry.init();
+	}
+
+	// Binary Cache
+	std::string getCacheName() {
+		std::stringstream ss;
+		ss << std::hex << util_hash(name);
+		return ss.str();
+	}
+
+	static uint32_t align16(uint32_t offset) {
+		return (offset + 15) & ~15u;
+	}
+
+	bool loadCache(uint64_t stamp) {
+		if (!file.open(LEVEL_CACHE_DIR + this->getCacheName() + ".bin")) {
+			return false;
+		}
+
+		LevelCacheHeader* header = (LevelCacheHeader*)file.data;
+
+		if (file.size < sizeof(LevelCacheHeader) ||
+			header->magic != LEVEL_CACHE_MAGIC ||
+			header->version != LEVEL_CACHE_VERSION ||
+			header->sourceStamp != stamp) {
+			file.close();
+			return false;
+		}
+
+		// Every section has to lie inside the file before anything reads
+		// it, counts are widened so a corrupt header can't overflow
+		uint64_t vertexOffset = align16(sizeof(LevelCacheHeader));
+		uint64_t vertexEnd = vertexOffset + (uint64_t)header->vertexCount * 3 * sizeof(float);
+		uint64_t indexOffset = (vertexEnd + 15) & ~(uint64_t)15;
+		uint64_t indexEnd = indexOffset + (uint64_t)header->indexCount * sizeof(int);
+
+		if (header->indexCount % 3 != 0 ||
+			header->bvhOffset % 16 != 0 ||
+			indexEnd > header->bvhOffset ||
+			(uint64_t)header->bvhOffset + header->bvhSize > file.size) {
+			std::cout << "Level cache of " << name << " is corrupt, rebuilding..." << std::endl;
+			file.close();
+			return false;
+		}
+
+		vertexCount = header->vertexCount;
+		indexCount = header->indexCount;
+		vertexData = (const float*)(file.data + vertexOffset);
+		indexData = (const int*)(file.data + indexOffset);
+
+		// Bullet and the arena upload index the vertices unchecked
+		for (uint32_t i = 0; i < indexCount; i++) {
+			if ((uint32_t)indexData[i] >= vertexCount) {
+				std::cout << "Level cache of " << name << " has bad indices, rebuilding..." << std::endl;
+				vertexData = nullptr;
+				indexData = nullptr;
+				file.close();
+				return false;
+			}
+		}
+		aabbMin = btVector3(header->aabbMin[0], header->aabbMin[1], header->aabbMin[2]);
+		aabbMax = btVector3(header->aabbMax[0], header->aabbMax[1], header->aabbMax[2]);
+
+		this->createShape(false);
+
+		// Fixes up the node pointers inside the mapping, which is copy on
+		// write so the file itself is left untouched
+		btOptimizedBvh* bvh = btOptimizedBvh::deSerializeInPlace(file.data + header->bvhOffset, header->bvhSize, false);
+
+		if (bvh == nullptr) {
+			this->releaseShape();
+			file.close();
+			return false;
+		}
+
+		shape->setOptimizedBvh(bvh);
+
+		return true;
+	}
+
+	void saveCache(uint64_t stamp) {
+		btOptimizedBvh* bvh = shape->getOptimizedBvh();
+		uint32_t bvhSize = bvh->calculateSerializeBufferSize();
+
+		uint32_t vertexOffset = align16(sizeof(LevelCacheHeader));
+		uint32_t indexOffset = align16(vertexOffset + vertexCount * 3 * sizeof(float));
+		uint32_t bvhOffset = align16(indexOffset + indexCount * sizeof(int));
+
+		// serializeInPlace needs 16 byte alignment, which new doesn't
+		// promise everywhere
+		uint32_t size = bvhOffset + bvhSize;
+		uint8_t* data = (uint8_t*)btAlignedAlloc(size, 16);
+		memset(data, 0, size);
+
+		LevelCacheHeader header;
+		header.magic = LEVEL_CACHE_MAGIC;
+		header.version = LEVEL_CACHE_VERSION;
+		header.sourceStamp = stamp;
+		header.vertexCount = vertexCount;
+		header.indexCount = indexCount;
+		header.bvhOffset = bvhOffset;
+		header.bvhSize = bvhSize;
+		for (int i = 0; i < 4; i++) {
+			header.aabbMin[i] = (i < 3) ? aabbMin[i] : 0.0f;
+			header.aabbMax[i] = (i < 3) ? aabbMax[i] : 0.0f;
+		}
+
+		memcpy(data, &header, sizeof(LevelCacheHeader));
+		memcpy(data + vertexOffset, vertexData, vertexCount * 3 * sizeof(float));
+		memcpy(data + indexOffset, indexData, indexCount * sizeof(int));
+
+		if (bvh->serializeInPlace(data + bvhOffset, bvhSize, false)) {
+			util_makeDirectory(PROGRAM_CACHE_DIR);
+			util_makeDirectory(LEVEL_CACHE_DIR);
+			util_writeFile(LEVEL_CACHE_DIR + this->getCacheName() + ".bin", data, size);
+		}
+
+		btAlignedFree(data);
+	}
+
+	void releaseShape() {
+		delete shape;
+		delete mesh;
+		shape = nullptr;
+		mesh = nullptr;
+	}
+
+	void release() {
+		if (body != nullptr) {
+			physics->removeRigidBody(body);
+			body = nullptr;
+		}
+
+		if (geometry.arena != nullptr) {
+			geometry.release();
+		}
+
+		// The BVH lives inside the mapping when cached, otherwise the shape
+		// built and owns it
+		this->releaseShape();
+
+		file.close();
+		vertices.clear();
+		indices.clear();
+	}
+};
+
+static Level level;
+static bool hasLevel = false;
+
+static RenderQueue renderQueue;
+
+// Geometry is shared between every object of the same type so the
+// render queue can draw all of them with one instanced command.
+struct SceneResources {
+	GeometryPlane plane;
+	GeometryCube cube;
+	GeometrySphere sphere;
+
+	uint32_t mainProgram;
+
+	uint32_t planeMesh;
+	uint32_t cubeMesh;
+	uint32_t sphereMesh;
+
+	uint32_t floorMaterial;
+	uint32_t boxMaterial;
+	uint32_t sphereMaterial;
+	// Remote players in client mode
+	uint32_t playerMaterial;
+
+	// Optional model given with --model
+	Model model;
+	bool hasModel = false;
+	uint32_t modelMesh;
+	uint32_t modelMaterial;
+
+	// Level given with --level or --terrain, registered once loaded
+	uint32_t levelMesh;
+	uint32_t levelMaterial;
+
+	void init() {
+		plane.init();
+		cube.init();
+		sphere.init();
+
+		mainProgram = renderQueue.addProgram(&program);
+
+		planeMesh = renderQueue.addMesh(&plane);
+		cubeMesh = renderQueue.addMesh(&cube);
+		sphereMesh = renderQueue.addMesh(&sphere);
+
+		floorMaterial = renderQueue.addMaterial(glm::vec4(0.0f, 0.5f, 0.0f, 1.0f));
+		boxMaterial = renderQueue.addMaterial(glm::vec4(1.0f, 0.0f, 0.0f, 1.0f));
+		sphereMaterial = renderQueue.addMaterial(glm::vec4(0.0f, 0.0f, 1.0f, 1.0f));
+		playerMaterial = renderQueue.addMaterial(glm::vec4(1.0f, 1.0f, 0.0f, 1.0f));
+
+		levelMaterial = renderQueue.addMaterial(glm::vec4(0.5f, 0.5f, 0.5f, 1.0f));
+
+		if (!g_modelPath.empty()) {
+			hasModel = model.init(g_modelPath);
+		}
+
+		if (hasModel) {
+			modelMesh = renderQueue.addMesh(&model.geometry);
+			modelMaterial = renderQueue.addMaterial(glm::vec4(1.0f, 0.5f, 0.0f, 1.0f));
+		}
+	}
+
+	void release() {
+		if (hasModel) {
+			model.release();
+			hasModel = false;
+		}
+		sphere.release();
+		cube.release();
+		plane.release();
+	}
+};
+
+static SceneResources resources;
+
+//static Camera camera;
+
+
+struct FloorObject {
+	Physics* physics;
+	btRigidBody* body;
+	btCollisionShape* shape;
+
+	void init(Physics* physics) {
+		this->physics = physics;
+		shape = physics->createStaticPlaneShape(btVector3(0, 1, 0), 0);
+
+		btTransform transform = btTransform(btQuaternion(0, 0, 0, 1));
+
+		body = physics->createRigid(0, transform, shape, COL_GROUND, COL_EVERYTHING);
+	}
+
+	void render() {
+		btTransform transform = body->getWorldTransform();
+		btScalar m[16];
+		transform.getOpenGLMatrix(m);
+
+		glm::mat4 model = 
+			glm::make_mat4(m) * 
+			glm::scale(glm::mat4(1.0f), glm::vec3(20.0f, 0.0f, 20.0f));
+
+		renderQueue.submit(resources.mainProgram, resources.planeMesh, resources.floorMaterial, model);
+	}
+
+	void release() {
+		physics->removeRigidBody(body);
+		delete shape;
+	}
+};
+
+struct BoxObject {
+	Physics* physics;
+	btRigidBody* body;
+	btCollisionShape* shape;
+
+	void init(Physics* physics, const btQuaternion& rotation, const btVector3& position) {
+		this->physics = physics;
+		shape = physics->createBoxShape(btVector3(1, 1, 1));
+		btTransform transform = btTransform(rotation, position);
+		body = physics->createRigid(1, transform, shape, COL_OBJECT, COL_EVERYTHING);
+	}
+
+	// Body made by Physics::createRigidBodies
+	void init(Physics* physics, btRigidBody* body, btCollisionShape* shape) {
+		this->physics = physics;
+		this->body = body;
+		this->shape = shape;
+	}
+
+	void render() {
+		btTransform transform = body->getWorldTransform();
+		float m[16];
+		transform.getOpenGLMatrix(m);
+		glm::mat4 model = glm::make_mat4(m);
+		renderQueue.submit(resources.mainProgram, resources.cubeMesh, resources.boxMaterial, model);
+	}
+
+	void release() {
+		physics->removeRigidBody(body);
+		delete shape;
+	}
+
+};
+
+struct SphereObject {
+	Physics* physics;
+	btRigidBody* body;
+	btCollisionShape* shape;
+
+	void init(Physics* physics, const btQuaternion& rotation, const btVector3& position) {
+		this->physics = physics;
+		shape = physics->createBoxShape(btVector3(1, 1, 1));
+		btTransform transform = btTransform(rotation, position);
+		body = physics->createRigid(1, transform, shape, COL_OBJECT, COL_EVERYTHING);
+	}
+
+	// Body made by Physics::createRigidBodies
+	void init(Physics* physics, btRigidBody* body, btCollisionShape* shape) {
+		this->physics = physics;
+		this->body = body;
+		this->shape = shape;
+	}
+
+	void render() {
+		btTransform transform = body->getWorldTransform();
+		float m[16];
+		transform.getOpenGLMatrix(m);
+		glm::mat4 model = glm::make_mat4(m);
+		renderQueue.submit(resources.mainProgram, resources.sphereMesh, resources.sphereMaterial, model);
+	}
+
+	void release() {
+		physics->removeRigidBody(body);
+		delete shape;
+	}
+
+};
+
+// Instance of the imported model, the shape is shared and owned by it
+struct ModelObject {
+	Physics* physics;
+	btRigidBody* body;
+
+	void init(Physics* physics, const btQuaternion& rotation, const btVector3& position) {
+		this->physics = physics;
+		btTransform transform = btTransform(rotation, position);
+		body = physics->createRigid(1, transform, resources.model.shape, COL_OBJECT, COL_EVERYTHING);
+	}
+
+	void render() {
+		btTransform transform = body->getWorldTransform();
+		float m[16];
+		transform.getOpenGLMatrix(m);
+		glm::mat4 model = glm::make_mat4(m);
+		renderQueue.submit(resources.mainProgram, resources.modelMesh, resources.modelMaterial, model);
+	}
+
+	void release() {
+		physics->removeRigidBody(body);
+	}
+};
+
+
+/*
+	------------------ World Streaming Section --------------------------
+*/
+// The XZ plane is split into square cells. Cells within WORLD_LOAD_RADIUS
+// of the player are simulated, cells past WORLD_UNLOAD_RADIUS are saved
+// and removed, so the simulated set stays bounded however far you walk.
+#define WORLD_CELL_SIZE 48.0f
+#define WORLD_LOAD_RADIUS 2
+#define WORLD_UNLOAD_RADIUS 3
+#define WORLD_CELL_BODIES 24
+// Bodies added to the dynamics world per frame
+#define WORLD_SPAWN_BUDGET 64
+#define WORLD_MAX_THREADS 2
+
+enum CellState {
+	CS_LOADING = 0,
+	CS_LOADED,
+	CS_SAVING
+};
+
+enum CellBodyType {
+	CBT_BOX = 0,
+	CBT_SPHERE
+};
+
+// Saved state of one body, stored as is in the cell blobs
+struct CellBody {
+	uint32_t type;
+	float position[3];
+	float rotation[4];
+	float linear[3];
+	float angular[3];
+};
+
+struct CellJob {
+	int64_t key;
+	int x;
+	int z;
+	bool save;
+	std::vector<CellBody> bodies;
+	uint32_t spawned = 0;
+};
+
+struct Cell {
+	int x;
+	int z;
+	CellState state;
+	std::vector<btRigidBody*> bodies;
+	std::vector<uint32_t> types;
+};
+
+struct WorldStreamer {
+	Physics* physics = nullptr;
+	std::map<int64_t, Cell> cells;
+
+	// Workers generate or decode cells and encode saved ones, the main
+	// thread only touches the dynamics world.
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<CellJob*> jobQueue;
+	std::deque<CellJob*> doneQueue;
+	std::map<int64_t, std::vector<uint8_t>> store;
+	bool running = false;
+
+	CellJob* spawning = nullptr;
+
+	// Called before a body is stored away and deleted, so whoever holds
+	// it (a grab constraint) can let go first
+	void (*onUnloadBody)(btRigidBody* body) = nullptr;
+
+	btCollisionShape* boxShape = nullptr;
+	btCollisionShape* sphereShape = nullptr;
+
+	uint32_t bodyCount = 0;
+
+	static int64_t getKey(int x, int z) {
+		return ((int64_t)x << 32) | (uint32_t)z;
+	}
+
+	static int getCell(float v) {
+		return (int)floorf(v / WORLD_CELL_SIZE);
+	}
+
+	void init(Physics* physics) {
+		this->physics = physics;
+		boxShape = physics->createBoxShape(btVector3(1, 1, 1));
+		sphereShape = physics->createSphereShape(1.0f);
+
+		uint32_t count = std::thread::hardware_concurrency();
+		count = (count > 1) ? count - 1 : 1;
+		count = (count > WORLD_MAX_THREADS) ? WORLD_MAX_THREADS : count;
+
+		running = true;
+
+		for (uint32_t i = 0; i < count; i++) {
+			workers.push_back(std::thread([&]() { this->work(); }));
+		}
+	}
+
+	// Worker Thread
+	void work() {
+		while (true) {
+			CellJob* job = nullptr;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cond.wait(lock, [&]() { return !running || !jobQueue.empty(); });
+
+				if (!running) {
+					return;
+				}
+
+				job = jobQueue.front();
+				jobQueue.pop_front();
+			}
+
+			if (job->save) {
+				std::vector<uint8_t> blob(job->bodies.size() * sizeof(CellBody));
+				memcpy(blob.data(), job->bodies.data(), blob.size());
+
+				std::unique_lock<std::mutex> lock(mutex);
+				store[job->key].swap(blob);
+				doneQueue.push_back(job);
+				continue;
+			}
+
+			bool found = false;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				std::map<int64_t, std::vector<uint8_t>>::iterator it = store.find(job->key);
+
+				if (it != store.end()) {
+					job->bodies.resize(it->second.size() / sizeof(CellBody));
+					memcpy(job->bodies.data(), it->second.data(), it->second.size());
+					found = true;
+				}
+			}
+
+			if (!found) {
+				this->generate(job);
+			}
+
+			std::unique_lock<std::mutex> lock(mutex);
+			doneQueue.push_back(job);
+		}
+	}
+
+	// Same contents every time a never saved cell is generated
+	void generate(CellJob* job) {
+		int64_t key = job->key;
+		uint32_t seed = (uint32_t)util_hash(&key, sizeof(int64_t));
+
+		std::function<float()> next = [&]() {
+			seed = seed * 1664525u + 1013904223u;
+			return (seed >> 8) / 16777216.0f;
+		};
+
+		job->bodies.resize(WORLD_CELL_BODIES);
+
+		for (uint32_t i = 0; i < WORLD_CELL_BODIES; i++) {
+			CellBody& body = job->bodies[i];
+			memset(&body, 0, sizeof(CellBody));
+
+			body.type = (next() < 0.5f) ? CellBodyType::CBT_BOX : CellBodyType::CBT_SPHERE;
+			body.position[0] = (job->x + 0.1f + next() * 0.8f) * WORLD_CELL_SIZE;
+			body.position[1] = 2.0f + next() * 16.0f;
+			body.position[2] = (job->z + 0.1f + next() * 0.8f) * WORLD_CELL_SIZE;
+			body.rotation[3] = 1.0f;
+		}
+	}
+
+	// Main Thread
+	void update(const btVector3& center) {
+		int cx = getCell(center.x());
+		int cz = getCell(center.z());
+
+		// Unload cells that drifted out of range
+		std::vector<int64_t> unload;
+
+		for (std::map<int64_t, Cell>::iterator it = cells.begin(); it != cells.end(); it++) {
+			Cell& cell = it->second;
+
+			if (cell.state == CellState::CS_LOADED &&
+				(abs(cell.x - cx) > WORLD_UNLOAD_RADIUS || abs(cell.z - cz) > WORLD_UNLOAD_RADIUS)) {
+				unload.push_back(it->first);
+			}
+		}
+
+		for (uint32_t i = 0; i < unload.size(); i++) {
+			this->unloadCell(unload[i]);
+		}
+
+		// Request cells coming into range
+		for (int z = cz - WORLD_LOAD_RADIUS; z <= cz + WORLD_LOAD_RADIUS; z++) {
+			for (int x = cx - WORLD_LOAD_RADIUS; x <= cx + WORLD_LOAD_RADIUS; x++) {
+				int64_t key = getKey(x, z);
+
+				if (cells.find(key) != cells.end()) {
+					continue;
+				}
+
+				Cell& cell = cells[key];
+				cell.x = x;
+				cell.z = z;
+				cell.state = CellState::CS_LOADING;
+
+				CellJob* job = new CellJob();
+				job->key = key;
+				job->x = x;
+				job->z = z;
+				job->save = false;
+
+				std::unique_lock<std::mutex> lock(mutex);
+				jobQueue.push_back(job);
+				cond.notify_one();
+			}
+		}
+
+		this->spawn(WORLD_SPAWN_BUDGET);
+	}
+
+	void spawn(uint32_t budget) {
+		while (true) {
+			if (spawning == nullptr) {
+				std::unique_lock<std::mutex> lock(mutex);
+
+				if (doneQueue.empty()) {
+					return;
+				}
+
+				spawning = doneQueue.front();
+				doneQueue.pop_front();
+			}
+
+			// Saved cells can be requested again now
+			if (spawning->save) {
+				cells.erase(spawning->key);
+				delete spawning;
+				spawning = nullptr;
+				continue;
+			}
+
+			if (budget == 0) {
+				return;
+			}
+
+			Cell& cell = cells[spawning->key];
+
+			while (budget > 0 && spawning->spawned < spawning->bodies.size()) {
+				const CellBody& data = spawning->bodies[spawning->spawned++];
+
+				btTransform transform(
+					btQuaternion(data.rotation[0], data.rotation[1], data.rotation[2], data.rotation[3]),
+					btVector3(data.position[0], data.position[1], data.position[2]));
+
+				btCollisionShape* shape = (data.type == CellBodyType::CBT_BOX) ? boxShape : sphereShape;
+				btRigidBody* body = physics->createRigid(1, transform, shape, COL_OBJECT, COL_EVERYTHING);
+				body->setLinearVelocity(btVector3(data.linear[0], data.linear[1], data.linear[2]));
+				body->setAngularVelocity(btVector3(data.angular[0], data.angular[1], data.angular[2]));
+
+				cell.bodies.push_back(body);
+				cell.types.push_back(data.type);
+				bodyCount++;
+				budget--;
+			}
+
+			if (spawning->spawned >= spawning->bodies.size()) {
+				cell.state = CellState::CS_LOADED;
+				delete spawning;
+				spawning = nullptr;
+			}
+		}
+	}
+
+	void unloadCell(int64_t key) {
+		Cell& cell = cells[key];
+
+		CellJob* job = new CellJob();
+		job->key = key;
+		job->x = cell.x;
+		job->z = cell.z;
+		job->save = true;
+
+		for (uint32_t i = 0; i < cell.bodies.size(); i++) {
+			btRigidBody* body = cell.bodies[i];
+			btTransform transform = body->getWorldTransform();
+
+			// Bodies that rolled or were carried into a loaded cell move
+			// over to it instead of disappearing with this one
+			int64_t owner = getKey(getCell(transform.getOrigin().x()), getCell(transform.getOrigin().z()));
+			std::map<int64_t, Cell>::iterator it = cells.find(owner);
+
+			if (owner != key && it != cells.end() && it->second.state == CellState::CS_LOADED) {
+				it->second.bodies.push_back(body);
+				it->second.types.push_back(cell.types[i]);
+				continue;
+			}
+
+			CellBody data;
+			data.type = cell.types[i];
+			this->store3(data.position, transform.getOrigin());
+			this->store3(data.linear, body->getLinearVelocity());
+			this->store3(data.angular, body->getAngularVelocity());
+			btQuaternion rotation = transform.getRotation();
+			data.rotation[0] = rotation.x();
+			data.rotation[1] = rotation.y();
+			data.rotation[2] = rotation.z();
+			data.rotation[3] = rotation.w();
+			job->bodies.push_back(data);
+
+			if (onUnloadBody != nullptr) {
+				onUnloadBody(body);
+			}
+
+			physics->removeRigidBody(body);
+			bodyCount--;
+		}
+
+		cell.bodies.clear();
+		cell.types.clear();
+		cell.state = CellState::CS_SAVING;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		jobQueue.push_back(job);
+		cond.notify_one();
+	}
+
+	static void store3(float* out, const btVector3& v) {
+		out[0] = v.x();
+		out[1] = v.y();
+		out[2] = v.z();
+	}
+
+	void render() {
+		for (std::map<int64_t, Cell>::iterator it = cells.begin(); it != cells.end(); it++) {
+			Cell& cell = it->second;
+
+			for (uint32_t i = 0; i < cell.bodies.size(); i++) {
+				float m[16];
+				cell.bodies[i]->getWorldTransform().getOpenGLMatrix(m);
+				glm::mat4 model = glm::make_mat4(m);
+
+				if (cell.types[i] == CellBodyType::CBT_BOX) {
+					renderQueue.submit(resources.mainProgram, resources.cubeMesh, resources.boxMaterial, model);
+				}
+				else {
+					renderQueue.submit(resources.mainProgram, resources.sphereMesh, resources.sphereMaterial, model);
+				}
+			}
+		}
+	}
+
+	uint32_t getStoredCount() {
+		std::unique_lock<std::mutex> lock(mutex);
+		return store.size();
+	}
+
+	void release() {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			running = false;
+			cond.notify_all();
+		}
+
+		std::for_each(workers.begin(), workers.end(), [&](std::thread& worker) {
+			worker.join();
+		});
+		workers.clear();
+
+		std::for_each(jobQueue.begin(), jobQueue.end(), [&](CellJob* job) { delete job; });
+		std::for_each(doneQueue.begin(), doneQueue.end(), [&](CellJob* job) { delete job; });
+		jobQueue.clear();
+		doneQueue.clear();
+
+		delete spawning;
+		spawning = nullptr;
+
+		for (std::map<int64_t, Cell>::iterator it = cells.begin(); it != cells.end(); it++) {
+			for (uint32_t i = 0; i < it->second.bodies.size(); i++) {
+				physics->removeRigidBody(it->second.bodies[i]);
+			}
+		}
+		cells.clear();
+		store.clear();
+		bodyCount = 0;
+
+		delete sphereShape;
+		delete boxShape;
+		sphereShape = nullptr;
+		boxShape = nullptr;
+	}
+};
+
+static WorldStreamer world;
+
+
+enum PhysicsOptions {
+	PO_PUSH = 0,
+	PO_PULL,
+	PO_MASS_PUSH,
+	PO_MASS_PULL,
+	PO_GRAB_BODY
+};
+
+// Grabbed bodies are pulled by soft point to point constraints, values
+// from Bullet's picking demo.
+#define GRAB_MAX_BODIES 8
+#define GRAB_DISTANCE 6.0f
+#define GRAB_TAU 0.01f
+#define GRAB_IMPULSE_CLAMP 30.0f
+#define GRAB_LAUNCH_SPEED 128.0f
+
+#define MASS_FIELD_RADIUS 32.0f
+#define MASS_FIELD_STRENGTH 192.0f
+
+struct GrabbedBody {
+	btRigidBody* body;
+	btPoint2PointConstraint* constraint;
+	// Pivot target in camera space
+	btVector3 anchor;
+};
+
+enum PlayerController {
+	PC_DYNAMIC = 0,
+	PC_KINEMATIC
+};
+
+struct PhysicsCamera {
+	PlayerController controller = PlayerController::PC_DYNAMIC;
+
+	// PC_DYNAMIC
+	btRigidBody* body = nullptr;
+	// PC_KINEMATIC, the ghost sweeps the capsule through the world and is
+	// never part of a simulation island.
+	btPairCachingGhostObject* ghost = nullptr;
+	btKinematicCharacterController* character = nullptr;
+
+	btConvexShape* shape = nullptr;
+	glm::vec2 rot;
+
+	float fov;
+	float aspect;
+	float znear;
+	float zfar;
+
+	float speed = 64.0f;
+	float walkSpeed = 512.0f;
+	float jumpSpeed = 512.0f;
+
+	PhysicsOptions options = PhysicsOptions::PO_PUSH;
+
+	std::vector<GrabbedBody> grabbed;
+
+	Physics* physics = nullptr;
+	// Optional, mass push/pull do nothing without it
+	ForceFieldSystem* forceFields = nullptr;
+
+	// Radial field that follows the player while mass push/pull is held
+	uint32_t massField = 0;
+
+	bool held[IA_COUNT] = { false };
+
+	void init(
+		Physics* physics,
+		btVector3 position,
+		glm::vec2 rotation,
+		float fov,
+		float aspect,
+		float znear,
+		float zfar,
+		PlayerController controller = PlayerController::PC_DYNAMIC) {
+
+		this->physics = physics;
+		this->controller = controller;
+
+		this->grabbed.reserve(GRAB_MAX_BODIES);
+
+		this->shape = physics->createCapsuleShape(1.0f, 2.0f);
+
+		btTransform transform = btTransform(btQuaternion(0, 0, 0, 1), position);
+
+		if (controller == PlayerController::PC_KINEMATIC) {
+			this->ghost = new btPairCachingGhostObject();
+			this->ghost->setWorldTransform(transform);
+			this->ghost->setCollisionShape(this->shape);
+			this->ghost->setCollisionFlags(btCollisionObject::CF_CHARACTER_OBJECT);
+
+			this->character = new btKinematicCharacterController(this->ghost, this->shape, 0.5f, btVector3(0, 1, 0));
+			this->character->setGravity(physics->getWorld()->getGravity());
+			this->character->setMaxJumpHeight(4.0f);
+
+			physics->getWorld()->addCollisionObject(this->ghost, COL_CAMERA, COL_OBJECT | COL_GROUND);
+			physics->getWorld()->addAction(this->character);
+		}
+		else {
+			this->body = physics->createRigid(1.0f, transform, this->shape, COL_CAMERA, COL_EVERYTHING);
+			this->body->setSleepingThresholds(0.0f, 0.0f);
+			this->body->setAngularFactor(0.0f);
+		}
+
+		this->rot = rotation;
+
+		this->fov = fov;
+		this->aspect = aspect;
+		this->znear = znear;
+		this->zfar = zfar;
+
+		// The headless server has no window or video subsystem
+		if (g_window != nullptr) {
+			SDL_SetRelativeMouseMode(SDL_TRUE);
+		}
+	}
+
+	// Input Actions
+	typedef void (PhysicsCamera::*ActionHandler)(const InputAction& action);
+	static const ActionHandler actionHandlers[IA_COUNT];
+
+	void doAction(const InputAction& action) {
+		(this->*actionHandlers[action.type])(action);
+	}
+
+	void onNone(const InputAction& action) {
+	}
+
+	void onHold(const InputAction& action) {
+		held[action.type] = action.pressed;
+	}
+
+	void onMode(const InputAction& action) {
+		if (action.pressed) {
+			return;
+		}
+
+		switch (action.type) {
+		case IA_MODE_PUSH:
+			options = PhysicsOptions::PO_PUSH;
+			releaseGrabbed();
+			endMassField();
+			std::cout << "PhysicsOptions: RAY PUSH MODE." << std::endl;
+			break;
+		case IA_MODE_PULL:
+			options = PhysicsOptions::PO_PULL;
+			releaseGrabbed();
+			endMassField();
+			std::cout << "PhysicsOptions: RAY PULL MODE." << std::endl;
+			break;
+		case IA_MODE_MASS_PUSH:
+			options = PhysicsOptions::PO_MASS_PUSH;
+			releaseGrabbed();
+			endMassField();
+			std::cout << "PhysicsOptions: MASS PUSH MODE." << std::endl;
+			break;
+		case IA_MODE_MASS_PULL:
+			options = PhysicsOptions::PO_MASS_PULL;
+			releaseGrabbed();
+			endMassField();
+			std::cout << "PhysicsOptions: MASS PULL MODE." << std::endl;
+			break;
+		case IA_MODE_GRAB:
+			options = PhysicsOptions::PO_GRAB_BODY;
+			endMassField();
+			std::cout << "PhysicsOptions: GRAB BODY MODE." << std::endl;
+			break;
+		default:
+			break;
+		}
+	}
+
+	void onPrimary(const InputAction& action) {
+		if (this->options == PhysicsOptions::PO_MASS_PUSH || this->options == PhysicsOptions::PO_MASS_PULL) {
+			if (action.pressed) {
+				beginMassField(this->options == PhysicsOptions::PO_MASS_PUSH ? MASS_FIELD_STRENGTH : -MASS_FIELD_STRENGTH);
+			}
+			else {
+				endMassField();
+			}
+			return;
+		}
+
+		if (action.pressed) {
+			return;
+		}
+
+		if (this->grabbed.empty()) {
+			switch (this->options) {
+			case PhysicsOptions::PO_PUSH:
+				phyRayPush(64);
+				break;
+			case PhysicsOptions::PO_PULL:
+				phyRayPull(64);
+				break;
+			case PhysicsOptions::PO_GRAB_BODY:
+				grabRigidBody();
+				break;
+			default:
+				break;
+			}
+		}
+		else if (this->options != PhysicsOptions::PO_GRAB_BODY || !grabRigidBody()) {
+			// Clicking on nothing or on a held body lets go of everything
+			releaseGrabbed();
+		}
+	}
+
+	void onSecondary(const InputAction& action) {
+		if (action.pressed) {
+			return;
+		}
+
+		if (!this->grabbed.empty()) {
+
+			if (this->options == PhysicsOptions::PO_GRAB_BODY) {
+				btVector3 rayTo = this->pickRay(g_width / 2, g_height / 2);
+
+				btVector3 dir = rayTo - this->getPosition();
+
+				dir.normalize();
+
+				dir *= GRAB_LAUNCH_SPEED;
+
+				for (uint32_t i = 0; i < grabbed.size(); i++) {
+					grabbed[i].body->activate(true);
+					grabbed[i].body->setLinearVelocity(dir);
+				}
+
+				releaseGrabbed();
+			}
+		}
+	}
+
+	void phyRayPush(float force) {
+		btVector3 rayTo = this->pickRay(g_width / 2, g_height / 2);
+		btVector3 pos = this->getPosition();
+		pos.setY(pos.y() + 1.0f);
+		btCollisionWorld::ClosestRayResultCallback rayCallback(pos, rayTo);
+		rayCallback.m_collisionFilterGroup = COL_OBJECT;
+		rayCallback.m_collisionFilterMask = COL_OBJECT;
+		physics->dynamicWorld->rayTest(pos, rayTo, rayCallback);
+		debugLine.setLine(pos, rayTo);
+		if (rayCallback.hasHit()) {
+			debugLine.setLine(pos, rayCallback.m_hitPointWorld);
+			btRigidBody* b = (btRigidBody*)btRigidBody::upcast(rayCallback.m_collisionObject);
+			b->activate(true);
+			// Used for Push
+			btVector3 dir = b->getCenterOfMassPosition() - pos;
+			dir.normalize();
+			dir *= force;
+			b->setLinearVelocity(dir);
+		}
+	}
+
+	void phyRayPull(float force) {
+		btVector3 rayTo = this->pickRay(g_width / 2, g_height / 2);
+		btVector3 pos = this->getPosition();
+		pos.setY(pos.y() + 1.0f);
+		btCollisionWorld::ClosestRayResultCallback rayCallback(pos, rayTo);
+		rayCallback.m_collisionFilterGroup = COL_OBJECT;
+		rayCallback.m_collisionFilterMask = COL_OBJECT;
+		physics->dynamicWorld->rayTest(pos, rayTo, rayCallback);
+		debugLine.setLine(pos, rayTo);
+		if (rayCallback.hasHit()) {
+			debugLine.setLine(pos, rayCallback.m_hitPointWorld);
+			btRigidBody* b = (btRigidBody*)btRigidBody::upcast(rayCallback.m_collisionObject);
+			b->activate(true);
+			// Used for Push
+			btVector3 dir = pos - b->getCenterOfMassPosition();
+			dir.normalize();
+			dir *= force;
+			b->setLinearVelocity(dir);
+		}
+	}
+
+	void beginMassField(float strength) {
+		endMassField();
+
+		if (forceFields == nullptr) {
+			return;
+		}
+
+		ForceField field;
+		field.type = ForceFieldType::FF_RADIAL;
+		field.center = this->getPosition();
+		field.radius = MASS_FIELD_RADIUS;
+		field.strength = strength;
+		field.falloff = 1;
+
+		massField = forceFields->add(field);
+	}
+
+	void endMassField() {
+		if (massField != 0) {
+			forceFields->remove(massField);
+			massField = 0;
+		}
+	}
+
+	// Adds the body under the crosshair to the grabbed set, returns false
+	// if nothing new was grabbed.
+	bool grabRigidBody() {
+		btVector3 rayTo = this->pickRay(g_width / 2, g_height / 2);
+		btVector3 pos = this->getPosition();
+		pos.setY(pos.y() + 1.0f);
+		btCollisionWorld::ClosestRayResultCallback rayCallback(pos, rayTo);
+		rayCallback.m_collisionFilterGroup = COL_OBJECT;
+		rayCallback.m_collisionFilterMask = COL_OBJECT;
+		physics->dynamicWorld->rayTest(pos, rayTo, rayCallback);
+		debugLine.setLine(pos, rayTo);
+
+		if (!rayCallback.hasHit() || grabbed.size() >= GRAB_MAX_BODIES) {
+			return false;
+		}
+
+		debugLine.setLine(pos, rayCallback.m_hitPointWorld);
+
+		btRigidBody* b = (btRigidBody*)btRigidBody::upcast(rayCallback.m_collisionObject);
+
+		for (uint32_t i = 0; i < grabbed.size(); i++) {
+			if (grabbed[i].body == b) {
+				return false;
+			}
+		}
+
+		btVector3 hit = rayCallback.m_hitPointWorld;
+		btVector3 pivot = b->getCenterOfMassTransform().inverse() * hit;
+
+		GrabbedBody g;
+		g.body = b;
+		g.constraint = new btPoint2PointConstraint(*b, pivot);
+		g.constraint->m_setting.m_tau = GRAB_TAU;
+		g.constraint->m_setting.m_impulseClamp = GRAB_IMPULSE_CLAMP;
+
+		// Keep the hit point where it is relative to the eye, pulled in
+		// to GRAB_DISTANCE when it was further away.
+		g.anchor = this->getEyeTransform().inverse() * hit;
+		if (g.anchor.length() > GRAB_DISTANCE) {
+			g.anchor *= GRAB_DISTANCE / g.anchor.length();
+		}
+
+		b->setActivationState(DISABLE_DEACTIVATION);
+		physics->getWorld()->addConstraint(g.constraint, true);
+
+		grabbed.push_back(g);
+
+		return true;
+	}
+
+	// Lets go of one body, for bodies about to be deleted
+	void releaseBody(btRigidBody* body) {
+		for (uint32_t i = 0; i < grabbed.size(); i++) {
+			if (grabbed[i].body == body) {
+				physics->getWorld()->removeConstraint(grabbed[i].constraint);
+				delete grabbed[i].constraint;
+				grabbed.erase(grabbed.begin() + i);
+				return;
+			}
+		}
+	}
+
+	void releaseGrabbed() {
+		for (uint32_t i = 0; i < grabbed.size(); i++) {
+			physics->getWorld()->removeConstraint(grabbed[i].constraint);
+			delete grabbed[i].constraint;
+
+			grabbed[i].body->forceActivationState(ACTIVE_TAG);
+			grabbed[i].body->activate(true);
+		}
+		grabbed.clear();
+	}
+
+	// Moves every constraint target along with the eye
+	void updateGrabbed() {
+		if (grabbed.empty()) {
+			return;
+		}
+
+		btTransform eye = this->getEyeTransform();
+
+		for (uint32_t i = 0; i < grabbed.size(); i++) {
+			grabbed[i].constraint->setPivotB(eye * grabbed[i].anchor);
+		}
+	}
+
+	void update(float delta) {
+		int x = 0, y = 0;
+		uint32_t buttons = SDL_GetRelativeMouseState(&x, &y);
+
+		if (body != nullptr) {
+			body->activate(true);
+		}
+
+		rot.x += this->speed * y * ((delta - 0.001f < 0) ? 0.001f : delta);
+		rot.y += this->speed * x * ((delta - 0.001f < 0) ? 0.001f : delta);
+
+		if (rot.y <= -360.0f) {
+			rot.y += 360.0f;
+		}
+
+		if (rot.y >= 360.0f) {
+			rot.y -= 360.0f;
+		}
+
+		if (rot.x < -90.0f) {
+			rot.x = -90.0f;
+		}
+
+		if (rot.x > 90.0f) {
+			rot.x = 90.0f;
+		}
+
+	}
+
+	// Called before every physics sub-step, after that sub-step's input
+	// actions were applied.
+	void tick(btScalar timeStep) {
+		float yrad = glm::radians(rot.y);
+
+		float sp = this->walkSpeed;
+
+		if (held[IA_SPRINT]) {
+			sp *= 3.0f;
+		}
+
+		btVector3 vel = (body != nullptr) ? body->getLinearVelocity() : btVector3(0, 0, 0);
+		
+		vel[0] = 0;
+		vel[2] = 0;
+
+		if (held[IA_JUMP]) {
+			vel[1] = this->jumpSpeed * FIXED_FRAME_60;
+		}
+
+		if (held[IA_FORWARD]) {
+			vel[0] += sp * btSin(yrad) * FIXED_FRAME_60;
+			vel[2] -= sp * btCos(yrad) * FIXED_FRAME_60;
+		}
+
+		if (held[IA_BACKWARD]) {
+			vel[0] -= sp * btSin(yrad) * FIXED_FRAME_60;
+			vel[2] += sp * btCos(yrad) * FIXED_FRAME_60;
+		}
+
+		if (held[IA_LEFT]) {
+			vel[0] -= sp * btCos(yrad) * FIXED_FRAME_60;
+			vel[2] -= sp * btSin(yrad) * FIXED_FRAME_60;
+		}
+
+		if (held[IA_RIGHT]) {
+			vel[0] += sp * btCos(yrad) * FIXED_FRAME_60;
+			vel[2] += sp * btSin(yrad) * FIXED_FRAME_60;
+		}
+
+		this->updateGrabbed();
+
+		if (massField != 0) {
+			forceFields->get(massField)->center = this->getPosition();
+		}
+
+		if (controller == PlayerController::PC_KINEMATIC) {
+			// The character controller only jumps from the ground, so
+			// holding space doesn't fly like the dynamic body does.
+			if (held[IA_JUMP] && character->canJump()) {
+				character->jump(btVector3(0, vel[1], 0));
+			}
+
+			vel[1] = 0;
+			character->setWalkDirection(vel * timeStep);
+		}
+		else {
+			body->setLinearVelocity(vel);
+		}
+	}
+
+	btVector3 getPosition() {
+		if (controller == PlayerController::PC_KINEMATIC) {
+			return ghost->getWorldTransform().getOrigin();
+		}
+		return body->getCenterOfMassPosition();
+	}
+
+	// Eye to world, same rotation as getView() without a matrix inverse
+	btTransform getEyeTransform() {
+		btVector3 position = this->getPosition();
+		position.setY(position.y() + 1.0f);
+		return btTransform(btQuaternion(btRadians(-rot.y), btRadians(-rot.x), 0.0f), position);
+	}
+
+	glm::mat4 getProjection() {
+		return glm::perspective(
+			glm::radians(this->fov),
+			aspect,
+			znear,
+			zfar);
+	}
+
+	glm::mat4 getView() {
+		btVector3 position = this->getPosition();
+
+		glm::vec3 pos = glm::vec3(
+			position.x(),
+			position.y() + 1.0f,
+			position.z()
+		);
+
+		return	
+				glm::rotate(glm::mat4(1.0f), glm::radians(this->rot.x), glm::vec3(1.0f, 0.0f, 0.0f)) *
+				glm::rotate(glm::mat4(1.0f), glm::radians(this->rot.y), glm::vec3(0.0f, 1.0f, 0.0f)) *
+				glm::translate(glm::mat4(1.0f), -pos);
+	}
+
+	btVector3 pickRay(int x, int y) {
+		glm::vec3 coords;
+
+		coords.x = (((2.0f * x) / g_width) - 1);
+		coords.y = -(((2.0f * y) / g_height) - 1);
+		coords.z = -1.0f;
+
+		glm::mat4 proj = this->getProjection();
+		glm::mat4 view = this->getView();
+
+		coords.x /= proj[1][1];
+		coords.y /= proj[2][2];
+
+		coords *= this->zfar;
+
+		glm::mat4 invView = glm::inverse(view);
+
+		coords = glm::mat3(invView) * coords;
+
+		return btVector3(coords.x, coords.y, coords.z);
+	}
+
+	void release() {
+		this->releaseGrabbed();
+		this->endMassField();
+
+		if (controller == PlayerController::PC_KINEMATIC) {
+			physics->getWorld()->removeAction(this->character);
+			physics->getWorld()->removeCollisionObject(this->ghost);
+			delete this->character;
+			delete this->ghost;
+			this->character = nullptr;
+			this->ghost = nullptr;
+		}
+		else {
+			physics->removeRigidBody(this->body);
+			this->body = nullptr;
+		}
+		delete this->shape;
+	}
+
+};
+
+const PhysicsCamera::ActionHandler PhysicsCamera::actionHandlers[IA_COUNT] = {
+	&PhysicsCamera::onNone,		// IA_NONE
+	&PhysicsCamera::onHold,		// IA_FORWARD
+	&PhysicsCamera::onHold,		// IA_BACKWARD
+	&PhysicsCamera::onHold,		// IA_LEFT
+	&PhysicsCamera::onHold,		// IA_RIGHT
+	&PhysicsCamera::onHold,		// IA_JUMP
+	&PhysicsCamera::onHold,		// IA_SPRINT
+	&PhysicsCamera::onPrimary,	// IA_PRIMARY
+	&PhysicsCamera::onSecondary,	// IA_SECONDARY
+	&PhysicsCamera::onMode,		// IA_MODE_PUSH
+	&PhysicsCamera::onMode,		// IA_MODE_PULL
+	&PhysicsCamera::onMode,		// IA_MODE_MASS_PUSH
+	&PhysicsCamera::onMode,		// IA_MODE_MASS_PULL
+	&PhysicsCamera::onMode		// IA_MODE_GRAB
+};
+
+float rotY = 0.0f;
+
+Physics physics;
+ForceFieldSystem forceFields;
+
+InputSystem input;
+PhysicsCamera camera;
+
+FloorObject floorObject;
+//BoxObject boxObject;
+
+std::vector<BoxObject> boxObjects;
+std::vector<SphereObject> sphereObjects;
+std::vector<ModelObject> modelObjects;
+
+
+Profiler profiler;
+TextureLoader textureLoader;
+Texture2D crosshairTex;
+GeometryQuad crosshairQuad;
+bool isDebugLine = false;
+//bool isWireFrame = false;
+
+enum PolyMode {
+	PM_FILL = 0,
+	PM_LINE,
+	PM_POINT
+};
+
+PolyMode polyMode = PolyMode::PM_FILL;
+
+uint32_t vortexField = 0;
+uint32_t windField = 0;
+
+/*
+	------------------ Server Section --------------------------
+*/
+// Snapshots kept for delta compression, a client that acks something
+// older than this gets a full snapshot
+#define NET_HISTORY 64
+#define NET_DEFAULT_RATE 20
+
+struct NetPeer {
+	bool active = false;
+	NetAddress address;
+	PhysicsCamera camera;
+	double lastHeard = 0.0;
+
+	// Actions received since the last physics tick
+	std::vector<InputAction> actions;
+	uint16_t heldBits = 0;
+	uint32_t lastSequence = 0;
+
+	// Latest client time stamp and when it arrived, echoed back so the
+	// client can measure the round trip
+	uint32_t echoTime = 0;
+	uint64_t echoReceived = 0;
+	uint32_t ackTick = 0;
+
+	uint64_t bytesSent = 0;
+	uint32_t snapshotsSent = 0;
+	uint32_t deltaSnapshots = 0;
+	// Entities left out because the packet was full
+	uint32_t truncated = 0;
+};
+
+struct SnapshotRecord {
+	uint32_t tick = 0;
+	std::vector<NetEntity> entities;
+};
+
+// What each client holds after applying a snapshot, by tick. Entities
+// that didn't fit keep the client's old value, so they are still seen as
+// changed once the client acks and go out in a later snapshot.
+struct NetPeerHistory {
+	SnapshotRecord records[NET_HISTORY];
+};
+
+struct NetServer {
+	UdpSocket socket;
+	uint32_t rate = NET_DEFAULT_RATE;
+	uint32_t tick = 0;
+
+	NetPeer peers[NET_MAX_CLIENTS];
+	NetPeerHistory history[NET_MAX_CLIENTS];
+	SnapshotRecord current;
+
+	uint8_t buffer[NET_MAX_PACKET];
+
+	bool init(uint16_t port, uint32_t rate) {
+		this->rate = std::max(rate, 1u);
+
+		if (!net_init() || !socket.open(port)) {
+			std::cout << "Server: unable to open UDP port " << port << std::endl;
+			return false;
+		}
+
+		std::cout << "Server: listening on UDP port " << port << ", " << this->rate << " snapshots/s" << std::endl;
+		return true;
+	}
+
+	NetPeer* findPeer(const NetAddress& address) {
+		for (uint32_t i = 0; i < NET_MAX_CLIENTS; i++) {
+			if (peers[i].active && peers[i].address == address) {
+				return &peers[i];
+			}
+		}
+		return nullptr;
+	}
+
+	NetPeer* addPeer(const NetAddress& address) {
+		for (uint32_t i = 0; i < NET_MAX_CLIENTS; i++) {
+			NetPeer& peer = peers[i];
+
+			if (peer.active) {
+				continue;
+			}
+
+			peer.active = true;
+			peer.address = address;
+			peer.actions.clear();
+			peer.heldBits = 0;
+			peer.lastSequence = 0;
+			peer.ackTick = 0;
+			peer.echoTime = 0;
+			peer.bytesSent = 0;
+			peer.snapshotsSent = 0;
+			peer.deltaSnapshots = 0;
+			peer.truncated = 0;
+
+			for (uint32_t h = 0; h < NET_HISTORY; h++) {
+				history[i].records[h].tick = 0;
+				history[i].records[h].entities.clear();
+			}
+
+			peer.camera.init(&physics, btVector3(i * 4.0f - 14.0f, 2.0f, 24.0f), glm::vec2(0.0f, 0.0f), 60.0f, 16.0f / 9.0f, 1.0f, 1024.0f);
+			peer.camera.forceFields = &forceFields;
+
+			std::cout << "Server: client " << i << " connected" << std::endl;
+			return &peer;
+		}
+		return nullptr;
+	}
+
+	void removePeer(NetPeer& peer) {
+		peer.camera.release();
+		peer.active = false;
+		std::cout << "Server: client " << (&peer - peers) << " disconnected" << std::endl;
+	}
+
+	void receive(double now) {
+		NetAddress from;
+		uint32_t size;
+
+		while ((size = socket.receive(from, buffer, NET_MAX_PACKET)) > 0) {
+			NetReader reader(buffer, size);
+			uint8_t type;
+
+			if (!reader.read(type)) {
+				continue;
+			}
+
+			NetPeer* peer = this->findPeer(from);
+
+			if (type == NetPacketType::NP_HELLO && peer == nullptr) {
+				peer = this->addPeer(from);
+			}
+
+			if (peer == nullptr) {
+				continue;
+			}
+
+			peer->lastHeard = now;
+
+			if (type == NetPacketType::NP_BYE) {
+				this->removePeer(*peer);
+			}
+			else if (type == NetPacketType::NP_INPUT) {
+				this->readInput(*peer, reader);
+			}
+		}
+	}
+
+	void readInput(NetPeer& peer, NetReader& reader) {
+		uint32_t sequence, clientTime, ackTick;
+		float rotX, rotY;
+		uint16_t heldBits;
+		uint8_t count;
+
+		if (!reader.read(sequence) || !reader.read(clientTime) || !reader.read(ackTick) ||
+			!reader.read(rotX) || !reader.read(rotY) || !reader.read(heldBits) || !reader.read(count)) {
+			return;
+		}
+
+		// Out of order, a newer packet already arrived
+		if (sequence <= peer.lastSequence) {
+			return;
+		}
+
+		peer.lastSequence = sequence;
+		peer.echoTime = clientTime;
+		peer.echoReceived = SDL_GetPerformanceCounter();
+		peer.ackTick = std::max(peer.ackTick, ackTick);
+		peer.camera.rot = glm::vec2(rotX, rotY);
+		peer.heldBits = heldBits;
+
+		for (uint32_t i = 0; i < count; i++) {
+			uint8_t actionType, pressed;
+
+			if (!reader.read(actionType) || !reader.read(pressed) || actionType >= IA_COUNT) {
+				return;
+			}
+
+			InputAction action;
+			action.type = actionType;
+			action.pressed = pressed != 0;
+			action.timestamp = peer.echoReceived;
+			peer.actions.push_back(action);
+		}
+	}
+
+	// Runs before every physics sub-step
+	void physicsTick(btScalar timeStep) {
+		for (uint32_t i = 0; i < NET_MAX_CLIENTS; i++) {
+			NetPeer& peer = peers[i];
+
+			if (!peer.active) {
+				continue;
+			}
+
+			for (uint32_t a = 0; a < peer.actions.size(); a++) {
+				peer.camera.doAction(peer.actions[a]);
+			}
+			peer.actions.clear();
+
+			// Held keys are also sent as a bit mask every packet, so a
+			// lost release can't leave the player walking
+			for (uint32_t a = IA_FORWARD; a <= IA_SPRINT; a++) {
+				peer.camera.held[a] = (peer.heldBits & (1 << a)) != 0;
+			}
+
+			peer.camera.tick(timeStep);
+		}
+
+		forceFields.tick(timeStep);
+	}
+
+	void capture(SnapshotRecord& record) {
+		record.tick = tick;
+		record.entities.clear();
+
+		std::function<void(uint32_t, uint32_t, const btTransform&)> add = [&](uint32_t type, uint32_t index, const btTransform& transform) {
+			NetEntity entity;
+			entity.id = (uint16_t)((type << NET_ID_TYPE_SHIFT) | (index & NET_ID_INDEX_MASK));
+			entity.position[0] = net_quantizePosition(transform.getOrigin().x());
+			entity.position[1] = net_quantizePosition(transform.getOrigin().y());
+			entity.position[2] = net_quantizePosition(transform.getOrigin().z());
+			entity.rotation = net_quantizeRotation(transform.getRotation());
+			record.entities.push_back(entity);
+		};
+
+		uint32_t index = 0;
+
+		for (uint32_t i = 0; i < boxObjects.size(); i++) {
+			add(NetEntityType::NET_BOX, index++, boxObjects[i].body->getWorldTransform());
+		}
+
+		for (uint32_t i = 0; i < sphereObjects.size(); i++) {
+			add(NetEntityType::NET_SPHERE, index++, sphereObjects[i].body->getWorldTransform());
+		}
+
+		// Players are indexed by slot, so clients can find their own
+		for (uint32_t i = 0; i < NET_MAX_CLIENTS; i++) {
+			if (peers[i].active) {
+				btTransform transform(btQuaternion(0, 0, 0, 1), peers[i].camera.getPosition());
+				add(NetEntityType::NET_PLAYER, i, transform);
+			}
+		}
+	}
+
+	void sendSnapshots() {
+		this->capture(current);
+
+		for (uint32_t i = 0; i < NET_MAX_CLIENTS; i++) {
+			NetPeer& peer = peers[i];
+
+			if (!peer.active) {
+				continue;
+			}
+
+			// Delta against the newest snapshot the client confirmed
+			SnapshotRecord* base = nullptr;
+			SnapshotRecord& candidate = history[i].records[peer.ackTick % NET_HISTORY];
+
+			if (peer.ackTick != 0 && candidate.tick == peer.ackTick && tick - peer.ackTick < NET_HISTORY) {
+				base = &candidate;
+			}
+
+			NetWriter writer;
+			uint16_t hold = (uint16_t)std::min(util_milliseconds(peer.echoReceived, SDL_GetPerformanceCounter()), 65535.0);
+
+			writer.write((uint8_t)NetPacketType::NP_SNAPSHOT);
+			writer.write(tick);
+			writer.write(base != nullptr ? base->tick : 0u);
+			writer.write(peer.echoTime);
+			writer.write(hold);
+			writer.write((uint8_t)i);
+
+			uint32_t countOffset = writer.size;
+			uint16_t count = 0;
+			writer.write(count);
+
+			// The client's state once it applied this packet, sorted by id
+			// like both lists
+			std::vector<NetEntity> held;
+			held.reserve(current.entities.size());
+
+			uint32_t b = 0;
+
+			for (uint32_t e = 0; e < current.entities.size(); e++) {
+				const NetEntity& entity = current.entities[e];
+				const NetEntity* previous = nullptr;
+
+				if (base != nullptr) {
+					while (b < base->entities.size() && base->entities[b].id < entity.id) {
+						if (!this->writeRemoved(writer, base->entities[b], count)) {
+							held.push_back(base->entities[b]);
+							peer.truncated++;
+						}
+						b++;
+					}
+
+					if (b < base->entities.size() && base->entities[b].id == entity.id) {
+						previous = &base->entities[b++];
+
+						if (*previous == entity) {
+							held.push_back(entity);
+							continue;
+						}
+					}
+				}
+
+				if (writer.write(entity)) {
+					held.push_back(entity);
+					count++;
+				}
+				else {
+					// Still unsent, the client keeps what it had
+					if (previous != nullptr) {
+						held.push_back(*previous);
+					}
+					peer.truncated++;
+				}
+			}
+
+			while (base != nullptr && b < base->entities.size()) {
+				if (!this->writeRemoved(writer, base->entities[b], count)) {
+					held.push_back(base->entities[b]);
+					peer.truncated++;
+				}
+				b++;
+			}
+
+			memcpy(writer.data + countOffset, &count, sizeof(uint16_t));
+
+			SnapshotRecord& record = history[i].records[tick % NET_HISTORY];
+			record.tick = tick;
+			record.entities.swap(held);
+
+			socket.send(peer.address, writer.data, writer.size);
+
+			peer.bytesSent += writer.size;
+			peer.snapshotsSent++;
+
+			if (base != nullptr) {
+				peer.deltaSnapshots++;
+			}
+		}
+	}
+
+	bool writeRemoved(NetWriter& writer, const NetEntity& entity, uint16_t& count) {
+		NetEntity removed = entity;
+		removed.id |= NET_ID_REMOVED;
+
+		if (!writer.write(removed)) {
+			return false;
+		}
+
+		count++;
+		return true;
+	}
+
+	void printStats(double seconds) {
+		for (uint32_t i = 0; i < NET_MAX_CLIENTS; i++) {
+			NetPeer& peer = peers[i];
+
+			if (!peer.active) {
+				continue;
+			}
+
+			std::cout << "Server: client " << i << " " << std::fixed << std::setprecision(2)
+				<< (peer.bytesSent / seconds / 1024.0) << " KiB/s, "
+				<< peer.snapshotsSent << " snapshots (" << peer.deltaSnapshots << " delta), avg "
+				<< (peer.snapshotsSent > 0 ? peer.bytesSent / peer.snapshotsSent : 0) << " bytes"
+				<< std::defaultfloat << std::endl;
+
+			if (peer.truncated > 0) {
+				std::cout << "Server: client " << i << " " << peer.truncated
+					<< " entity updates didn't fit a snapshot and were deferred" << std::endl;
+			}
+
+			peer.bytesSent = 0;
+			peer.snapshotsSent = 0;
+			peer.deltaSnapshots = 0;
+			peer.truncated = 0;
+		}
+
+		std::cout << "Server: bullet " << std::fixed << std::setprecision(1)
+			<< (memoryStats.getBulletCurrent() / 1024.0) << " KiB, bodies peak "
+			<< (memoryStats.getPeak(MEM_BODIES) / 1024.0) << " KiB, step peak "
+			<< (memoryStats.getPeak(MEM_SIMULATION) / 1024.0) << " KiB"
+			<< std::defaultfloat << std::endl;
+	}
+
+	void release() {
+		for (uint32_t i = 0; i < NET_MAX_CLIENTS; i++) {
+			if (peers[i].active) {
+				this->removePeer(peers[i]);
+			}
+		}
+
+		socket.close();
+		net_release();
+	}
+};
+
+static NetServer server;
+
+void server_physicsTick(btScalar timeStep) {
+	server.physicsTick(timeStep);
+}
+
+// run.exe --server [port] [rate] [seconds]
+// Headless authoritative world. Steps the scene at 60 Hz and streams
+// snapshots to every connected client at rate per second, forever when
+// seconds is 0.
+int tool_server(int argc, char** argv) {
+	uint16_t port = (argc > 0) ? (uint16_t)atoi(argv[0]) : NET_DEFAULT_PORT;
+	uint32_t rate = (argc > 1) ? atoi(argv[1]) : NET_DEFAULT_RATE;
+	double duration = (argc > 2) ? atof(argv[2]) : 0.0;
+
+	if (!server.init(port, rate)) {
+		return 1;
+	}
+
+	srand(1);
+
+	physics.init();
+	physics.preTick = server_physicsTick;
+	forceFields.init(&physics);
+	floorObject.init(&physics);
+	app_spawnObjects();
+
+	uint64_t frequency = SDL_GetPerformanceFrequency();
+	uint64_t start = SDL_GetPerformanceCounter();
+	uint64_t ticksPerSnapshot = std::max(60u / server.rate, 1u);
+	double lastStats = 0.0;
+
+	double now = 0.0;
+
+	while (duration <= 0.0 || now < duration) {
+		now = (double)(SDL_GetPerformanceCounter() - start) / frequency;
+
+		server.receive(now);
+
+		for (uint32_t i = 0; i < NET_MAX_CLIENTS; i++) {
+			if (server.peers[i].active && now - server.peers[i].lastHeard > NET_TIMEOUT) {
+				server.removePeer(server.peers[i]);
+			}
+		}
+
+		// Catch up on every fixed tick that is due
+		while (server.tick < (uint32_t)(now / FIXED_FRAME_60)) {
+			physics.stepSimulation();
+			server.tick++;
+
+			if (server.tick % ticksPerSnapshot == 0) {
+				server.sendSnapshots();
+			}
+		}
+
+		if (now - lastStats >= 1.0) {
+			server.printStats(now - lastStats);
+			lastStats = now;
+		}
+
+		SDL_Delay(1);
+	}
+
+	memoryStats.print();
+
+	server.release();
+
+	for (uint32_t i = 0; i < sphereObjects.size(); i++) {
+		sphereObjects[i].release();
+	}
+	sphereObjects.clear();
+
+	for (uint32_t i = 0; i < boxObjects.size(); i++) {
+		boxObjects[i].release();
+	}
+	boxObjects.clear();
+
+	floorObject.release();
+	forceFields.clear();
+	physics.release();
+
+	return 0;
+}
+
+/*
+	------------------ Client Section --------------------------
+*/
+// Rendering runs this far behind the newest snapshot so there is
+// nearly always a later snapshot to interpolate towards
+#define NET_INTERP_DELAY 0.1
+#define NET_CLIENT_SNAPSHOTS 64
+#define NET_HELLO_INTERVAL 0.5
+
+struct ClientSnapshot {
+	uint32_t tick = 0;
+	// Stamp of the newest input the server applied before this snapshot
+	uint32_t echoTime = 0;
+	std::vector<NetEntity> entities;
+};
+
+struct NetClient {
+	UdpSocket socket;
+	NetAddress server;
+	bool connected = false;
+	double lastHello = -1.0;
+
+	// Received snapshots by tick, also the baselines for deltas
+	ClientSnapshot snapshots[NET_CLIENT_SNAPSHOTS];
+	uint32_t latestTick = 0;
+	uint64_t latestReceived = 0;
+	int32_t slot = -1;
+
+	uint32_t sequence = 0;
+	uint16_t heldBits = 0;
+	std::vector<InputAction> actions;
+
+	glm::vec2 rot = glm::vec2(0.0f, 0.0f);
+	float speed = 64.0f;
+	btVector3 position = btVector3(0, 2, 0);
+
+	// Stats, reset every second
+	uint64_t start = 0;
+	double statsTime = 0.0;
+	uint64_t bytesReceived = 0;
+	uint32_t packetsReceived = 0;
+	double rttTotal = 0.0;
+	uint32_t rttSamples = 0;
+	double bandwidth = 0.0;
+	double rtt = 0.0;
+	double inputLatencyTotal = 0.0;
+	uint32_t inputLatencySamples = 0;
+	double inputLatency = 0.0;
+
+	// One input with actions is timed at a time, from the oldest action
+	// being polled until a snapshot the server built after applying it is
+	// on screen. pendingStamp is the stamp of the packet that carried it.
+	uint32_t pendingStamp = 0;
+	uint64_t pendingEvent = 0;
+	// Echo stamp of the snapshot rendered last frame
+	uint32_t displayedEcho = 0;
+
+	uint8_t buffer[NET_MAX_PACKET];
+
+	bool init(std::string address) {
+		if (!server.parse(address)) {
+			std::cout << "Client: bad server address " << address << std::endl;
+			return false;
+		}
+
+		if (!net_init() || !socket.open(0)) {
+			std::cout << "Client: unable to open UDP socket" << std::endl;
+			return false;
+		}
+
+		start = SDL_GetPerformanceCounter();
+		return true;
+	}
+
+	double now() {
+		return util_milliseconds(start, SDL_GetPerformanceCounter()) / 1000.0;
+	}
+
+	void update(float delta) {
+		// Last frame was swapped by now, so its snapshot is displayed
+		if (pendingStamp != 0 && displayedEcho >= pendingStamp) {
+			inputLatencyTotal += util_milliseconds(pendingEvent, SDL_GetPerformanceCounter());
+			inputLatencySamples++;
+			pendingStamp = 0;
+		}
+
+		int x = 0, y = 0;
+		SDL_GetRelativeMouseState(&x, &y);
+
+		rot.x += this->speed * y * ((delta - 0.001f < 0) ? 0.001f : delta);
+		rot.y += this->speed * x * ((delta - 0.001f < 0) ? 0.001f : delta);
+		rot.x = std::max(-90.0f, std::min(90.0f, rot.x));
+		rot.y = fmodf(rot.y, 360.0f);
+
+		if (!connected && now() - lastHello >= NET_HELLO_INTERVAL) {
+			uint8_t hello = NetPacketType::NP_HELLO;
+			socket.send(server, &hello, 1);
+			lastHello = now();
+		}
+
+		this->receive();
+
+		if (now() - statsTime >= 1.0) {
+			double seconds = now() - statsTime;
+			bandwidth = bytesReceived / seconds / 1024.0;
+			rtt = (rttSamples > 0) ? rttTotal / rttSamples : 0.0;
+			inputLatency = (inputLatencySamples > 0) ? inputLatencyTotal / inputLatencySamples : inputLatency;
+			bytesReceived = 0;
+			packetsReceived = 0;
+			rttTotal = 0.0;
+			rttSamples = 0;
+			inputLatencyTotal = 0.0;
+			inputLatencySamples = 0;
+			statsTime = now();
+		}
+	}
+
+	void receive() {
+		NetAddress from;
+		uint32_t size;
+
+		while ((size = socket.receive(from, buffer, NET_MAX_PACKET)) > 0) {
+			if (!(from == server)) {
+				continue;
+			}
+
+			bytesReceived += size;
+			packetsReceived++;
+
+			NetReader reader(buffer, size);
+			uint8_t type;
+
+			if (reader.read(type) && type == NetPacketType::NP_SNAPSHOT) {
+				this->readSnapshot(reader);
+			}
+		}
+	}
+
+	void readSnapshot(NetReader& reader) {
+		uint32_t tick, baseTick, echoTime;
+		uint16_t hold, count;
+		uint8_t peerSlot;
+
+		if (!reader.read(tick) || !reader.read(baseTick) || !reader.read(echoTime) ||
+			!reader.read(hold) || !reader.read(peerSlot) || !reader.read(count)) {
+			return;
+		}
+
+		connected = true;
+		slot = peerSlot;
+
+		if (echoTime != 0) {
+			uint32_t nowMs = (uint32_t)(now() * 1000.0);
+			rttTotal += (double)(nowMs - echoTime) - hold;
+			rttSamples++;
+		}
+
+		// Stale, or the baseline was already overwritten
+		if (tick <= latestTick && latestTick != 0) {
+			return;
+		}
+
+		ClientSnapshot* base = nullptr;
+
+		if (baseTick != 0) {
+			base = &snapshots[baseTick % NET_CLIENT_SNAPSHOTS];
+
+			if (base->tick != baseTick) {
+				return;
+			}
+		}
+
+		std::vector<NetEntity> changes(count);
+
+		for (uint32_t i = 0; i < count; i++) {
+			if (!reader.read(changes[i])) {
+				return;
+			}
+		}
+
+		ClientSnapshot& snapshot = snapshots[tick % NET_CLIENT_SNAPSHOTS];
+		std::vector<NetEntity> entities;
+
+		// Merge the sorted baseline with the sorted changes
+		uint32_t b = 0;
+		uint32_t c = 0;
+		uint32_t baseCount = (base != nullptr) ? base->entities.size() : 0;
+
+		while (b < baseCount || c < count) {
+			uint16_t baseID = (b < baseCount) ? base->entities[b].id : 0xFFFF;
+			uint16_t changeID = (c < count) ? (changes[c].id & ~NET_ID_REMOVED) : 0xFFFF;
+
+			if (baseID < changeID) {
+				entities.push_back(base->entities[b++]);
+				continue;
+			}
+
+			if (baseID == changeID) {
+				b++;
+			}
+
+			if ((changes[c].id & NET_ID_REMOVED) == 0) {
+				entities.push_back(changes[c]);
+			}
+			c++;
+		}
+
+		snapshot.tick = tick;
+		snapshot.echoTime = echoTime;
+		snapshot.entities.swap(entities);
+
+		latestTick = tick;
+		latestReceived = SDL_GetPerformanceCounter();
+	}
+
+	// Queues actions from the input system and sends them with the held
+	// keys and look direction, once per fixed update
+	void sendInput() {
+		if (!connected) {
+			return;
+		}
+
+		input.beginTick(1);
+
+		InputAction action;
+
+		while (input.next(action)) {
+			if (action.pressed) {
+				heldBits |= (1 << action.type);
+			}
+			else {
+				heldBits &= ~(1 << action.type);
+			}
+
+			actions.push_back(action);
+		}
+
+		uint32_t stamp = (uint32_t)std::max(now() * 1000.0, 1.0);
+
+		if (pendingStamp == 0 && !actions.empty()) {
+			pendingStamp = stamp;
+			pendingEvent = actions[0].timestamp;
+		}
+
+		NetWriter writer;
+		writer.write((uint8_t)NetPacketType::NP_INPUT);
+		writer.write(++sequence);
+		writer.write(stamp);
+		writer.write(latestTick);
+		writer.write(rot.x);
+		writer.write(rot.y);
+		writer.write(heldBits);
+
+		uint8_t count = (uint8_t)std::min(actions.size(), (size_t)255);
+		writer.write(count);
+
+		for (uint32_t i = 0; i < count; i++) {
+			writer.write(actions[i].type);
+			writer.write((uint8_t)actions[i].pressed);
+		}
+
+		actions.erase(actions.begin(), actions.begin() + count);
+
+		socket.send(server, writer.data, writer.size);
+	}
+
+	// Server time NET_INTERP_DELAY behind the newest snapshot
+	double renderTick() {
+		double since = util_milliseconds(latestReceived, SDL_GetPerformanceCounter()) / 1000.0;
+		return latestTick + (since - NET_INTERP_DELAY) / FIXED_FRAME_60;
+	}
+
+	void render() {
+		if (latestTick == 0) {
+			return;
+		}
+
+		double target = this->renderTick();
+
+		// Newest snapshot at or before the target and the one after it
+		ClientSnapshot* from = nullptr;
+		ClientSnapshot* to = nullptr;
+
+		for (uint32_t i = 0; i < NET_CLIENT_SNAPSHOTS; i++) {
+			ClientSnapshot& snapshot = snapshots[i];
+
+			if (snapshot.tick == 0 || latestTick - snapshot.tick >= NET_CLIENT_SNAPSHOTS) {
+				continue;
+			}
+
+			if (snapshot.tick <= target && (from == nullptr || snapshot.tick > from->tick)) {
+				from = &snapshot;
+			}
+
+			if (snapshot.tick > target && (to == nullptr || snapshot.tick < to->tick)) {
+				to = &snapshot;
+			}
+		}
+
+		if (from == nullptr) {
+			from = to;
+		}
+
+		if (to == nullptr) {
+			to = from;
+		}
+
+		float t = (to->tick != from->tick) ? (float)((target - from->tick) / (to->tick - from->tick)) : 0.0f;
+
+		displayedEcho = std::max(displayedEcho, from->echoTime);
+
+		uint32_t f = 0;
+
+		for (uint32_t i = 0; i < to->entities.size(); i++) {
+			const NetEntity& b = to->entities[i];
+
+			while (f < from->entities.size() && from->entities[f].id < b.id) {
+				f++;
+			}
+
+			// Entities that just appeared snap to their position
+			const NetEntity& a = (f < from->entities.size() && from->entities[f].id == b.id) ? from->entities[f] : b;
+
+			btVector3 pa(a.position[0], a.position[1], a.position[2]);
+			btVector3 pb(b.position[0], b.position[1], b.position[2]);
+			btVector3 p = pa.lerp(pb, t) / NET_POSITION_SCALE;
+			btQuaternion q = net_dequantizeRotation(a.rotation).slerp(net_dequantizeRotation(b.rotation), t);
+
+			uint32_t type = b.id >> NET_ID_TYPE_SHIFT;
+
+			if (type == NetEntityType::NET_PLAYER) {
+				// Our own player is the camera
+				if ((int32_t)(b.id & NET_ID_INDEX_MASK) == slot) {
+					position = p;
+					continue;
+				}
+
+				glm::mat4 model =
+					glm::translate(glm::mat4(1.0f), glm::vec3(p.x(), p.y(), p.z())) *
+					glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, 2.0f, 1.0f));
+				renderQueue.submit(resources.mainProgram, resources.cubeMesh, resources.playerMaterial, model);
+				continue;
+			}
+
+			btScalar m[16];
+			btTransform(q, p).getOpenGLMatrix(m);
+			glm::mat4 model = glm::make_mat4(m);
 
-//static Camera camera;
+			if (type == NetEntityType::NET_BOX) {
+				renderQueue.submit(resources.mainProgram, resources.cubeMesh, resources.boxMaterial, model);
+			}
+			else {
+				renderQueue.submit(resources.mainProgram, resources.sphereMesh, resources.sphereMaterial, model);
+			}
+		}
+	}
+
+	glm::mat4 getView() {
+		return
+			glm::rotate(glm::mat4(1.0f), glm::radians(this->rot.x), glm::vec3(1.0f, 0.0f, 0.0f)) *
+			glm::rotate(glm::mat4(1.0f), glm::radians(this->rot.y), glm::vec3(0.0f, 1.0f, 0.0f)) *
+			glm::translate(glm::mat4(1.0f), -glm::vec3(position.x(), position.y() + 1.0f, position.z()));
+	}
+
+	glm::mat4 getProjection() {
+		return glm::perspective(glm::radians(60.0f), (float)g_width / (float)g_height, 1.0f, 1024.0f);
+	}
+
+	void release() {
+		uint8_t bye = NetPacketType::NP_BYE;
+		socket.send(server, &bye, 1);
+		socket.close();
+		net_release();
+	}
+};
+
+static NetClient client;
+
+void reset_Objects() {
+	// Boxes
+	for (uint32_t i = 0; i < 32; i++) {
+		int x = (rand() % 40) - 20;
+		int y = (rand() % 160) + 32;
+		int z = (rand() % 40) - 20;
+
+		int rx = rand() % 361;
+		int ry = rand() % 361;
+		int rz = rand() % 361;
+
+		btTransform transform = btTransform(btQuaternion(rx, ry, rz), btVector3(x, y, z));
+		
+		boxObjects[i].body->setAngularVelocity(btVector3(0, 0, 0));
+		boxObjects[i].body->setLinearVelocity(btVector3(0, 0, 0));
+		boxObjects[i].body->setWorldTransform(transform);
+		boxObjects[i].body->activate(true);
+	}
+	// Spheres
+	for (uint32_t i = 0; i < 32; i++) {
+		int x = (rand() % 40) - 20;
+		int y = (rand() % 160) + 32;
+		int z = (rand() % 40) - 20;
+
+		btTransform transform = btTransform(btQuaternion(0, 0, 0, 1), btVector3(x, y, z));
+
+		sphereObjects[i].body->setAngularVelocity(btVector3(0, 0, 0));
+		sphereObjects[i].body->setLinearVelocity(btVector3(0, 0, 0));
+		sphereObjects[i].body->setWorldTransform(transform);
+		sphereObjects[i].body->activate(true);
+	}
+	// Models
+	for (uint32_t i = 0; i < modelObjects.size(); i++) {
+		int x = (rand() % 40) - 20;
+		int y = (rand() % 160) + 32;
+		int z = (rand() % 40) - 20;
+
+		btTransform transform = btTransform(btQuaternion(0, 0, 0, 1), btVector3(x, y, z));
+
+		modelObjects[i].body->setAngularVelocity(btVector3(0, 0, 0));
+		modelObjects[i].body->setLinearVelocity(btVector3(0, 0, 0));
+		modelObjects[i].body->setWorldTransform(transform);
+		modelObjects[i].body->activate(true);
+	}
+}
+
+// Boxes, spheres and imported models dropped over the floor. Boxes and
+// spheres are created in one batch.
+void app_spawnObjects() {
+	std::vector<btCollisionShape*> shapes;
+	std::vector<btTransform> transforms;
+
+	for (uint32_t i = 0; i < 32; i++) {
+		int x = (rand() % 40) - 20;
+		int y = (rand() % 160) + 32;
+		int z = (rand() % 40) - 20;
+
+		int rx = rand() % 361;
+		int ry = rand() % 361;
+		int rz = rand() % 361;
+
+		shapes.push_back(physics.createBoxShape(btVector3(1, 1, 1)));
+		transforms.push_back(btTransform(btQuaternion(btRadians(rx), btRadians(ry), btRadians(rz)), btVector3(x, y, z)));
+	}
+
+	for (uint32_t i = 0; i < 32; i++) {
+		int x = (rand() % 40) - 20;
+		int y = (rand() % 160) + 32;
+		int z = (rand() % 40) - 20;
+
+		shapes.push_back(physics.createBoxShape(btVector3(1, 1, 1)));
+		transforms.push_back(btTransform(btQuaternion(0, 0, 0, 1), btVector3(x, y, z)));
+	}
+
+	std::vector<float> masses(shapes.size(), 1.0f);
+	std::vector<btRigidBody*> bodies(shapes.size());
+
+	physics.createRigidBodies(shapes.size(), shapes.data(), transforms.data(), masses.data(), COL_OBJECT, COL_EVERYTHING, bodies.data());
+
+	for (uint32_t i = 0; i < 32; i++) {
+		BoxObject temp;
+		temp.init(&physics, bodies[i], shapes[i]);
+		boxObjects.push_back(temp);
+	}
+
+	for (uint32_t i = 32; i < 64; i++) {
+		SphereObject temp;
+		temp.init(&physics, bodies[i], shapes[i]);
+		sphereObjects.push_back(temp);
+	}
+
+	for (uint32_t i = 0; resources.hasModel && i < 8; i++) {
+		int x = (rand() % 40) - 20;
+		int y = (rand() % 160) + 32;
+		int z = (rand() % 40) - 20;
+
+		ModelObject temp;
+		temp.init(&physics, btQuaternion(0, 0, 0, 1), btVector3(x, y, z));
+		modelObjects.push_back(temp);
+	}
+}
+
+void app_init() {
+
+	// Captures use a fixed seed so runs can be compared
+	srand(g_capturePath.empty() ? time(nullptr) : 1);
+
+	glEnable(GL_DEPTH_TEST);
+
+	vertexShader.init(GL_VERTEX_SHADER, "data/shaders/main.vs.glsl");
+	fragmentShader.init(GL_FRAGMENT_SHADER, "data/shaders/main.fs.glsl");
+
+	program.addShader(&vertexShader);
+	program.addShader(&fragmentShader);
+
+	program.init();
+
+	program.bind();
+
+	// Create Uniforms
+	program.createUniform("proj");
+	program.createUniform("view");
+
+	// Create Attributes, the model matrix and color come per instance
+	program.setAttribute("vertices", 0);
+	program.setAttribute("instanceModel0", 1);
+	program.setAttribute("instanceModel1", 2);
+	program.setAttribute("instanceModel2", 3);
+	program.setAttribute("instanceModel3", 4);
+	program.setAttribute("instanceColor", 5);
+
+	program.bindAttribute();
+	program.enableAttribute("vertices");
+	program.enableAttribute("instanceModel0");
+	program.enableAttribute("instanceModel1");
+	program.enableAttribute("instanceModel2");
+	program.enableAttribute("instanceModel3");
+	program.enableAttribute("instanceColor");
+	program.unbindAttribute();
+	program.disableAttribute("vertices");
+	program.disableAttribute("instanceModel0");
+	program.disableAttribute("instanceModel1");
+	program.disableAttribute("instanceModel2");
+	program.disableAttribute("instanceModel3");
+	program.disableAttribute("instanceColor");
+
+	program.unbind();
+
+
+	// HUB Shaders
+	hubVertexShader.init(GL_VERTEX_SHADER, "data/shaders/hub.vs.glsl");
+	hubFragmentShader.init(GL_FRAGMENT_SHADER, "data/shaders/hub.fs.glsl");
+
+	hubProgram.addShader(&hubVertexShader);
+	hubProgram.addShader(&hubFragmentShader);
+
+	hubProgram.init();
+
+	hubProgram.bind();
+	hubProgram.createUniform("proj");
+	hubProgram.createUniform("view");
+	hubProgram.createUniform("model");
+	hubProgram.createUniform("tex0");
+	hubProgram.set1i("tex0", 0);
+
+	hubProgram.setAttribute("vertices", 0);
+	hubProgram.setAttribute("texCoords", 1);
+
+	hubProgram.bindAttribute();
+	hubProgram.enableAttribute("vertices");
+	hubProgram.enableAttribute("texCoords");
+	hubProgram.unbindAttribute();
+	hubProgram.disableAttribute("vertices");
+	hubProgram.disableAttribute("texCoords");
+
+	hubProgram.unbind();
+
+	// Debug Shaders
+	debugVertexShader.init(GL_VERTEX_SHADER, "data/shaders/debug.vs.glsl");
+	debugFragmentShader.init(GL_FRAGMENT_SHADER, "data/shaders/debug.fs.glsl");
+
+	debugProgram.addShader(&debugVertexShader);
+	debugProgram.addShader(&debugFragmentShader);
+
+	debugProgram.init();
+
+	debugProgram.bind();
+	debugProgram.createUniform("proj");
+	debugProgram.createUniform("view");
+
+	debugProgram.setAttribute("vertices", 0);
+	debugProgram.setAttribute("colors", 1);
+
+	debugProgram.bindAttribute();
+	debugProgram.enableAttribute("vertices");
+	debugProgram.enableAttribute("colors");
+	debugProgram.unbindAttribute();
+	debugProgram.disableAttribute("vertices");
+	debugProgram.disableAttribute("colors");
+
+	debugProgram.unbind();
+
+	renderQueue.init();
+	resources.init();
+
+	input.init();
+
+	if (g_netClient) {
+		client.init(g_connectAddress);
+	}
+	else {
+		physics.ccd = g_ccd;
+		physics.substeps = g_substeps;
+		physics.broadphaseType = broadphase_fromName(g_broadphase);
+		physics.init();
+		physics.preTick = app_physicsTick;
+		physics.getWorld()->setDebugDrawer(&debugDrawer);
+
+		forceFields.init(&physics);
+
+		camera.init(
+			&physics,
+			btVector3(0.0f, 2.0f, 0.0f),
+			glm::vec2(0.0f, 0.0f),
+			60.0f,
+			(float)g_width / (float)g_height,
+			1.0f,
+			1024.0f,
+			g_kinematicPlayer ? PlayerController::PC_KINEMATIC : PlayerController::PC_DYNAMIC);
+		camera.forceFields = &forceFields;
+
+		floorObject.init(&physics);
+
+		if (!g_levelPath.empty()) {
+			hasLevel = level.init(g_levelPath);
+		}
+		else if (g_terrainSize > 0) {
+			hasLevel = level.initTerrain(g_terrainSize);
+		}
+
+		if (hasLevel) {
+			level.createBody(&physics);
+			level.initGeometry();
+			resources.levelMesh = renderQueue.addMesh(&level.geometry);
+		}
+
+		if (g_streamWorld) {
+			world.init(&physics);
+			world.onUnloadBody = app_unloadBody;
+		}
+
+		app_spawnObjects();
+	}
+
+	profiler.init();
+
+	textureLoader.init();
+	textureLoader.load(&crosshairTex, "data/textures/crosshair.png");
+	crosshairQuad.init();
+	
+	debugDrawer.init();
+}
+
+void app_event(SDL_Event& e) {
+	if (e.type == SDL_KEYUP) {
+		// The server owns the objects in client mode
+		if (e.key.keysym.scancode == SDL_SCANCODE_Q && !g_netClient) {
+			reset_Objects();
+		}
+
+		if (e.key.keysym.scancode == SDL_SCANCODE_F1) {
+			isDebugLine = !isDebugLine;
+		}
+
+		if (e.key.keysym.scancode == SDL_SCANCODE_F3) {
+			profiler.toggle();
+		}
+
+		if (e.key.keysym.scancode == SDL_SCANCODE_F4 && !g_netClient) {
+			if (vortexField == 0) {
+				ForceField field;
+				field.type = ForceFieldType::FF_VORTEX;
+				field.center = btVector3(0, 8, 0);
+				field.direction = btVector3(0, 1, 0);
+				field.radius = 24.0f;
+				field.strength = 48.0f;
+				vortexField = forceFields.add(field);
+			}
+			else {
+				forceFields.remove(vortexField);
+				vortexField = 0;
+			}
+		}
+
+		if (e.key.keysym.scancode == SDL_SCANCODE_F5 && !g_netClient) {
+			if (windField == 0) {
+				ForceField field;
+				field.type = ForceFieldType::FF_WIND;
+				field.center = btVector3(0, 16, 0);
+				field.direction = btVector3(1, 0, 0);
+				field.radius = 64.0f;
+				field.strength = 16.0f;
+				field.falloff = 0;
+				windField = forceFields.add(field);
+			}
+			else {
+				forceFields.remove(windField);
+				windField = 0;
+			}
+		}
+
+		if (e.key.keysym.scancode == SDL_SCANCODE_F2) {
+			if (polyMode == PolyMode::PM_FILL) {
+				polyMode = PolyMode::PM_LINE;
+			}
+			else if (polyMode == PolyMode::PM_LINE) {
+				polyMode = PolyMode::PM_POINT;
+			}
+			else if (polyMode == PolyMode::PM_POINT) {
+				polyMode = PolyMode::PM_FILL;
+			}
+
+			switch (polyMode) {
+			case PolyMode::PM_FILL:
+				glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+				break;
+			case PolyMode::PM_LINE:
+				glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+				break;
+			case PolyMode::PM_POINT:
+				glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
+				break;
+			}
+		}
+	}
+
+	input.doEvent(e);
+}
+
+void app_update(float delta) {
+
+	profiler.beginFrame();
+	profiler.begin(PT_UPDATE);
+
+	const uint8_t* keys = SDL_GetKeyboardState(nullptr);
+
+	if (keys[SDL_SCANCODE_ESCAPE]) {
+		g_running = false;
+	}
+
+	if (g_netClient) {
+		client.update(delta);
+	}
+	else {
+		camera.update(delta);
+	}
+
+	textureLoader.update();
+
+	profiler.setCounter("frame mean ms", framePacer.meanMs);
+	profiler.setCounter("frame p99 ms", framePacer.p99Ms);
+	profiler.setCounter("frame max ms", framePacer.maxMs);
+	profiler.setCounter("frame jitter ms", framePacer.jitterMs);
+	profiler.setCounter("frame sleep ms", framePacer.sleepAverage);
+	profiler.setCounter("frame spin ms", framePacer.spinAverage);
+
+	profiler.end(PT_UPDATE);
+}
+
+void app_fixedUpdate() {
+	if (g_netClient) {
+		client.sendInput();
+
+		profiler.setCounter("net KiB/s", client.bandwidth);
+		profiler.setCounter("net rtt ms", client.rtt);
+		profiler.setCounter("net input to display ms", client.inputLatency);
+		return;
+	}
+
+	profiler.begin(PT_FIXED_UPDATE);
+
+	if (g_streamWorld) {
+		world.update(camera.getPosition());
+	}
+
+	input.beginTick(physics.substeps);
+	physics.stepSimulation();
+
+	profiler.end(PT_FIXED_UPDATE);
+
+	uint32_t contactCounts[3] = { 0, 0, 0 };
+	uint32_t impacts = 0;
+	ContactEvent contact;
+
+	while (physics.contacts.next(contact)) {
+		contactCounts[contact.type]++;
+
+		if (contact.type == ContactEventType::CE_BEGIN && contact.impulse >= CONTACT_IMPACT_IMPULSE) {
+			impacts++;
+		}
+	}
 
+	profiler.setCounter("contacts begin", contactCounts[ContactEventType::CE_BEGIN]);
+	profiler.setCounter("contacts persist", contactCounts[ContactEventType::CE_PERSIST]);
+	profiler.setCounter("contacts end", contactCounts[ContactEventType::CE_END]);
+	profiler.setCounter("contacts dropped", physics.contacts.dropped + physics.pairsDropped);
+	profiler.setCounter("impacts", impacts);
 
-struct FloorObject {
-	GeometryPlane floor;
-	btRigidBody* body;
-	btCollisionShape* shape;
+	for (uint32_t i = 0; i < MEM_COUNT; i++) {
+		profiler.setCounter(std::string("mem ") + memoryCategoryNames[i] + " KiB", memoryStats.getCurrent(i) / 1024.0);
+		profiler.setCounter(std::string("mem ") + memoryCategoryNames[i] + " peak", memoryStats.getPeak(i) / 1024.0);
+	}
 
-	void init() {
-		floor.init();
+	profiler.setCounter("input latency ms", input.latencyAverage);
+	profiler.setCounter("input latency max", input.latencyMax);
+	profiler.setCounter("input dropped", input.dropped);
+	profiler.setCounter("force fields", forceFields.fields.size());
+	profiler.setCounter("ccd bodies", physics.ccdBodies);
+	profiler.setCounter("broadphase ms", physics.broadphaseTimer->ms);
+	profiler.setCounter("broadphase pairs", physics.broadphase->getOverlappingPairCache()->getNumOverlappingPairs());
+	profiler.setCounter("field bodies", forceFields.affected);
+
+	if (g_streamWorld) {
+		profiler.setCounter("world cells", world.cells.size());
+		profiler.setCounter("world bodies", world.bodyCount);
+		profiler.setCounter("world stored cells", world.getStoredCount());
+	}
+}
 
-		shape = physics.createStaticPlaneShape(btVector3(0, 1, 0), 0);
+// Runs before each internal physics sub-step
+void app_unloadBody(btRigidBody* body) {
+	camera.releaseBody(body);
+}
 
-		btTransform transform = btTransform(btQuaternion(0, 0, 0, 1));
+void app_physicsTick(btScalar timeStep) {
+	InputAction action;
 
-		body = physics.createRigid(0, transform, shape, COL_GROUND, COL_EVERYTHING);
+	while (input.next(action)) {
+		camera.doAction(action);
 	}
 
-	void render() {
-		btTransform transform = body->getWorldTransform();
-		btScalar m[16];
-		transform.getOpenGLMatrix(m);
+	camera.tick(timeStep);
 
-		glm::mat4 model = 
-			glm::make_mat4(m) * 
-			glm::scale(glm::mat4(1.0f), glm::vec3(20.0f, 0.0f, 20.0f));
+	profiler.begin(PT_FORCE_FIELDS);
+	forceFields.tick(timeStep);
+	profiler.end(PT_FORCE_FIELDS);
 
-		program.setMat4("model", model);
-		program.set4f("frag_Color", glm::vec4(0.0f, 0.5f, 0.0f, 1.0f));
+	input.endSubstep();
+}
 
-		floor.render(program);
+void app_render() {
+	glClear(
+		GL_COLOR_BUFFER_BIT | 
+		GL_DEPTH_BUFFER_BIT);
 
-	}
+	// Render 3D
+	profiler.begin(PT_RENDER_3D);
 
-	void release() {
-		physics.removeRigidBody(body);
-		delete shape;
-		floor.release();
-	}
-};
+	if (g_netClient) {
+		renderQueue.begin(client.getProjection(), client.getView());
 
-struct BoxObject {
-	GeometryCube box;
-	btRigidBody* body;
-	btCollisionShape* shape;
+		// The floor never moves so it isn't part of the snapshots
+		glm::mat4 floorModel = glm::scale(glm::mat4(1.0f), glm::vec3(20.0f, 0.0f, 20.0f));
+		renderQueue.submit(resources.mainProgram, resources.planeMesh, resources.floorMaterial, floorModel);
 
-	void init(const btQuaternion& rotation, const btVector3& position) {
-		box.init();
-		shape = physics.createBoxShape(btVector3(1, 1, 1));
-		btTransform transform = btTransform(rotation, position);
-		body = physics.createRigid(1, transform, shape, COL_OBJECT, COL_EVERYTHING);
+		client.render();
 	}
+	else {
+		renderQueue.begin(camera.getProjection(), camera.getView());
 
-	void render() {
-		btTransform transform = body->getWorldTransform();
-		float m[16];
-		transform.getOpenGLMatrix(m);
-		glm::mat4 model = glm::make_mat4(m);
-		program.setMat4("model", model);
-		program.set4f("frag_Color", glm::vec4(1.0f, 0.0f, 0.0f, 1.0f));
+		floorObject.render();
+		//boxObject.render();
 
-		box.render(program);
-	}
+		if (hasLevel) {
+			renderQueue.submit(resources.mainProgram, resources.levelMesh, resources.levelMaterial, glm::mat4(1.0f));
+		}
 
-	void release() {
-		physics.removeRigidBody(body);
-		delete shape;
-		box.release();
-	}
+		for (int i = 0; i < boxObjects.size(); i++) {
+			boxObjects[i].render();
+		}
 
-};
+		for (int i = 0; i < sphereObjects.size(); i++) {
+			sphereObjects[i].render();
+		}
 
-struct SphereObject {
-	GeometrySphere box;
-	btRigidBody* body;
-	btCollisionShape* shape;
+		for (int i = 0; i < modelObjects.size(); i++) {
+			modelObjects[i].render();
+		}
 
-	void init(const btQuaternion& rotation, const btVector3& position) {
-		box.init();
-		shape = physics.createBoxShape(btVector3(1, 1, 1));
-		btTransform transform = btTransform(rotation, position);
-		body = physics.createRigid(1, transform, shape, COL_OBJECT, COL_EVERYTHING);
+		if (g_streamWorld) {
+			world.render();
+		}
 	}
 
-	void render() {
-		btTransform transform = body->getWorldTransform();
-		float m[16];
-		transform.getOpenGLMatrix(m);
-		glm::mat4 model = glm::make_mat4(m);
-		program.setMat4("model", model);
-		program.set4f("frag_Color", glm::vec4(0.0f, 0.0f, 1.0f, 1.0f));
+	renderQueue.flush();
 
-		box.render(program);
-	}
+	if (isDebugLine && !g_netClient) {
+		debugDrawer.begin();
+		physics.getWorld()->debugDrawWorld();
+		debugLine.draw(debugDrawer);
+		debugDrawer.flush(debugProgram, camera.getProjection(), camera.getView());
 
-	void release() {
-		physics.removeRigidBody(body);
-		delete shape;
-		box.release();
+		profiler.setCounter("debug lines", debugDrawer.lines);
+		profiler.setCounter("debug lines dropped", debugDrawer.dropped);
 	}
 
-};
+	profiler.end(PT_RENDER_3D);
 
+	profiler.setCounter("draw calls", renderQueue.stats.drawCalls);
+	profiler.setCounter("draw commands", renderQueue.stats.commands);
+	profiler.setCounter("program binds", renderQueue.stats.programBinds);
+	profiler.setCounter("arena binds", renderQueue.stats.arenaBinds);
 
-enum PhysicsOptions {
-	PO_PUSH = 0,
-	PO_PULL,
-	PO_MASS_PUSH,
-	PO_MASS_PULL,
-	PO_GRAB_BODY
-};
+	glm::mat4 proj = glm::ortho(0.0f, (float)g_width, (float)g_height, 0.0f);
+	glm::mat4 view = glm::mat4(1.0f);
+	glm::mat4 model =
+		glm::translate(glm::mat4(1.0f), glm::vec3(g_width * 0.5f, g_height * 0.5f, 0.0f)) *
+		glm::scale(glm::mat4(1.0f), glm::vec3(16.0f, 16.0f, 0.0f));
 
-struct PhysicsCamera {
-	btRigidBody* body = nullptr;
-	btCollisionShape* shape = nullptr;
-	glm::vec2 rot;
 
-	float fov;
-	float aspect;
-	float znear;
-	float zfar;
+	// Render HUB
+	profiler.begin(PT_RENDER_HUB);
 
-	float speed = 64.0f;
-	float walkSpeed = 512.0f;
-	float jumpSpeed = 512.0f;
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE_MINUS_DST_COLOR, GL_ZERO);
 
-	PhysicsOptions options = PhysicsOptions::PO_PUSH;
+	hubProgram.bind();
 
-	btRigidBody* grabbed = nullptr;
+	hubProgram.setMat4("proj", proj);
+	hubProgram.setMat4("view", view);
+	hubProgram.setMat4("model", model);
 
-	void init(
-		btVector3 position,
-		glm::vec2 rotation,
-		float fov,
-		float aspect,
-		float znear,
-		float zfar) {
+	crosshairTex.bind(GL_TEXTURE0);
 
-		this->shape = physics.createCapsuleShape(1.0f, 2.0f);
+	crosshairQuad.render(hubProgram);
 
-		btTransform transform = btTransform(btQuaternion(0, 0, 0, 1), position);
+	crosshairTex.unbind(GL_TEXTURE0);
+	
+	hubProgram.unbind();
 
-		this->body = physics.createRigid(1.0f, transform, this->shape, COL_CAMERA, COL_EVERYTHING);
-		this->body->setSleepingThresholds(0.0f, 0.0f);
-		this->body->setAngularFactor(0.0f);
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
 
-		this->rot = rotation;
+	profiler.end(PT_RENDER_HUB);
 
-		this->fov = fov;
-		this->aspect = aspect;
-		this->znear = znear;
-		this->zfar = zfar;
+	profiler.endFrame();
+}
 
-		SDL_SetRelativeMouseMode(SDL_TRUE);
+void app_release() {
+	memoryStats.print();
+
+	debugDrawer.release();
+
+	crosshairQuad.release();
+	textureLoader.release();
+	crosshairTex.release();
 
+	if (g_netClient) {
+		client.release();
 	}
+	else {
+		// Held bodies are deleted below, let go of them first
+		camera.releaseGrabbed();
 
-	void doEvent(SDL_Event& e) {
+		if (g_streamWorld) {
+			world.release();
+		}
 
-		if (e.type == SDL_KEYUP) {
-			switch (e.key.keysym.scancode) {
-			case SDL_SCANCODE_1:
-				options = PhysicsOptions::PO_PUSH;
-				grabbed = nullptr;
-				std::cout << "PhysicsOptions: RAY PUSH MODE." << std::endl;
-				break;
-			case SDL_SCANCODE_2:
-				options = PhysicsOptions::PO_PULL;
-				grabbed = nullptr;
-				std::cout << "PhysicsOptions: RAY PULL MODE." << std::endl;
-				break;
-			case SDL_SCANCODE_3:
-				options = PhysicsOptions::PO_MASS_PUSH;
-				grabbed = nullptr;
-				std::cout << "PhysicsOptions: MASS PUSH MODE." << std::endl;
-				break;
-			case SDL_SCANCODE_4:
-				options = PhysicsOptions::PO_MASS_PULL;
-				grabbed = nullptr;
-				std::cout << "PhysicsOptions: MASS PULL MODE." << std::endl;
-				break;
-			case SDL_SCANCODE_5:
-				options = PhysicsOptions::PO_GRAB_BODY;
-				std::cout << "PhysicsOptions: GRAB BODY MODE." << std::endl;
-				break;
-			default:
-				break;
-			}
+		for (int i = 0; i < modelObjects.size(); i++) {
+			modelObjects[i].release();
 		}
+		modelObjects.clear();
 
-		std::function<void(float)> phyRayPush = [&](float force) {
-			btVector3 rayTo = this->pickRay(g_width / 2, g_height / 2);
-			btVector3 pos = this->body->getCenterOfMassPosition();
-			pos.setY(pos.y() + 1.0f);
-			btCollisionWorld::ClosestRayResultCallback rayCallback(pos, rayTo);
-			rayCallback.m_collisionFilterGroup = COL_OBJECT;
-			rayCallback.m_collisionFilterMask = COL_OBJECT;
-			physics.dynamicWorld->rayTest(pos, rayTo, rayCallback);
-			debugLine.setLine(pos, rayTo);
-			if (rayCallback.hasHit()) {
-				debugLine.setLine(pos, rayCallback.m_hitPointWorld);
-				btRigidBody* b = (btRigidBody*)btRigidBody::upcast(rayCallback.m_collisionObject);
-				b->activate(true);
-				// Used for Push
-				btVector3 dir = b->getCenterOfMassPosition() - pos;
-				dir.normalize();
-				dir *= force;
-				b->setLinearVelocity(dir);
-			}
-		};
+		for (int i = 0; i < sphereObjects.size(); i++) {
+			sphereObjects[i].release();
+		}
+		sphereObjects.clear();
 
-		std::function<void(float)> phyRayPull = [&](float force) {
-			btVector3 rayTo = this->pickRay(g_width / 2, g_height / 2);
-			btVector3 pos = this->body->getCenterOfMassPosition();
-			pos.setY(pos.y() + 1.0f);
-			btCollisionWorld::ClosestRayResultCallback rayCallback(pos, rayTo);
-			rayCallback.m_collisionFilterGroup = COL_OBJECT;
-			rayCallback.m_collisionFilterMask = COL_OBJECT;
-			physics.dynamicWorld->rayTest(pos, rayTo, rayCallback);
-			debugLine.setLine(pos, rayTo);
-			if (rayCallback.hasHit()) {
-				debugLine.setLine(pos, rayCallback.m_hitPointWorld);
-				btRigidBody* b = (btRigidBody*)btRigidBody::upcast(rayCallback.m_collisionObject);
-				b->activate(true);
-				// Used for Push
-				btVector3 dir = pos - b->getCenterOfMassPosition();
-				dir.normalize();
-				dir *= force;
-				b->setLinearVelocity(dir);
-			}
-		};
+		for (int i = 0; i < boxObjects.size(); i++) {
+			boxObjects[i].release();
+		}
+		boxObjects.clear();
 
-		std::function<void(const btVector3&, float)> phyMassPush = [&](const btVector3& offsets, float force) {
-			std::vector<btRigidBody*> bodies;
-			btVector3 point = body->getCenterOfMassPosition();
-			btVector3 minAABB = point - offsets;
-			btVector3 maxAABB = offsets + point;
-			physics.getRigidBodiesFromAABB(minAABB, maxAABB, bodies, COL_OBJECT);
+		if (hasLevel) {
+			level.release();
+			hasLevel = false;
+		}
 
-			std::cout << bodies.size() << std::endl;
+		floorObject.release();
+		camera.release();
 
-			for (int i = 0; i < bodies.size(); i++) {
-				btVector3 other = bodies[i]->getCenterOfMassPosition();
-				btVector3 dir = other - point;
-				dir.normalize();
-				dir *= force;
-				bodies[i]->activate(true);
-				bodies[i]->setLinearVelocity(dir);
-			}
-		};
+		forceFields.clear();
+		physics.release();
+	}
 
-		std::function<void(const btVector3&, float)> phyMassPull = [&](const btVector3& offsets, float force) {
-			std::vector<btRigidBody*> bodies;
-			btVector3 point = body->getCenterOfMassPosition();
-			btVector3 minAABB = point - offsets;
-			btVector3 maxAABB = offsets + point;
-			physics.getRigidBodiesFromAABB(minAABB, maxAABB, bodies, COL_OBJECT);
-			for (int i = 0; i < bodies.size(); i++) {
-				btVector3 other = bodies[i]->getCenterOfMassPosition();
-				btVector3 dir = point - other;
-				dir.normalize();
-				dir *= force;
-				bodies[i]->activate(true);
-				bodies[i]->setLinearVelocity(dir);
-			}
-		};
+	resources.release();
+	renderQueue.release();
+	mesh_releaseArenas();
 
-		std::function<void()> grabRigidBody = [&]() {
-			btVector3 rayTo = this->pickRay(g_width / 2, g_height / 2);
-			btVector3 pos = this->body->getCenterOfMassPosition();
-			pos.setY(pos.y() + 1.0f);
-			btCollisionWorld::ClosestRayResultCallback rayCallback(pos, rayTo);
-			rayCallback.m_collisionFilterGroup = COL_OBJECT;
-			rayCallback.m_collisionFilterMask = COL_OBJECT;
-			physics.dynamicWorld->rayTest(pos, rayTo, rayCallback);
-			debugLine.setLine(pos, rayTo);
-			if (rayCallback.hasHit()) {
-				debugLine.setLine(pos, rayTo);
-				this->grabbed = (btRigidBody*)btRigidBody::upcast(rayCallback.m_collisionObject);
-			}
-		};
+	hubProgram.release();
+	hubFragmentShader.release();
+	hubVertexShader.release();
 
-		if (e.type == SDL_MOUSEBUTTONUP) {
-			if (e.button.button == SDL_BUTTON_LEFT) {
+	debugProgram.release();
+	debugFragmentShader.release();
+	debugVertexShader.release();
 
-				if (this->grabbed == nullptr) {
-					switch (this->options) {
-					case PhysicsOptions::PO_PUSH:
-						phyRayPush(64);
-						break;
-					case PhysicsOptions::PO_PULL:
-						phyRayPull(64);
-						break;
-					case PhysicsOptions::PO_MASS_PUSH:
-						phyMassPush(btVector3(32, 32, 32), 64);
-						break;
-					case PhysicsOptions::PO_MASS_PULL:
-						phyMassPull(btVector3(32, 32, 32), 64);
-						break;
-					case PhysicsOptions::PO_GRAB_BODY:
-						grabRigidBody();
-						break;
-					}
-				}
-				else {
-					grabbed = nullptr;
-				}
-			}
-			else if (e.button.button == SDL_BUTTON_RIGHT) {
+	profiler.release();
+
+	program.release();
 
-				if (this->grabbed != nullptr) {
+	fragmentShader.release();
+	vertexShader.release();
+}
 
-					if (this->options == PhysicsOptions::PO_GRAB_BODY) {
-						btVector3 rayTo = this->pickRay(g_width / 2, g_height / 2);
+/*
+	------------------ Benchmark Section --------------------------
+*/
+// run.exe --bench-controller [bodies] [ticks]
+// Walks the player through a dense pile of boxes with each controller
+// and reports the physics step time.
+int tool_benchController(int argc, char** argv) {
+	uint32_t count = (argc > 0) ? atoi(argv[0]) : 2000;
+	uint32_t ticks = (argc > 1) ? atoi(argv[1]) : 600;
 
-						btVector3 dir = rayTo - body->getCenterOfMassPosition();
+	const char* names[2] = { "dynamic", "kinematic" };
 
-						dir.normalize();
+	for (uint32_t c = 0; c < 2; c++) {
+		physics.init();
+		physics.preTick = app_physicsTick;
+		input.init();
 
-						dir *= 128.0f;
+		camera.init(&physics, btVector3(0.0f, 2.0f, 0.0f), glm::vec2(0.0f, 0.0f), 60.0f, 16.0f / 9.0f, 1.0f, 1024.0f, (PlayerController)c);
+		floorObject.init(&physics);
 
-						grabbed->activate(true);
-						grabbed->setLinearVelocity(dir);
-						grabbed = nullptr;
-					}
-				}
+		// Columns of boxes 8 high, leaving room for the player to spawn
+		uint32_t side = (uint32_t)ceil(sqrt(count / 8.0f));
+
+		for (uint32_t i = 0; boxObjects.size() < count; i++) {
+			float x = ((i % side) - side * 0.5f) * 2.1f;
+			float z = (((i / side) % side) - side * 0.5f) * 2.1f;
+			float y = 1.0f + (i / (side * side)) * 2.1f;
+
+			if (fabs(x) < 3.0f && fabs(z) < 3.0f) {
+				continue;
 			}
+
+			BoxObject temp;
+			temp.init(&physics, btQuaternion(0, 0, 0, 1), btVector3(x, y, z));
+			boxObjects.push_back(temp);
 		}
-	}
 
-	void update(float delta) {
-		int x = 0, y = 0;
-		uint32_t buttons = SDL_GetRelativeMouseState(&x, &y);
-		const uint8_t* keys = SDL_GetKeyboardState(nullptr);
+		camera.held[IA_FORWARD] = true;
 
-		body->activate(true);
+		double total = 0.0;
+		double peak = 0.0;
 
-		rot.x += this->speed * y * ((delta - 0.001f < 0) ? 0.001f : delta);
-		rot.y += this->speed * x * ((delta - 0.001f < 0) ? 0.001f : delta);
+		for (uint32_t t = 0; t < ticks; t++) {
+			input.beginTick(physics.substeps);
 
-		if (rot.y <= -360.0f) {
-			rot.y += 360.0f;
-		}
+			uint64_t start = SDL_GetPerformanceCounter();
+			physics.stepSimulation();
+			double ms = util_milliseconds(start, SDL_GetPerformanceCounter());
 
-		if (rot.y >= 360.0f) {
-			rot.y -= 360.0f;
+			total += ms;
+			peak = std::max(peak, ms);
 		}
 
-		if (rot.x < -90.0f) {
-			rot.x = -90.0f;
+		uint32_t active = 0;
+		for (uint32_t i = 0; i < boxObjects.size(); i++) {
+			if (boxObjects[i].body->isActive()) {
+				active++;
+			}
 		}
 
-		if (rot.x > 90.0f) {
-			rot.x = 90.0f;
+		std::cout << names[c] << " controller: " << boxObjects.size() << " bodies, " << ticks << " ticks, step avg "
+			<< (total / ticks) << " ms, max " << peak << " ms, " << active << " active bodies at end" << std::endl;
+
+		for (uint32_t i = 0; i < boxObjects.size(); i++) {
+			boxObjects[i].release();
 		}
+		boxObjects.clear();
+		floorObject.release();
+		camera.release();
+		physics.release();
+	}
 
-		float yrad = glm::radians(rot.y);
+	return 0;
+}
 
-		float sp = this->walkSpeed;
+// run.exe --bench-fields [fields] [bodies] [ticks]
+// Drops bodies on the floor under randomly placed fields of every type
+// and reports the time spent applying the fields per tick.
+int tool_benchFields(int argc, char** argv) {
+	uint32_t fieldCount = (argc > 0) ? atoi(argv[0]) : 200;
+	uint32_t count = (argc > 1) ? atoi(argv[1]) : 4000;
+	uint32_t ticks = (argc > 2) ? atoi(argv[2]) : 300;
 
-		if (keys[SDL_SCANCODE_E]) {
-			sp *= 3.0f;
-		}
+	srand(1);
 
-		btVector3 vel = body->getLinearVelocity();
-		
-		vel[0] = 0;
-		vel[2] = 0;
+	physics.init();
+	forceFields.init(&physics);
+	floorObject.init(&physics);
 
-		if (keys[SDL_SCANCODE_SPACE]) {
-			vel[1] = this->jumpSpeed * FIXED_FRAME_60;
-		}
+	uint32_t side = (uint32_t)ceil(sqrt(count / 4.0f));
 
-		if (keys[SDL_SCANCODE_W]) {
-			vel[0] += sp * btSin(yrad) * FIXED_FRAME_60;
-			vel[2] -= sp * btCos(yrad) * FIXED_FRAME_60;
-		}
+	for (uint32_t i = 0; i < count; i++) {
+		float x = ((i % side) - side * 0.5f) * 2.5f;
+		float z = (((i / side) % side) - side * 0.5f) * 2.5f;
+		float y = 1.0f + (i / (side * side)) * 2.5f;
 
-		if (keys[SDL_SCANCODE_S]) {
-			vel[0] -= sp * btSin(yrad) * FIXED_FRAME_60;
-			vel[2] += sp * btCos(yrad) * FIXED_FRAME_60;
-		}
+		BoxObject temp;
+		temp.init(&physics, btQuaternion(0, 0, 0, 1), btVector3(x, y, z));
+		boxObjects.push_back(temp);
+	}
 
-		if (keys[SDL_SCANCODE_A]) {
-			vel[0] -= sp * btCos(yrad) * FIXED_FRAME_60;
-			vel[2] -= sp * btSin(yrad) * FIXED_FRAME_60;
-		}
+	float extent = side * 1.25f;
+
+	for (uint32_t i = 0; i < fieldCount; i++) {
+		ForceField field;
+		field.type = (ForceFieldType)(i % 3);
+		field.center = btVector3(
+			((rand() % 2001) / 1000.0f - 1.0f) * extent,
+			4.0f,
+			((rand() % 2001) / 1000.0f - 1.0f) * extent);
+		field.direction = (field.type == ForceFieldType::FF_WIND) ? btVector3(1, 0, 0) : btVector3(0, 1, 0);
+		field.radius = 12.0f;
+		field.strength = (i % 2 == 0) ? 32.0f : -32.0f;
+		forceFields.add(field);
+	}
 
-		if (keys[SDL_SCANCODE_D]) {
-			vel[0] += sp * btCos(yrad) * FIXED_FRAME_60;
-			vel[2] += sp * btSin(yrad) * FIXED_FRAME_60;
-		}
+	double fieldTotal = 0.0;
+	double stepTotal = 0.0;
+	uint64_t affected = 0;
 
-		body->setLinearVelocity(vel);
+	for (uint32_t t = 0; t < ticks; t++) {
+		uint64_t start = SDL_GetPerformanceCounter();
+		forceFields.tick(FIXED_FRAME_60);
+		uint64_t mid = SDL_GetPerformanceCounter();
+		physics.stepSimulation();
+		uint64_t end = SDL_GetPerformanceCounter();
+
+		fieldTotal += util_milliseconds(start, mid);
+		stepTotal += util_milliseconds(mid, end);
+		affected += forceFields.affected;
 	}
 
-	void fixedUpdate() {
-		if (this->options == PhysicsOptions::PO_GRAB_BODY && this->grabbed != nullptr) {
-			glm::mat4 trans = glm::translate(glm::mat4(1.0f), glm::vec3(.5f, .5f, 5.0f));
+	std::cout << fieldCount << " fields, " << count << " bodies, " << ticks << " ticks: fields avg "
+		<< (fieldTotal / ticks) << " ms (" << (affected / ticks) << " body/field pairs per tick), step avg "
+		<< (stepTotal / ticks) << " ms" << std::endl;
 
-			glm::mat4 movement = trans * this->getView();
+	forceFields.clear();
 
-			movement = glm::inverse(movement);
+	for (uint32_t i = 0; i < boxObjects.size(); i++) {
+		boxObjects[i].release();
+	}
+	boxObjects.clear();
+	floorObject.release();
+	physics.release();
 
-			glm::vec3 v = glm::normalize(glm::vec3(1.0f, 1.0f, 1.0f));
+	return 0;
+}
 
-			glm::vec4 v4 = glm::vec4(v, 1.0f);
+// run.exe --bench-tunneling [bodies] [speed]
+// Fires small spheres through resting ones at a thin slab at launch speed
+// and counts how many end up on the wrong side. Runs discrete stepping,
+// per-body CCD and whole world sub-stepping so correctness and cost can
+// be compared.
+int tool_benchTunneling(int argc, char** argv) {
+	uint32_t count = (argc > 0) ? atoi(argv[0]) : 1000;
+	float speed = (argc > 1) ? (float)atof(argv[1]) : GRAB_LAUNCH_SPEED;
+	uint32_t ticks = 120;
+
+	struct Config {
+		const char* name;
+		bool ccd;
+		int substeps;
+	};
+
+	Config configs[] = {
+		{ "discrete",      false, 1 },
+		{ "ccd",           true,  1 },
+		{ "substeps x4",   false, 4 },
+		{ "substeps x8",   false, 8 }
+	};
+
+	for (uint32_t c = 0; c < 4; c++) {
+		physics.ccd = configs[c].ccd;
+		physics.substeps = configs[c].substeps;
+		physics.init();
+
+		// 10 cm thick slab at y = 0
+		btCollisionShape* slabShape = physics.createBoxShape(btVector3(64.0f, 0.05f, 64.0f));
+		btRigidBody* slab = physics.createRigid(0, btTransform(btQuaternion(0, 0, 0, 1), btVector3(0, -0.05f, 0)), slabShape, COL_GROUND, COL_EVERYTHING);
+
+		btCollisionShape* sphereShape = physics.createSphereShape(0.1f);
+		std::vector<btRigidBody*> bodies;
+		uint32_t side = (uint32_t)ceil(sqrt(count / 2.0f));
+
+		for (uint32_t i = 0; i < count; i++) {
+			// Spheres come in pairs on the same column, one resting on the
+			// slab and one fired down through it
+			uint32_t column = i / 2;
+			float x = ((column % side) - side * 0.5f) * 0.5f;
+			float z = ((column / side) - side * 0.5f) * 0.5f;
+
+			bool fired = (i % 2 == 1);
+			btVector3 position(x, fired ? 2.0f : 0.1f, z);
+
+			btRigidBody* body = physics.createRigid(0.1f, btTransform(btQuaternion(0, 0, 0, 1), position), sphereShape, COL_OBJECT, COL_EVERYTHING);
+
+			if (fired) {
+				body->setLinearVelocity(btVector3(0, -speed, 0));
+			}
 
-			v4 = movement * v4;
+			bodies.push_back(body);
+		}
 
-			btTransform tran = grabbed->getCenterOfMassTransform();
+		double total = 0.0;
 
-			tran.setOrigin(btVector3(v4.x, v4.y, v4.z));
-			tran.setRotation(btQuaternion(btRadians(-rot.y), btRadians(-rot.x), 0.0f));
-			grabbed->activate(true);
-			grabbed->setCenterOfMassTransform(tran);
+		for (uint32_t t = 0; t < ticks; t++) {
+			uint64_t start = SDL_GetPerformanceCounter();
+			physics.stepSimulation();
+			total += util_milliseconds(start, SDL_GetPerformanceCounter());
 		}
-	}
 
-	glm::mat4 getProjection() {
-		return glm::perspective(
-			glm::radians(this->fov),
-			aspect,
-			znear,
-			zfar);
-	}
+		uint32_t tunneled = 0;
 
-	glm::mat4 getView() {
-		btVector3 position = body->getCenterOfMassPosition();
+		for (uint32_t i = 0; i < bodies.size(); i++) {
+			if (bodies[i]->getCenterOfMassPosition().y() < -0.1f) {
+				tunneled++;
+			}
+		}
 
-		glm::vec3 pos = glm::vec3(
-			position.x(),
-			position.y() + 1.0f,
-			position.z()
-		);
+		std::cout << std::left << std::setw(12) << configs[c].name
+			<< " tunneled " << tunneled << " / " << count
+			<< ", step avg " << (total / ticks) << " ms" << std::endl;
 
-		return	
-				glm::rotate(glm::mat4(1.0f), glm::radians(this->rot.x), glm::vec3(1.0f, 0.0f, 0.0f)) *
-				glm::rotate(glm::mat4(1.0f), glm::radians(this->rot.y), glm::vec3(0.0f, 1.0f, 0.0f)) *
-				glm::translate(glm::mat4(1.0f), -pos);
+		for (uint32_t i = 0; i < bodies.size(); i++) {
+			physics.removeRigidBody(bodies[i]);
+		}
+		physics.removeRigidBody(slab);
+
+		delete sphereShape;
+		delete slabShape;
+
+		physics.release();
 	}
 
-	btVector3 pickRay(int x, int y) {
-		glm::vec3 coords;
+	return 0;
+}
 
-		coords.x = (((2.0f * x) / g_width) - 1);
-		coords.y = -(((2.0f * y) / g_height) - 1);
-		coords.z = -1.0f;
+// run.exe --bench-level [size]
+// Loads a generated size x size terrain twice, first with the cache
+// removed so the BVH is built and written, then mapped from the cache,
+// and drops spheres on it to check the mapped BVH collides.
+int tool_benchLevel(int argc, char** argv) {
+	uint32_t size = (argc > 0) ? std::max(atoi(argv[0]), 2) : 384;
+	uint32_t count = 256;
+	uint32_t ticks = 240;
 
-		glm::mat4 proj = this->getProjection();
-		glm::mat4 view = this->getView();
+	physics.init();
 
-		coords.x /= proj[1][1];
-		coords.y /= proj[2][2];
+	const char* names[2] = { "cold", "warm" };
+	double times[2];
 
-		coords *= this->zfar;
+	for (uint32_t c = 0; c < 2; c++) {
+		if (c == 0) {
+			Level temp;
+			temp.name = "terrain" + std::to_string(size);
+			std::remove((LEVEL_CACHE_DIR + temp.getCacheName() + ".bin").c_str());
+		}
 
-		glm::mat4 invView = glm::inverse(view);
+		uint64_t start = SDL_GetPerformanceCounter();
 
-		coords = glm::mat3(invView) * coords;
+		if (!level.initTerrain(size)) {
+			physics.release();
+			return 1;
+		}
 
-		return btVector3(coords.x, coords.y, coords.z);
-	}
+		times[c] = util_milliseconds(start, SDL_GetPerformanceCounter());
 
-	void release() {
-		physics.removeRigidBody(this->body);
-		delete this->shape;
+		if (c == 0) {
+			level.release();
+		}
 	}
 
-};
-
-float rotY = 0.0f;
+	level.createBody(&physics);
 
-PhysicsCamera camera;
+	btCollisionShape* sphereShape = physics.createSphereShape(0.5f);
+	std::vector<btRigidBody*> bodies;
+	uint32_t side = (uint32_t)ceil(sqrt((float)count));
+	float extent = (size - 1) * 2.0f * 0.4f;
 
-FloorObject floorObject;
-//BoxObject boxObject;
+	for (uint32_t i = 0; i < count; i++) {
+		float x = ((float)(i % side) / side - 0.5f) * extent;
+		float z = ((float)(i / side) / side - 0.5f) * extent;
+		bodies.push_back(physics.createRigid(1.0f, btTransform(btQuaternion(0, 0, 0, 1), btVector3(x, 16.0f, z)), sphereShape, COL_OBJECT, COL_EVERYTHING));
+	}
 
-std::vector<BoxObject> boxObjects;
-std::vector<SphereObject> sphereObjects;
+	double total = 0.0;
 
+	for (uint32_t t = 0; t < ticks; t++) {
+		uint64_t start = SDL_GetPerformanceCounter();
+		physics.stepSimulation();
+		total += util_milliseconds(start, SDL_GetPerformanceCounter());
+	}
 
-Texture2D crosshairTex;
-GeometryQuad crosshairQuad;
-bool isDebugLine = false;
-//bool isWireFrame = false;
+	uint32_t fell = 0;
 
-enum PolyMode {
-	PM_FILL = 0,
-	PM_LINE,
-	PM_POINT
-};
+	for (uint32_t i = 0; i < bodies.size(); i++) {
+		if (bodies[i]->getCenterOfMassPosition().y() < level.aabbMin.y() - 1.0f) {
+			fell++;
+		}
+	}
 
-PolyMode polyMode = PolyMode::PM_FILL;
+	std::cout << (level.indexCount / 3) << " triangles" << std::endl;
 
-void reset_Objects() {
-	// Boxes
-	for (uint32_t i = 0; i < 32; i++) {
-		int x = (rand() % 40) - 20;
-		int y = (rand() % 160) + 32;
-		int z = (rand() % 40) - 20;
+	for (uint32_t c = 0; c < 2; c++) {
+		std::cout << names[c] << " load " << times[c] << " ms" << std::endl;
+	}
 
-		int rx = rand() % 361;
-		int ry = rand() % 361;
-		int rz = rand() % 361;
+	std::cout << count << " spheres, " << fell << " fell through, step avg " << (total / ticks) << " ms" << std::endl;
 
-		btTransform transform = btTransform(btQuaternion(rx, ry, rz), btVector3(x, y, z));
-		
-		boxObjects[i].body->setAngularVelocity(btVector3(0, 0, 0));
-		boxObjects[i].body->setLinearVelocity(btVector3(0, 0, 0));
-		boxObjects[i].body->setWorldTransform(transform);
-		boxObjects[i].body->activate(true);
+	for (uint32_t i = 0; i < bodies.size(); i++) {
+		physics.removeRigidBody(bodies[i]);
 	}
-	// Spheres
-	for (uint32_t i = 0; i < 32; i++) {
-		int x = (rand() % 40) - 20;
-		int y = (rand() % 160) + 32;
-		int z = (rand() % 40) - 20;
+	delete sphereShape;
 
-		btTransform transform = btTransform(btQuaternion(0, 0, 0, 1), btVector3(x, y, z));
+	level.release();
+	physics.release();
 
-		sphereObjects[i].body->setAngularVelocity(btVector3(0, 0, 0));
-		sphereObjects[i].body->setLinearVelocity(btVector3(0, 0, 0));
-		sphereObjects[i].body->setWorldTransform(transform);
-		sphereObjects[i].body->activate(true);
-	}
+	return 0;
 }
 
-void app_init() {
+// run.exe --bench-streaming [cells] [speed]
+// Moves the streaming center in a straight line across the given number
+// of cells and reports how many bodies were simulated at most, to show
+// the active set stays bounded however far it travels.
+int tool_benchStreaming(int argc, char** argv) {
+	uint32_t cellCount = (argc > 0) ? atoi(argv[0]) : 64;
+	float speed = (argc > 1) ? (float)atof(argv[1]) : 40.0f;
+	uint32_t ticks = (uint32_t)(cellCount * WORLD_CELL_SIZE / (speed * FIXED_FRAME_60));
 
-	srand(time(nullptr));
+	physics.init();
+	floorObject.init(&physics);
+	world.init(&physics);
+
+	btVector3 center(0, 2, 0);
+	uint32_t maxBodies = 0;
+	uint32_t maxCells = 0;
+	double updateTotal = 0.0;
+	double stepTotal = 0.0;
+	double stepMax = 0.0;
+
+	for (uint32_t t = 0; t < ticks; t++) {
+		center.setX(center.x() + speed * FIXED_FRAME_60);
+
+		uint64_t start = SDL_GetPerformanceCounter();
+		world.update(center);
+		uint64_t mid = SDL_GetPerformanceCounter();
+		physics.stepSimulation();
+		uint64_t end = SDL_GetPerformanceCounter();
+
+		updateTotal += util_milliseconds(start, mid);
+		stepTotal += util_milliseconds(mid, end);
+		stepMax = std::max(stepMax, util_milliseconds(mid, end));
+		maxBodies = std::max(maxBodies, world.bodyCount);
+		maxCells = std::max(maxCells, (uint32_t)world.cells.size());
+	}
 
-	glEnable(GL_DEPTH_TEST);
+	std::cout << "travelled " << cellCount << " cells in " << ticks << " ticks" << std::endl;
+	std::cout << "max cells " << maxCells << ", max simulated bodies " << maxBodies
+		<< ", cells stored " << world.getStoredCount() << std::endl;
+	std::cout << "update avg " << (updateTotal / ticks) << " ms, step avg " << (stepTotal / ticks)
+		<< " ms, step max " << stepMax << " ms" << std::endl;
 
-	vertexShader.init(GL_VERTEX_SHADER, "data/shaders/main.vs.glsl");
-	fragmentShader.init(GL_FRAGMENT_SHADER, "data/shaders/main.fs.glsl");
+	memoryStats.print();
 
-	program.addShader(&vertexShader);
-	program.addShader(&fragmentShader);
+	world.release();
+	floorObject.release();
+	physics.release();
 
-	program.init();
+	return 0;
+}
 
-	program.bind();
+// One independent world of a batch run, a seed for where the boxes fall
+// and a friction value swept across the batch
+struct WorldScenario {
+	uint32_t seed;
+	float friction;
+	uint32_t bodies;
+	uint32_t ticks;
+
+	// Results
+	uint32_t sleeping;
+	float spread;
+};
 
-	// Create Uniforms
-	program.createUniform("proj");
-	program.createUniform("view");
-	program.createUniform("model");
-	program.createUniform("frag_Color");
-	program.set4f("frag_Color", glm::vec4(1.0f, 1.0f, 1.0f, 1.0f));
+void bench_runScenario(WorldScenario& scenario) {
+	// Each scenario owns its world, nothing is shared between threads
+	Physics physics;
+	physics.init();
 
-	// Create Attributes
-	program.setAttribute("vertices", 0);
+	FloorObject ground;
+	ground.init(&physics);
+	ground.body->setFriction(scenario.friction);
 
-	program.bindAttribute();
-	program.enableAttribute("vertices");
-	program.unbindAttribute();
-	program.disableAttribute("vertices");
+	uint32_t seed = scenario.seed;
 
-	program.unbind();
+	std::function<float()> next = [&]() {
+		seed = seed * 1664525u + 1013904223u;
+		return (seed >> 8) / 16777216.0f;
+	};
 
+	std::vector<BoxObject> boxes(scenario.bodies);
 
-	// HUB Shaders
-	hubVertexShader.init(GL_VERTEX_SHADER, "data/shaders/hub.vs.glsl");
-	hubFragmentShader.init(GL_FRAGMENT_SHADER, "data/shaders/hub.fs.glsl");
+	for (uint32_t i = 0; i < boxes.size(); i++) {
+		btVector3 position((next() - 0.5f) * 40.0f, 2.0f + next() * 64.0f, (next() - 0.5f) * 40.0f);
+		btQuaternion rotation(next() * SIMD_2_PI, next() * SIMD_2_PI, next() * SIMD_2_PI);
 
-	hubProgram.addShader(&hubVertexShader);
-	hubProgram.addShader(&hubFragmentShader);
+		boxes[i].init(&physics, rotation, position);
+		boxes[i].body->setFriction(scenario.friction);
+	}
 
-	hubProgram.init();
+	for (uint32_t t = 0; t < scenario.ticks; t++) {
+		physics.stepSimulation();
+	}
 
-	hubProgram.bind();
-	hubProgram.createUniform("proj");
-	hubProgram.createUniform("view");
-	hubProgram.createUniform("model");
-	hubProgram.createUniform("tex0");
-	hubProgram.set1i("tex0", 0);
+	scenario.sleeping = 0;
+	scenario.spread = 0.0f;
 
-	hubProgram.setAttribute("vertices", 0);
-	hubProgram.setAttribute("texCoords", 1);
+	for (uint32_t i = 0; i < boxes.size(); i++) {
+		btVector3 p = boxes[i].body->getCenterOfMassPosition();
+		scenario.spread += btVector3(p.x(), 0, p.z()).length() / boxes.size();
 
-	hubProgram.bindAttribute();
-	hubProgram.enableAttribute("vertices");
-	hubProgram.enableAttribute("texCoords");
-	hubProgram.unbindAttribute();
-	hubProgram.disableAttribute("vertices");
-	hubProgram.disableAttribute("texCoords");
+		if (!boxes[i].body->isActive()) {
+			scenario.sleeping++;
+		}
 
-	hubProgram.unbind();
+		boxes[i].release();
+	}
 
-	physics.init();
+	ground.release();
+	physics.release();
+}
 
-	camera.init(
-		btVector3(0.0f, 2.0f, 0.0f),
-		glm::vec2(0.0f, 0.0f),
-		60.0f,
-		(float)g_width / (float)g_height,
-		1.0f,
-		1024.0f);
+// run.exe --bench-worlds [worlds] [threads] [bodies] [ticks]
+// Simulates a batch of independent worlds on one thread and then on a
+// pool of threads, and reports the aggregate ticks per second of both.
+int tool_benchWorlds(int argc, char** argv) {
+	uint32_t worlds = (argc > 0) ? atoi(argv[0]) : 32;
+	uint32_t threads = (argc > 1) ? atoi(argv[1]) : std::thread::hardware_concurrency();
+	uint32_t bodies = (argc > 2) ? atoi(argv[2]) : 256;
+	uint32_t ticks = (argc > 3) ? atoi(argv[3]) : 600;
 
+	threads = std::max(threads, 1u);
 
-	floorObject.init();
+	std::vector<WorldScenario> scenarios(worlds);
 
-	for (uint32_t i = 0; i < 32; i++) {
-		int x = (rand() % 40) - 20;
-		int y = (rand() % 160) + 32;
-		int z = (rand() % 40) - 20;
+	uint32_t counts[2] = { 1, threads };
+	double rates[2] = { 0.0, 0.0 };
 
-		int rx = rand() % 361;
-		int ry = rand() % 361;
-		int rz = rand() % 361;
+	for (uint32_t r = 0; r < 2; r++) {
+		for (uint32_t i = 0; i < worlds; i++) {
+			scenarios[i].seed = i + 1;
+			scenarios[i].friction = (worlds > 1) ? (float)i / (worlds - 1) : 0.5f;
+			scenarios[i].bodies = bodies;
+			scenarios[i].ticks = ticks;
+		}
 
-		BoxObject temp;
+		std::atomic<uint32_t> nextScenario(0);
+		std::vector<std::thread> pool;
 
-		temp.init(btQuaternion(btRadians(rx), btRadians(ry), btRadians(rz)), btVector3(x, y, z));
+		uint64_t start = SDL_GetPerformanceCounter();
 
-		boxObjects.push_back(temp);
+		for (uint32_t t = 0; t < counts[r]; t++) {
+			pool.push_back(std::thread([&]() {
+				uint32_t i;
+				while ((i = nextScenario++) < worlds) {
+					bench_runScenario(scenarios[i]);
+				}
+			}));
+		}
+
+		std::for_each(pool.begin(), pool.end(), [&](std::thread& thread) {
+			thread.join();
+		});
+
+		double seconds = util_milliseconds(start, SDL_GetPerformanceCounter()) / 1000.0;
+		rates[r] = (double)worlds * ticks / seconds;
+
+		std::cout << counts[r] << " thread(s): " << worlds << " worlds x " << ticks << " ticks in "
+			<< seconds << " s, " << (uint64_t)rates[r] << " ticks/s" << std::endl;
 	}
 
-	for (uint32_t i = 0; i < 32; i++) {
-		int x = (rand() % 40) - 20;
-		int y = (rand() % 160) + 32;
-		int z = (rand() % 40) - 20;
+	std::cout << "speed up " << (rates[1] / rates[0]) << "x" << std::endl;
 
-		SphereObject temp;
-		temp.init(btQuaternion(0, 0, 0, 1), btVector3(x, y, z));
-		sphereObjects.push_back(temp);
+	for (uint32_t i = 0; i < worlds; i++) {
+		std::cout << "  world " << i << " friction " << scenarios[i].friction
+			<< ": " << scenarios[i].sleeping << "/" << bodies << " asleep, spread "
+			<< scenarios[i].spread << std::endl;
 	}
 
-	crosshairTex.init("data/textures/crosshair.png");
-	crosshairQuad.init();
-	
-	debugLine.init();
+	memoryStats.print();
+
+	return 0;
 }
 
-void app_event(SDL_Event& e) {
-	if (e.type == SDL_KEYUP) {
-		if (e.key.keysym.scancode == SDL_SCANCODE_Q) {
-			reset_Objects();
-		}
+// run.exe --bench-spawn [bodies]
+// Spawns a pile of touching boxes and spheres one body at a time through
+// createRigid and then in one batch through createRigidBodies, and
+// reports the spawn time, the pairs found, the depth of the broadphase
+// tree and the first step after it.
+int tool_benchSpawn(int argc, char** argv) {
+	uint32_t count = (argc > 0) ? std::max(atoi(argv[0]), 1) : 100000;
 
-		if (e.key.keysym.scancode == SDL_SCANCODE_F1) {
-			isDebugLine = !isDebugLine;
-		}
+	const char* names[2] = { "one by one", "bulk" };
 
-		if (e.key.keysym.scancode == SDL_SCANCODE_F2) {
-			if (polyMode == PolyMode::PM_FILL) {
-				polyMode = PolyMode::PM_LINE;
-			}
-			else if (polyMode == PolyMode::PM_LINE) {
-				polyMode = PolyMode::PM_POINT;
-			}
-			else if (polyMode == PolyMode::PM_POINT) {
-				polyMode = PolyMode::PM_FILL;
-			}
+	for (uint32_t c = 0; c < 2; c++) {
+		physics.init();
 
-			switch (polyMode) {
-			case PolyMode::PM_FILL:
-				glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-				break;
-			case PolyMode::PM_LINE:
-				glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-				break;
-			case PolyMode::PM_POINT:
-				glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
-				break;
-			}
-		}
-	}
+		btCollisionShape* boxShape = physics.createBoxShape(btVector3(1, 1, 1));
+		btCollisionShape* sphereShape = physics.createSphereShape(1.0f);
 
-	camera.doEvent(e);
-}
+		std::vector<btCollisionShape*> shapes(count);
+		std::vector<btTransform> transforms(count);
+		std::vector<float> masses(count, 1.0f);
+		std::vector<btRigidBody*> bodies(count);
 
-void app_update(float delta) {
+		uint32_t side = (uint32_t)ceil(cbrt((double)count));
 
-	const uint8_t* keys = SDL_GetKeyboardState(nullptr);
+		for (uint32_t i = 0; i < count; i++) {
+			float x = ((i % side) - side * 0.5f) * 2.0f;
+			float z = (((i / side) % side) - side * 0.5f) * 2.0f;
+			float y = 1.0f + (i / (side * side)) * 2.0f;
 
-	if (keys[SDL_SCANCODE_ESCAPE]) {
-		g_running = false;
-	}
+			shapes[i] = (i % 2 == 0) ? boxShape : sphereShape;
+			transforms[i] = btTransform(btQuaternion(0, 0, 0, 1), btVector3(x, y, z));
+		}
 
-	camera.update(delta);
-}
+		uint64_t start = SDL_GetPerformanceCounter();
 
-void app_fixedUpdate() {
-	physics.stepSimulation();
-	camera.fixedUpdate();
-}
+		if (c == 0) {
+			for (uint32_t i = 0; i < count; i++) {
+				bodies[i] = physics.createRigid(masses[i], transforms[i], shapes[i], COL_OBJECT, COL_EVERYTHING);
+			}
+		}
+		else {
+			physics.createRigidBodies(count, shapes.data(), transforms.data(), masses.data(), COL_OBJECT, COL_EVERYTHING, bodies.data());
+		}
 
-void app_render() {
-	glClear(
-		GL_COLOR_BUFFER_BIT | 
-		GL_DEPTH_BUFFER_BIT);
+		double spawn = util_milliseconds(start, SDL_GetPerformanceCounter());
 
-	// Render 3D
-	program.bind();
+		uint32_t pairs = physics.broadphase->getOverlappingPairCache()->getNumOverlappingPairs();
+		int depth = btDbvt::maxdepth(physics.dbvt->m_sets[0].m_root);
 
-	program.setMat4("proj", camera.getProjection());
-	program.setMat4("view", camera.getView());
+		start = SDL_GetPerformanceCounter();
+		physics.stepSimulation();
+		double step = util_milliseconds(start, SDL_GetPerformanceCounter());
 
-	floorObject.render();
-	//boxObject.render();
+		std::cout << std::left << std::setw(11) << names[c] << count << " bodies: spawn " << spawn
+			<< " ms (" << (spawn * 1000.0 / count) << " us/body), " << pairs << " pairs, tree depth "
+			<< depth << ", first step " << step << " ms" << std::endl;
 
-	for (int i = 0; i < boxObjects.size(); i++) {
-		boxObjects[i].render();
-	}
+		// The bodies are deleted along with the world
+		physics.release();
 
-	for (int i = 0; i < sphereObjects.size(); i++) {
-		sphereObjects[i].render();
+		delete sphereShape;
+		delete boxShape;
 	}
 
-	if (isDebugLine) {
-		debugLine.render(program);
-	}
+	return 0;
+}
 
-	program.unbind();
+// run.exe --bench-broadphase [bodies] [ticks]
+// Simulates three scenes with every broadphase: a dense pile of touching
+// bodies, bodies scattered sparsely over a bounded arena and a few tight
+// clusters far apart. Reports the time spent finding pairs, the pairs
+// found and the whole step, averaged over the ticks.
+int tool_benchBroadphase(int argc, char** argv) {
+	uint32_t count = (argc > 0) ? std::max(atoi(argv[0]), 1) : 8000;
+	uint32_t ticks = (argc > 1) ? std::max(atoi(argv[1]), 1) : 300;
+
+	const char* scenes[3] = { "pile", "scatter", "clusters" };
+
+	std::cout << std::left << std::setw(10) << "scene" << std::setw(12) << "broadphase"
+		<< std::setw(14) << "pairs ms avg" << std::setw(14) << "pairs ms max"
+		<< std::setw(12) << "pairs avg" << "step ms avg" << std::endl;
+
+	for (uint32_t s = 0; s < 3; s++) {
+		for (uint32_t b = 0; b < BP_COUNT; b++) {
+			// The floor takes a handle too
+			if ((b == BP_AXIS_SWEEP && count + 1 > PHYSICS_SAP_HANDLES) ||
+				(b == BP_AXIS_SWEEP_32 && count + 1 > PHYSICS_SAP32_HANDLES)) {
+				std::cout << std::left << std::setw(10) << scenes[s] << std::setw(12) << broadphaseNames[b]
+					<< "skipped, more than " << (b == BP_AXIS_SWEEP ? PHYSICS_SAP_HANDLES : PHYSICS_SAP32_HANDLES)
+					<< " handles" << std::endl;
+				continue;
+			}
 
-	glm::mat4 proj = glm::ortho(0.0f, (float)g_width, (float)g_height, 0.0f);
-	glm::mat4 view = glm::mat4(1.0f);
-	glm::mat4 model =
-		glm::translate(glm::mat4(1.0f), glm::vec3(g_width * 0.5f, g_height * 0.5f, 0.0f)) *
-		glm::scale(glm::mat4(1.0f), glm::vec3(16.0f, 16.0f, 0.0f));
+			// Only the pairs are measured, not the contact events
+			physics.broadphaseType = (BroadphaseType)b;
+			physics.contactEvents = false;
+			physics.init();
 
+			btCollisionShape* floorShape = physics.createStaticPlaneShape(btVector3(0, 1, 0), 0);
+			btCollisionShape* boxShape = physics.createBoxShape(btVector3(1, 1, 1));
+			btCollisionShape* sphereShape = physics.createSphereShape(1.0f);
 
-	// Render HUB
+			physics.createRigid(0, btTransform(btQuaternion(0, 0, 0, 1)), floorShape, COL_GROUND, COL_EVERYTHING);
 
-	glDisable(GL_DEPTH_TEST);
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_ONE_MINUS_DST_COLOR, GL_ZERO);
+			std::vector<btCollisionShape*> shapes(count);
+			std::vector<btTransform> transforms(count);
+			std::vector<float> masses(count, 1.0f);
+			std::vector<btRigidBody*> bodies(count);
 
-	hubProgram.bind();
+			// Same layout for every broadphase
+			srand(1);
 
-	hubProgram.setMat4("proj", proj);
-	hubProgram.setMat4("view", view);
-	hubProgram.setMat4("model", model);
+			uint32_t side = (uint32_t)ceil(cbrt((double)count));
+			uint32_t clusterSide = (uint32_t)ceil(cbrt(count / 16.0));
 
-	crosshairTex.bind(GL_TEXTURE0);
+			for (uint32_t i = 0; i < count; i++) {
+				btVector3 position;
 
-	crosshairQuad.render(hubProgram);
+				if (s == 0) {
+					position.setValue(
+						((i % side) - side * 0.5f) * 2.0f,
+						1.0f + (i / (side * side)) * 2.0f,
+						(((i / side) % side) - side * 0.5f) * 2.0f);
+				}
+				else if (s == 1) {
+					position.setValue(
+						(rand() % 8000) * 0.1f - 400.0f,
+						(rand() % 2000) * 0.1f + 1.0f,
+						(rand() % 8000) * 0.1f - 400.0f);
+				}
+				else {
+					uint32_t cluster = i % 16;
+					uint32_t j = i / 16;
 
-	crosshairTex.unbind(GL_TEXTURE0);
-	
-	hubProgram.unbind();
+					position.setValue(
+						((cluster % 4) * 160.0f - 240.0f) + ((j % clusterSide) - clusterSide * 0.5f) * 2.0f,
+						1.0f + (j / (clusterSide * clusterSide)) * 2.0f,
+						((cluster / 4) * 160.0f - 240.0f) + (((j / clusterSide) % clusterSide) - clusterSide * 0.5f) * 2.0f);
+				}
 
-	glDisable(GL_BLEND);
-	glEnable(GL_DEPTH_TEST);
-}
+				shapes[i] = (i % 2 == 0) ? boxShape : sphereShape;
+				transforms[i] = btTransform(btQuaternion(0, 0, 0, 1), position);
+			}
 
-void app_release() {
-	debugLine.release();
+			physics.createRigidBodies(count, shapes.data(), transforms.data(), masses.data(), COL_OBJECT, COL_EVERYTHING, bodies.data());
 
-	crosshairQuad.release();
-	crosshairTex.release();
+			double pairMs = 0.0;
+			double pairMax = 0.0;
+			double stepMs = 0.0;
+			uint64_t pairs = 0;
 
-	for (int i = 0; i < sphereObjects.size(); i++) {
-		sphereObjects[i].release();
-	}
-	sphereObjects.clear();
+			for (uint32_t t = 0; t < ticks; t++) {
+				uint64_t start = SDL_GetPerformanceCounter();
+				physics.stepSimulation();
+				stepMs += util_milliseconds(start, SDL_GetPerformanceCounter());
 
-	for (int i = 0; i < boxObjects.size(); i++) {
-		boxObjects[i].release();
-	}
-	boxObjects.clear();
-	floorObject.release();
-	camera.release();
+				pairMs += physics.broadphaseTimer->ms;
+				pairMax = std::max(pairMax, physics.broadphaseTimer->ms);
+				pairs += physics.broadphase->getOverlappingPairCache()->getNumOverlappingPairs();
+			}
 
-	physics.release();
+			std::cout << std::left << std::setw(10) << scenes[s] << std::setw(12) << broadphaseNames[b]
+				<< std::setw(14) << (pairMs / ticks) << std::setw(14) << pairMax
+				<< std::setw(12) << (pairs / ticks) << (stepMs / ticks) << std::endl;
 
+			// The bodies are deleted along with the world
+			physics.release();
 
-	hubProgram.release();
-	hubFragmentShader.release();
-	hubVertexShader.release();
+			delete sphereShape;
+			delete boxShape;
+			delete floorShape;
+		}
+	}
 
-	program.release();
+	physics.broadphaseType = BP_DBVT;
+	physics.contactEvents = true;
 
-	fragmentShader.release();
-	vertexShader.release();
+	return 0;
 }